@@ -0,0 +1,80 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include "benchdaemon.h"
+
+GPid FcitxBenchDaemonStart(const char* path, const char* const* args)
+{
+    GPtrArray* argv = g_ptr_array_new();
+    GError* error = NULL;
+    GPid pid;
+    int out;
+    char line[16];
+    size_t len = 0;
+    ssize_t n;
+    gboolean ok;
+
+    g_ptr_array_add(argv, (gpointer) path);
+    while (args && *args)
+        g_ptr_array_add(argv, (gpointer) *args++);
+    g_ptr_array_add(argv, NULL);
+
+    ok = g_spawn_async_with_pipes(NULL, (gchar**) argv->pdata, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                                  NULL, NULL, &pid, NULL, &out, NULL, &error);
+    g_ptr_array_free(argv, TRUE);
+    if (!ok) {
+        fprintf(stderr, "cannot start %s: %s\n", path, error->message);
+        g_error_free(error);
+        return -1;
+    }
+
+    /* "ready\n" once the name is owned, EOF if it gave up */
+    while (len < sizeof(line) - 1) {
+        n = read(out, line + len, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || line[len] == '\n')
+            break;
+        len ++;
+    }
+    close(out);
+    line[len] = '\0';
+
+    if (strcmp(line, "ready") != 0) {
+        FcitxBenchDaemonStop(pid);
+        return -1;
+    }
+    return pid;
+}
+
+void FcitxBenchDaemonStop(GPid pid)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    g_spawn_close_pid(pid);
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
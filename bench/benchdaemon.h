@@ -0,0 +1,41 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_BENCH_DAEMON_H
+#define FCITX_BENCH_DAEMON_H
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * start the mock daemon with extra arguments, NULL terminated, and wait
+     * until it owns the fcitx name on the session bus; -1 if it did not
+     */
+    GPid FcitxBenchDaemonStart(const char* path, const char* const* args);
+    void FcitxBenchDaemonStop(GPid pid);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
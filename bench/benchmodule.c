@@ -0,0 +1,124 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <glib-object.h>
+#include <gmodule.h>
+
+#include "benchmodule.h"
+
+static GType _fcitx_type_bench_module = 0;
+
+static void fcitx_bench_module_class_init(FcitxBenchModuleClass* klass);
+static gboolean fcitx_bench_module_load(GTypeModule* type_module);
+static void fcitx_bench_module_unload(GTypeModule* type_module);
+
+GType
+fcitx_bench_module_get_type(void)
+{
+    static const GTypeInfo fcitx_bench_module_info = {
+        sizeof(FcitxBenchModuleClass),
+        (GBaseInitFunc) NULL,
+        (GBaseFinalizeFunc) NULL,
+        (GClassInitFunc) fcitx_bench_module_class_init,
+        (GClassFinalizeFunc) NULL,
+        NULL, /* klass data */
+        sizeof(FcitxBenchModule),
+        0,
+        (GInstanceInitFunc) NULL,
+        0
+    };
+
+    if (_fcitx_type_bench_module == 0)
+        _fcitx_type_bench_module = g_type_register_static(G_TYPE_TYPE_MODULE,
+                                                          "FcitxBenchModule",
+                                                          &fcitx_bench_module_info,
+                                                          (GTypeFlags)0);
+    return _fcitx_type_bench_module;
+}
+
+static void
+fcitx_bench_module_class_init(FcitxBenchModuleClass* klass)
+{
+    GTypeModuleClass* module_class = G_TYPE_MODULE_CLASS(klass);
+
+    module_class->load = fcitx_bench_module_load;
+    module_class->unload = fcitx_bench_module_unload;
+}
+
+static gboolean
+fcitx_bench_module_load(GTypeModule* type_module)
+{
+    FcitxBenchModule* module = (FcitxBenchModule*) type_module;
+
+    module->library = g_module_open(module->path, G_MODULE_BIND_LAZY | G_MODULE_BIND_LOCAL);
+    if (!module->library) {
+        fprintf(stderr, "%s\n", g_module_error());
+        return FALSE;
+    }
+
+    if (!g_module_symbol(module->library, "im_module_init", (gpointer*) &module->init)
+        || !g_module_symbol(module->library, "im_module_exit", (gpointer*) &module->exit)
+        || !g_module_symbol(module->library, "im_module_create", (gpointer*) &module->create)) {
+        fprintf(stderr, "%s\n", g_module_error());
+        g_module_close(module->library);
+        module->library = NULL;
+        return FALSE;
+    }
+
+    module->init(type_module);
+    return TRUE;
+}
+
+static void
+fcitx_bench_module_unload(GTypeModule* type_module)
+{
+    FcitxBenchModule* module = (FcitxBenchModule*) type_module;
+
+    module->exit();
+    g_module_close(module->library);
+    module->library = NULL;
+    module->init = NULL;
+    module->exit = NULL;
+    module->create = NULL;
+}
+
+FcitxBenchModule* FcitxBenchModuleLoad(const char* path)
+{
+    FcitxBenchModule* module = g_object_new(fcitx_bench_module_get_type(), NULL);
+
+    module->path = g_strdup(path);
+    g_type_module_set_name(G_TYPE_MODULE(module), path);
+
+    /* a type module is never finalized, a failed one is just left behind */
+    if (!g_type_module_use(G_TYPE_MODULE(module)))
+        return NULL;
+    return module;
+}
+
+ClutterIMContext* FcitxBenchModuleCreate(FcitxBenchModule* module)
+{
+    return module->create("fcitx");
+}
+
+gboolean FcitxBenchModuleSymbol(FcitxBenchModule* module, const char* name, gpointer* symbol)
+{
+    return g_module_symbol(module->library, name, symbol);
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,62 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_BENCH_MODULE_H
+#define FCITX_BENCH_MODULE_H
+
+#include <glib-object.h>
+#include <gmodule.h>
+#include <clutter-imcontext/clutter-imcontext.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * the built im-fcitx opened as a GTypeModule, the way clutter-imcontext
+     * opens input method modules, so its dependencies and init functions
+     * are paid for like in an application
+     */
+    typedef struct _FcitxBenchModule {
+        GTypeModule parent;
+        char* path;
+        GModule* library;
+        void (*init)(GTypeModule* module);
+        void (*exit)(void);
+        ClutterIMContext* (*create)(const gchar* context_id);
+    } FcitxBenchModule;
+
+    typedef struct _FcitxBenchModuleClass {
+        GTypeModuleClass parent;
+    } FcitxBenchModuleClass;
+
+    GType fcitx_bench_module_get_type(void);
+
+    /** open the module and run im_module_init, NULL on failure */
+    FcitxBenchModule* FcitxBenchModuleLoad(const char* path);
+    /** im_module_create("fcitx") */
+    ClutterIMContext* FcitxBenchModuleCreate(FcitxBenchModule* module);
+    gboolean FcitxBenchModuleSymbol(FcitxBenchModule* module, const char* name, gpointer* symbol);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,130 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "fcitx/fcitx.h"
+
+#include "benchstats.h"
+
+/*
+ * glibc keeps its allocator reachable under these names, so the process
+ * wide malloc family can be counted here and passed through; g_slice only
+ * shows up with G_SLICE=always-malloc, which the benchmarks set
+ */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t nmemb, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+
+static guint64 allocs = 0;
+
+static const char* opnames[FCITX_BENCH_OP_LAST] = {
+    "filter_keypress",
+    "key reply",
+    "commit_string",
+    "update_preedit",
+    "get_preedit_string",
+    "forward_key",
+    "FcitxIsHotKey"
+};
+
+FcitxBenchStat fcitx_bench_stats[FCITX_BENCH_OP_LAST];
+
+FCITX_EXPORT_API
+void* malloc(size_t size)
+{
+    allocs ++;
+    return __libc_malloc(size);
+}
+
+FCITX_EXPORT_API
+void* calloc(size_t nmemb, size_t size)
+{
+    allocs ++;
+    return __libc_calloc(nmemb, size);
+}
+
+FCITX_EXPORT_API
+void* realloc(void* ptr, size_t size)
+{
+    allocs ++;
+    return __libc_realloc(ptr, size);
+}
+
+FCITX_EXPORT_API
+void* memalign(size_t alignment, size_t size)
+{
+    allocs ++;
+    return __libc_memalign(alignment, size);
+}
+
+FCITX_EXPORT_API
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    allocs ++;
+    return __libc_memalign(alignment, size);
+}
+
+FCITX_EXPORT_API
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+    void* ptr;
+
+    allocs ++;
+    ptr = __libc_memalign(alignment, size);
+    if (!ptr)
+        return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+const char* FcitxBenchOpName(FcitxBenchOp op)
+{
+    return opnames[op];
+}
+
+void FcitxBenchStatsReset(void)
+{
+    memset(fcitx_bench_stats, 0, sizeof(fcitx_bench_stats));
+}
+
+guint64 FcitxBenchNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (guint64) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+guint64 FcitxBenchAllocCount(void)
+{
+    return allocs;
+}
+
+void FcitxBenchOpAdd(FcitxBenchOp op, guint64 start, guint64 before)
+{
+    guint64 now = FcitxBenchNow();
+
+    fcitx_bench_stats[op].calls ++;
+    fcitx_bench_stats[op].nsec += now - start;
+    fcitx_bench_stats[op].allocs += allocs - before;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,69 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_BENCH_STATS_H
+#define FCITX_BENCH_STATS_H
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /** context entry points, each timed from the outside */
+    typedef enum _FcitxBenchOp {
+        FCITX_BENCH_OP_FILTER_KEYPRESS,
+        FCITX_BENCH_OP_KEY_REPLY,
+        FCITX_BENCH_OP_COMMIT_STRING,
+        FCITX_BENCH_OP_UPDATE_PREEDIT,
+        FCITX_BENCH_OP_GET_PREEDIT_STRING,
+        FCITX_BENCH_OP_FORWARD_KEY,
+        FCITX_BENCH_OP_IS_HOTKEY,
+        FCITX_BENCH_OP_LAST
+    } FcitxBenchOp;
+
+    typedef struct _FcitxBenchStat {
+        guint64 calls;
+        guint64 nsec;
+        guint64 allocs;
+    } FcitxBenchStat;
+
+    extern FcitxBenchStat fcitx_bench_stats[FCITX_BENCH_OP_LAST];
+
+    const char* FcitxBenchOpName(FcitxBenchOp op);
+    void FcitxBenchStatsReset(void);
+    guint64 FcitxBenchNow(void);
+    /** malloc, calloc, realloc and memalign calls of the whole process */
+    guint64 FcitxBenchAllocCount(void);
+    void FcitxBenchOpAdd(FcitxBenchOp op, guint64 start, guint64 allocs);
+
+#define FCITX_BENCH_OP(op, stmt) \
+    do { \
+        guint64 _bench_allocs = FcitxBenchAllocCount(); \
+        guint64 _bench_start = FcitxBenchNow(); \
+        stmt; \
+        FcitxBenchOpAdd(op, _bench_start, _bench_allocs); \
+    } while (0)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
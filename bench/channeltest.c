@@ -0,0 +1,515 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+/**
+ * @file channeltest.c
+ *
+ * Types the corpora through the real client against the mock daemon and
+ * checks which way the keys went. When the daemon hands out a key channel
+ * every key has to use it, synchronous ones sent behind keys still waiting
+ * for their reply included; when it does not, everything has to fall back
+ * to ProcessKeyEvent. The daemon only handles a key that comes in corpus
+ * order, so an overtaking key shows up as a wrong answer or commit.
+ *
+ * With --check-allocations the daemon sends no signals and, once warmed
+ * up, sending keys and reading their replies off the channel must not
+ * call malloc at all.
+ *
+ * With --local-echo the keys go through a context with local echo on top
+ * of the client instead, and every preedit it shows has to be one the
+ * daemon sends for a key typed so far; a letter echoed twice is not.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clutter-imcontext/clutter-imcontext.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib.h>
+#include <fcitx/module/dbus/dbusstuff.h>
+#include <fcitx/module/ipc/ipc.h>
+#include "fcitx/fcitx.h"
+#include "fcitx/ime.h"
+#include "fcitx-utils/utils.h"
+
+#include "client.h"
+#include "fcitximcontext.h"
+#include "fakeim.h"
+#include "mockdaemon.h"
+#include "benchdaemon.h"
+#include "benchstats.h"
+
+/* ms to wait for the IC or for the replies of a pass */
+#define WAIT_TIMEOUT 5000
+/* keys in flight with --check-allocations, within the client's recycled calls */
+#define CHECK_BURST 16
+
+typedef struct _FcitxChannelTest {
+    FcitxIMClient* client;
+    const FcitxFakeIMCorpus* corpus;
+    boolean connected;
+    GString* committed;
+    /* answer per key of a pass, press and release, -2 while unanswered */
+    int* ret;
+    int expected;
+    int answered;
+    int lastanswered;
+    boolean ordered;
+    /* malloc calls while sending keys and dispatching replies */
+    guint64 allocs;
+    /* --local-echo: last key typed and the key whose preedit is shown */
+    ClutterIMContext* context;
+    int typed;
+    int shown;
+    char* badpreedit;
+    guint32 time;
+} FcitxChannelTest;
+
+static char* daemonpath = NULL;
+static gboolean no_key_channel = FALSE;
+static gboolean preedit_first = FALSE;
+static gboolean local_echo = FALSE;
+static gboolean check_allocations = FALSE;
+static int passes = 3;
+
+static GOptionEntry entries[] = {
+    { "daemon", 'D', 0, G_OPTION_ARG_STRING, &daemonpath, "The mock daemon to start", "PATH" },
+    { "no-key-channel", 0, 0, G_OPTION_ARG_NONE, &no_key_channel, "Run the daemon without OpenKeyChannel", NULL },
+    { "preedit-first", 0, 0, G_OPTION_ARG_NONE, &preedit_first, "Have the daemon send UpdatePreedit ahead of the reply", NULL },
+    { "local-echo", 'e', 0, G_OPTION_ARG_NONE, &local_echo, "Type through a context with local echo", NULL },
+    { "check-allocations", 0, 0, G_OPTION_ARG_NONE, &check_allocations, "Fail if the key channel path allocates", NULL },
+    { "passes", 'p', 0, G_OPTION_ARG_INT, &passes, "Passes over the corpus", "N" },
+    { NULL }
+};
+
+static FcitxChannelTest test;
+
+static void FcitxChannelTestConnect(FcitxIMClient* client, void* data);
+static void FcitxChannelTestDestroy(FcitxIMClient* client, void* data);
+static void FcitxChannelTestCommit(DBusGProxy* proxy, char* str, void* user_data);
+static void FcitxChannelTestReply(int ret, void* user_data);
+static boolean FcitxChannelTestConnected(void);
+static boolean FcitxChannelTestAnswered(void);
+static gboolean FcitxChannelTestExpire(gpointer user_data);
+static boolean FcitxChannelTestWait(boolean (*done)(void));
+static boolean FcitxChannelTestSync(uint32_t* counts);
+static void FcitxChannelTestSend(int index, uint32_t keyval, FcitxKeyEventType type, uint32_t t);
+static boolean FcitxChannelTestPass(int pass);
+static void FcitxChannelTestEchoCommit(ClutterIMContext* context, const char* str, gpointer user_data);
+static void FcitxChannelTestEchoPreedit(ClutterIMContext* context, gpointer user_data);
+static boolean FcitxChannelTestEchoReady(void);
+static boolean FcitxChannelTestEchoShown(void);
+static boolean FcitxChannelTestEchoPass(int pass);
+
+void FcitxChannelTestConnect(FcitxIMClient* client, void* data)
+{
+    test.connected = true;
+    FcitxIMClientConnectSignal(client, NULL, NULL, G_CALLBACK(FcitxChannelTestCommit), NULL, NULL, NULL, &test, NULL);
+    FcitxIMClientFocusIn(client);
+}
+
+void FcitxChannelTestDestroy(FcitxIMClient* client, void* data)
+{
+    test.connected = false;
+}
+
+void FcitxChannelTestCommit(DBusGProxy* proxy, char* str, void* user_data)
+{
+    g_string_append(test.committed, str);
+}
+
+void FcitxChannelTestReply(int ret, void* user_data)
+{
+    int index = GPOINTER_TO_INT(user_data);
+
+    if (index <= test.lastanswered)
+        test.ordered = false;
+    test.lastanswered = index;
+    test.ret[index] = ret;
+    test.answered ++;
+}
+
+boolean FcitxChannelTestConnected(void)
+{
+    return test.connected;
+}
+
+boolean FcitxChannelTestAnswered(void)
+{
+    return test.answered == test.expected;
+}
+
+gboolean FcitxChannelTestExpire(gpointer user_data)
+{
+    *(gboolean*) user_data = TRUE;
+    return FALSE;
+}
+
+boolean FcitxChannelTestWait(boolean (*done)(void))
+{
+    gboolean expired = FALSE;
+    guint timeout = g_timeout_add(WAIT_TIMEOUT, FcitxChannelTestExpire, &expired);
+
+    while (!done() && !expired) {
+        guint64 allocs = FcitxBenchAllocCount();
+        g_main_context_iteration(NULL, TRUE);
+        test.allocs += FcitxBenchAllocCount() - allocs;
+    }
+
+    if (expired)
+        return false;
+    g_source_remove(timeout);
+    return true;
+}
+
+/*
+ * a round trip on the client's own bus connection: whatever the daemon
+ * sent before, the OpenKeyChannel reply and commits included, has been
+ * dispatched when it returns
+ */
+boolean FcitxChannelTestSync(uint32_t* counts)
+{
+    DBusConnection* conn = dbus_bus_get(DBUS_BUS_SESSION, NULL);
+    char servicename[64];
+    DBusMessage* msg;
+    DBusMessage* reply = NULL;
+    uint32_t* array = NULL;
+    int len = 0;
+    boolean ok = false;
+
+    if (!conn)
+        return false;
+
+    snprintf(servicename, sizeof(servicename), "%s-%d", FCITX_DBUS_SERVICE, fcitx_utils_get_display_number());
+    msg = dbus_message_new_method_call(servicename, FCITX_IM_DBUS_PATH, FCITX_MOCK_DAEMON_INTERFACE, "GetKeyCounts");
+    if (msg) {
+        reply = dbus_connection_send_with_reply_and_block(conn, msg, WAIT_TIMEOUT, NULL);
+        dbus_message_unref(msg);
+    }
+
+    if (reply) {
+        if (dbus_message_get_args(reply, NULL, DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &array, &len, DBUS_TYPE_INVALID)
+            && len == FCITX_MOCK_COUNT_LAST) {
+            memcpy(counts, array, sizeof(uint32_t) * FCITX_MOCK_COUNT_LAST);
+            ok = true;
+        }
+        dbus_message_unref(reply);
+    }
+    dbus_connection_unref(conn);
+
+    while (g_main_context_iteration(NULL, FALSE));
+    return ok;
+}
+
+void FcitxChannelTestSend(int index, uint32_t keyval, FcitxKeyEventType type, uint32_t t)
+{
+    guint64 allocs = FcitxBenchAllocCount();
+
+    test.expected ++;
+    FcitxIMClientProcessKey(test.client, FcitxChannelTestReply, GINT_TO_POINTER(index), NULL,
+                            keyval, 0, 0, type, t);
+    test.allocs += FcitxBenchAllocCount() - allocs;
+}
+
+/*
+ * every key is pressed and released; from the second pass on every third
+ * press is synchronous while the keys before it may still be in flight,
+ * except with --check-allocations where no more than CHECK_BURST keys are
+ * in flight like behind a context
+ */
+boolean FcitxChannelTestPass(int pass)
+{
+    uint32_t counts[FCITX_MOCK_COUNT_LAST];
+    int i;
+
+    test.expected = 0;
+    test.answered = 0;
+    test.lastanswered = -1;
+    test.ordered = true;
+    test.allocs = 0;
+    g_string_truncate(test.committed, 0);
+
+    for (i = 0; i < test.corpus->n; i++) {
+        uint32_t keyval = test.corpus->keys[i].keyval;
+        test.ret[2 * i] = test.ret[2 * i + 1] = -2;
+
+        if (check_allocations && test.expected - test.answered >= CHECK_BURST
+            && !FcitxChannelTestWait(FcitxChannelTestAnswered))
+            break;
+
+        if (pass > 0 && i % 3 == 2 && !check_allocations)
+            test.ret[2 * i] = FcitxIMClientProcessKeySync(test.client, keyval, 0, 0, FCITX_PRESS_KEY, i);
+        else
+            FcitxChannelTestSend(2 * i, keyval, FCITX_PRESS_KEY, i);
+        FcitxChannelTestSend(2 * i + 1, keyval, FCITX_RELEASE_KEY, i);
+    }
+
+    if (!FcitxChannelTestWait(FcitxChannelTestAnswered)) {
+        fprintf(stderr, "channeltest: pass %d got %d of %d replies\n", pass, test.answered, test.expected);
+        return false;
+    }
+    if (!FcitxChannelTestSync(counts)) {
+        fprintf(stderr, "channeltest: no key counts from the daemon\n");
+        return false;
+    }
+
+    if (!test.ordered) {
+        fprintf(stderr, "channeltest: pass %d replies out of order\n", pass);
+        return false;
+    }
+    for (i = 0; i < 2 * test.corpus->n; i++) {
+        /* the daemon handles every press in corpus order and no release */
+        if (test.ret[i] != (i % 2 == 0 ? 1 : 0)) {
+            fprintf(stderr, "channeltest: pass %d key %d answered %d\n", pass, i, test.ret[i]);
+            return false;
+        }
+    }
+    /* the first pass fills the client's recycled calls */
+    if (check_allocations) {
+        if (pass > 0 && test.allocs != 0) {
+            fprintf(stderr, "channeltest: pass %d allocated %lu times for %d keys\n",
+                    pass, (unsigned long) test.allocs, test.expected);
+            return false;
+        }
+        return true;
+    }
+    if (strcmp(test.committed->str, test.corpus->committed) != 0) {
+        fprintf(stderr, "channeltest: pass %d committed \"%s\", expected \"%s\"\n",
+                pass, test.committed->str, test.corpus->committed);
+        return false;
+    }
+    return true;
+}
+
+void FcitxChannelTestEchoCommit(ClutterIMContext* context, const char* str, gpointer user_data)
+{
+    g_string_append(test.committed, str);
+}
+
+/*
+ * the echo may run ahead of the daemon but never past the keys typed, so
+ * what is shown is the preedit of a key from the last shown to the last
+ * typed one
+ */
+void FcitxChannelTestEchoPreedit(ClutterIMContext* context, gpointer user_data)
+{
+    char* str;
+    PangoAttrList* attrs;
+    int cursor;
+    int k;
+
+    clutter_im_context_get_preedit_string(context, &str, &attrs, &cursor);
+    for (k = test.typed; k >= test.shown; k--) {
+        if (strcmp(str, test.corpus->keys[k].preedit) == 0)
+            break;
+    }
+    if (k >= test.shown)
+        test.shown = k;
+    else if (!test.badpreedit)
+        test.badpreedit = g_strdup_printf("\"%s\" after key %d", str, test.typed);
+    g_free(str);
+    pango_attr_list_unref(attrs);
+}
+
+/* the context's IC exists, and its key channel unless the daemon has none */
+boolean FcitxChannelTestEchoReady(void)
+{
+    uint32_t counts[FCITX_MOCK_COUNT_LAST];
+    gint64 deadline = g_get_monotonic_time() + WAIT_TIMEOUT * 1000;
+
+    while (g_get_monotonic_time() < deadline) {
+        if (!FcitxChannelTestSync(counts))
+            return false;
+        if (counts[FCITX_MOCK_COUNT_IC_CREATED] > 0
+            && (no_key_channel || counts[FCITX_MOCK_COUNT_CHANNEL_OPENED] > 0))
+            return true;
+        g_usleep(1000);
+    }
+    return false;
+}
+
+boolean FcitxChannelTestEchoShown(void)
+{
+    return test.badpreedit
+        || (test.committed->len >= strlen(test.corpus->committed) && test.shown == test.corpus->n - 1);
+}
+
+/*
+ * keys are typed without waiting for their replies, only what already
+ * came in is dispatched in between, so letters get echoed ahead
+ */
+boolean FcitxChannelTestEchoPass(int pass)
+{
+    ClutterKeyEvent event;
+    int i;
+
+    test.typed = 0;
+    test.shown = 0;
+    g_string_truncate(test.committed, 0);
+
+    for (i = 0; i < test.corpus->n; i++) {
+        test.typed = i;
+        memset(&event, 0, sizeof(event));
+        event.keyval = test.corpus->keys[i].keyval;
+        event.type = CLUTTER_KEY_PRESS;
+        event.time = (test.time += 10);
+        clutter_im_context_filter_keypress(test.context, &event);
+        while (g_main_context_iteration(NULL, FALSE));
+
+        event.type = CLUTTER_KEY_RELEASE;
+        event.time = (test.time += 10);
+        event.modifier_state = 0;
+        clutter_im_context_filter_keypress(test.context, &event);
+        while (g_main_context_iteration(NULL, FALSE));
+    }
+
+    if (!FcitxChannelTestWait(FcitxChannelTestEchoShown)) {
+        fprintf(stderr, "channeltest: pass %d shows the preedit of key %d of %d\n", pass, test.shown, test.corpus->n);
+        return false;
+    }
+    if (test.badpreedit) {
+        fprintf(stderr, "channeltest: pass %d showed %s\n", pass, test.badpreedit);
+        return false;
+    }
+    if (strcmp(test.committed->str, test.corpus->committed) != 0) {
+        fprintf(stderr, "channeltest: pass %d committed \"%s\", expected \"%s\"\n",
+                pass, test.committed->str, test.corpus->committed);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* options;
+    GError* error = NULL;
+    FcitxFakeIMCorpus* corpus;
+    const char* daemonargs[4];
+    int nargs = 0;
+    uint32_t counts[FCITX_MOCK_COUNT_LAST];
+    uint32_t viachannel, viadbus, total;
+    boolean failed = false;
+    GPid daemon;
+    int pass;
+
+    /* before the first slice, so g_slice allocations are counted too */
+    g_setenv("G_SLICE", "always-malloc", TRUE);
+
+    options = g_option_context_new("- fcitx clutter key channel test");
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "channeltest: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+
+    if (!daemonpath || passes < 2) {
+        fprintf(stderr, "channeltest: --daemon is required and passes must be at least 2\n");
+        return 1;
+    }
+    if (check_allocations && (no_key_channel || local_echo)) {
+        fprintf(stderr, "channeltest: --check-allocations needs the key channel and no context\n");
+        return 1;
+    }
+
+    if (local_echo) {
+        /* the context reads its settings once, leave the user's file out */
+        g_setenv("XDG_CONFIG_HOME", "/nonexistent", TRUE);
+        g_setenv("FCITX_CLUTTER_MODE", "async", TRUE);
+        g_setenv("FCITX_CLUTTER_LOCAL_ECHO", "1", TRUE);
+        g_setenv("FCITX_CLUTTER_SHARED_IC", "0", TRUE);
+        g_setenv("FCITX_CLUTTER_CLIENT_SIDE_UI", "0", TRUE);
+        g_unsetenv("FCITX_CLUTTER_ASYNC");
+        g_unsetenv("FCITX_CLUTTER_KEY_QUEUE_DEPTH");
+    }
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    if (no_key_channel)
+        daemonargs[nargs++] = "--no-key-channel";
+    if (preedit_first)
+        daemonargs[nargs++] = "--preedit-first";
+    if (check_allocations)
+        daemonargs[nargs++] = "--no-signals";
+    daemonargs[nargs] = NULL;
+    daemon = FcitxBenchDaemonStart(daemonpath, daemonargs);
+    if (daemon < 0) {
+        fprintf(stderr, "channeltest: the mock daemon did not start\n");
+        return 1;
+    }
+
+    corpus = FcitxFakeIMCorpusNew("all");
+    memset(&test, 0, sizeof(test));
+    test.corpus = corpus;
+    test.committed = g_string_new(NULL);
+    test.ret = g_new(int, 2 * corpus->n);
+
+    if (local_echo) {
+        test.context = CLUTTER_IM_CONTEXT(fcitx_im_context_new());
+        g_signal_connect(test.context, "commit", G_CALLBACK(FcitxChannelTestEchoCommit), NULL);
+        g_signal_connect(test.context, "preedit-changed", G_CALLBACK(FcitxChannelTestEchoPreedit), NULL);
+        clutter_im_context_focus_in(test.context);
+        if (!FcitxChannelTestEchoReady()) {
+            fprintf(stderr, "channeltest: no IC\n");
+            failed = true;
+        }
+    } else if (!(test.client = FcitxIMClientOpen(FcitxChannelTestConnect, FcitxChannelTestDestroy, NULL))
+               || !FcitxChannelTestWait(FcitxChannelTestConnected)) {
+        fprintf(stderr, "channeltest: no IC\n");
+        failed = true;
+    } else if (!FcitxChannelTestSync(counts)) {
+        fprintf(stderr, "channeltest: no key counts from the daemon\n");
+        failed = true;
+    }
+
+    for (pass = 0; !failed && pass < passes; pass++)
+        failed = !(local_echo ? FcitxChannelTestEchoPass(pass) : FcitxChannelTestPass(pass));
+
+    if (!failed && FcitxChannelTestSync(counts)) {
+        total = 2 * corpus->n * passes;
+        viachannel = no_key_channel ? 0 : total;
+        viadbus = no_key_channel ? total : 0;
+        /* the context batches keys when there is no channel, count those alone */
+        if (counts[FCITX_MOCK_COUNT_CHANNEL_OPENED] != (no_key_channel ? 0 : 1)
+            || counts[FCITX_MOCK_COUNT_CHANNEL] != viachannel
+            || (!local_echo && counts[FCITX_MOCK_COUNT_PROCESS_KEY] != viadbus)
+            || counts[FCITX_MOCK_COUNT_INLINE] != 0
+            || (!local_echo && counts[FCITX_MOCK_COUNT_BATCH] != 0)) {
+            fprintf(stderr, "channeltest: %u keys, %u over %u channels, %u ProcessKeyEvent, expected %u and %u\n",
+                    total, counts[FCITX_MOCK_COUNT_CHANNEL], counts[FCITX_MOCK_COUNT_CHANNEL_OPENED],
+                    counts[FCITX_MOCK_COUNT_PROCESS_KEY], viachannel, viadbus);
+            failed = true;
+        }
+    }
+
+    if (test.context)
+        g_object_unref(test.context);
+    if (test.client)
+        FcitxIMClientClose(test.client);
+    FcitxBenchDaemonStop(daemon);
+    g_free(test.ret);
+    g_free(test.badpreedit);
+    g_string_free(test.committed, TRUE);
+    FcitxFakeIMCorpusFree(corpus);
+    return failed ? 1 : 0;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
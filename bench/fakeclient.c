@@ -0,0 +1,391 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <string.h>
+#include <glib.h>
+
+#include "fakeclient.h"
+#include "benchstats.h"
+
+#define FAKE_CLIENT_MAX_CALLS 64
+#define FAKE_CLIENT_MAX_BATCH 64
+
+typedef void (*FcitxFakeClientCommitSignal)(DBusGProxy* proxy, char* str, void* user_data);
+typedef void (*FcitxFakeClientPreeditSignal)(DBusGProxy* proxy, char* str, int cursor_pos, void* user_data);
+typedef void (*FcitxFakeClientForwardKeySignal)(DBusGProxy* proxy, guint keyval, guint state, gint type, void* user_data);
+
+typedef struct _FcitxFakeClientCall {
+    FcitxIMClientProcessKeyCallback callback;
+    FcitxIMClientProcessKeyBatchCallback batchcallback;
+    void* user_data;
+    GDestroyNotify notify;
+    int n;
+    FcitxIMClientKeyEvent keys[FAKE_CLIENT_MAX_BATCH];
+} FcitxFakeClientCall;
+
+struct _FcitxIMClient {
+    int id;
+    boolean valid;
+    boolean enabled;
+    FcitxIMClientConnectCallback connectcb;
+    FcitxIMClientDestroyCallback destroycb;
+    void* data;
+    guint connectidle;
+    FcitxHotkey triggerkey[2];
+    GCallback commitString;
+    GCallback forwardKey;
+    GCallback updatePreedit;
+    void* signaldata;
+    FcitxFakeIM im;
+    /* ring of the calls waiting for an answer */
+    FcitxFakeClientCall calls[FAKE_CLIENT_MAX_CALLS];
+    int head;
+    int ncalls;
+};
+
+static const FcitxFakeIMCorpus* fakecorpus = NULL;
+static FcitxIMClient* lastclient = NULL;
+static int lastid = 0;
+
+static gboolean FcitxFakeClientConnectIdle(gpointer user_data);
+static FcitxFakeClientCall* FcitxFakeClientPush(FcitxIMClient* client);
+static void FcitxFakeClientCommit(FcitxIMClient* client, const char* str);
+static void FcitxFakeClientUpdatePreedit(FcitxIMClient* client, const char* str);
+static void FcitxFakeClientReply(FcitxFakeClientCall* call, const int* ret);
+
+void FcitxFakeClientSetCorpus(const FcitxFakeIMCorpus* corpus)
+{
+    fakecorpus = corpus;
+}
+
+FcitxIMClient* FcitxFakeClientGetLast(void)
+{
+    return lastclient;
+}
+
+FcitxIMClient* FcitxIMClientOpen(FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data)
+{
+    return FcitxIMClientOpenForDisplay(NULL, connectcb, destroycb, data);
+}
+
+FcitxIMClient* FcitxIMClientOpenForDisplay(const char* display, FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data)
+{
+    FcitxIMClient* client = g_new0(FcitxIMClient, 1);
+
+    client->id = ++lastid;
+    client->enabled = true;
+    client->connectcb = connectcb;
+    client->destroycb = destroycb;
+    client->data = data;
+    /* the default trigger key of fcitx */
+    client->triggerkey[0].sym = FcitxKey_space;
+    client->triggerkey[0].state = FcitxKeyState_Ctrl;
+    FcitxFakeIMInit(&client->im, fakecorpus);
+    /* CreateICv2 is asynchronous, the caller has not stored the client yet */
+    client->connectidle = g_idle_add(FcitxFakeClientConnectIdle, client);
+
+    lastclient = client;
+    return client;
+}
+
+gboolean FcitxFakeClientConnectIdle(gpointer user_data)
+{
+    FcitxIMClient* client = (FcitxIMClient*) user_data;
+
+    client->connectidle = 0;
+    client->valid = true;
+    if (client->connectcb)
+        client->connectcb(client, client->data);
+    return FALSE;
+}
+
+void FcitxIMClientClose(FcitxIMClient* client)
+{
+    FcitxFakeClientCall* call;
+
+    if (client->connectidle)
+        g_source_remove(client->connectidle);
+
+    /* like cancelled pending calls, only the destroy notify runs */
+    while (client->ncalls) {
+        call = &client->calls[client->head];
+        client->head = (client->head + 1) % FAKE_CLIENT_MAX_CALLS;
+        client->ncalls --;
+        if (call->notify)
+            call->notify(call->user_data);
+    }
+
+    if (lastclient == client)
+        lastclient = NULL;
+    g_free(client);
+}
+
+boolean IsFcitxIMClientValid(FcitxIMClient* client)
+{
+    return client != NULL && client->valid;
+}
+
+boolean IsFcitxIMClientEnabled(FcitxIMClient* client)
+{
+    return client->enabled;
+}
+
+boolean FcitxIMClientIsProbingBatch(FcitxIMClient* client)
+{
+    return false;
+}
+
+boolean FcitxIMClientHasKeyChannel(FcitxIMClient* client)
+{
+    return false;
+}
+
+void FcitxIMClientSetEnabled(FcitxIMClient* client, boolean enable)
+{
+    client->enabled = enable;
+}
+
+void FcitxIMClientEnableIC(FcitxIMClient* client)
+{
+    client->enabled = true;
+}
+
+void FcitxIMClientCloseIC(FcitxIMClient* client)
+{
+    client->enabled = false;
+}
+
+void FcitxIMClientFocusIn(FcitxIMClient* client)
+{
+}
+
+void FcitxIMClientFocusOut(FcitxIMClient* client)
+{
+}
+
+void FcitxIMClientSetCursorLocation(FcitxIMClient* client, int x, int y)
+{
+}
+
+void FcitxIMClientSetInlineResult(FcitxIMClient* client, boolean inlineresult)
+{
+}
+
+void FcitxIMClientSetCapacity(FcitxIMClient* client, FcitxCapacityFlags flags)
+{
+}
+
+void FcitxIMClientReset(FcitxIMClient* client)
+{
+}
+
+FcitxFakeClientCall* FcitxFakeClientPush(FcitxIMClient* client)
+{
+    FcitxFakeClientCall* call;
+
+    if (client->ncalls == FAKE_CLIENT_MAX_CALLS)
+        g_error("fake client: more than %d calls in flight", FAKE_CLIENT_MAX_CALLS);
+
+    call = &client->calls[(client->head + client->ncalls) % FAKE_CLIENT_MAX_CALLS];
+    client->ncalls ++;
+    return call;
+}
+
+void FcitxIMClientProcessKey(FcitxIMClient* client, FcitxIMClientProcessKeyCallback callback, void* user_data, GDestroyNotify notify, uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
+{
+    FcitxFakeClientCall* call = FcitxFakeClientPush(client);
+
+    call->callback = callback;
+    call->batchcallback = NULL;
+    call->user_data = user_data;
+    call->notify = notify;
+    call->n = 1;
+    call->keys[0].keyval = keyval;
+    call->keys[0].keycode = keycode;
+    call->keys[0].state = state;
+    call->keys[0].type = type;
+    call->keys[0].time = t;
+}
+
+void FcitxIMClientProcessKeyBatch(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+                                  FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify)
+{
+    FcitxFakeClientCall* call;
+
+    if (n > FAKE_CLIENT_MAX_BATCH)
+        g_error("fake client: batch of %d keys", n);
+
+    call = FcitxFakeClientPush(client);
+    call->callback = NULL;
+    call->batchcallback = callback;
+    call->user_data = user_data;
+    call->notify = notify;
+    call->n = n;
+    memcpy(call->keys, keys, sizeof(FcitxIMClientKeyEvent) * n);
+}
+
+int FcitxIMClientProcessKeySync(FcitxIMClient* client,
+                                uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
+{
+    FcitxFakeIMResult result;
+
+    FcitxFakeIMFeed(&client->im, keyval, type == FCITX_RELEASE_KEY, &result);
+    if (result.commit)
+        FcitxFakeClientCommit(client, result.commit);
+    if (result.preedit)
+        FcitxFakeClientUpdatePreedit(client, result.preedit);
+    return result.ret;
+}
+
+boolean FcitxIMClientWaitKeyReplies(FcitxIMClient* client, int timeout)
+{
+    return FcitxFakeClientAnswer(client);
+}
+
+int FcitxIMClientProcessKeySyncInline(FcitxIMClient* client,
+                                      uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+                                      FcitxIMClientKeyResult* result)
+{
+    FcitxFakeIMResult im;
+
+    FcitxFakeIMFeed(&client->im, keyval, type == FCITX_RELEASE_KEY, &im);
+    result->ret = im.ret;
+    result->isinline = true;
+    result->commit = im.commit;
+    result->preedit = im.preedit;
+    result->cursor = im.preedit ? (int) strlen(im.preedit) : -1;
+    result->reply = NULL;
+    return im.ret;
+}
+
+void FcitxIMClientKeyResultClear(FcitxIMClientKeyResult* result)
+{
+    result->commit = NULL;
+    result->preedit = NULL;
+    result->reply = NULL;
+}
+
+void FcitxIMClientConnectSignal(FcitxIMClient* imclient,
+                                GCallback enableIM,
+                                GCallback closeIM,
+                                GCallback commitString,
+                                GCallback forwardKey,
+                                GCallback updatePreedit,
+                                GCallback updateClientSideUI,
+                                void* user_data,
+                                GClosureNotify freefunc
+                               )
+{
+    imclient->commitString = commitString;
+    imclient->forwardKey = forwardKey;
+    imclient->updatePreedit = updatePreedit;
+    imclient->signaldata = user_data;
+}
+
+void FcitxIMClientDisconnectSignal(FcitxIMClient* imclient, void* user_data)
+{
+    if (user_data && imclient->signaldata != user_data)
+        return;
+    imclient->commitString = NULL;
+    imclient->forwardKey = NULL;
+    imclient->updatePreedit = NULL;
+    imclient->signaldata = NULL;
+}
+
+FcitxHotkey* FcitxIMClientGetTriggerKey(FcitxIMClient* client)
+{
+    return client->triggerkey;
+}
+
+int FcitxIMClientGetID(FcitxIMClient* client)
+{
+    return client ? client->id : -1;
+}
+
+const char* FcitxIMClientGetProcessName(void)
+{
+    return g_get_prgname();
+}
+
+int FcitxFakeClientPendingCalls(FcitxIMClient* client)
+{
+    return client->ncalls;
+}
+
+void FcitxFakeClientCommit(FcitxIMClient* client, const char* str)
+{
+    if (client->commitString)
+        ((FcitxFakeClientCommitSignal) client->commitString)(NULL, (char*) str, client->signaldata);
+}
+
+void FcitxFakeClientUpdatePreedit(FcitxIMClient* client, const char* str)
+{
+    if (client->updatePreedit)
+        ((FcitxFakeClientPreeditSignal) client->updatePreedit)(NULL, (char*) str, strlen(str), client->signaldata);
+}
+
+void FcitxFakeClientForwardKey(FcitxIMClient* client, uint32_t keyval, uint32_t state, FcitxKeyEventType type)
+{
+    if (client->forwardKey)
+        FCITX_BENCH_OP(FCITX_BENCH_OP_FORWARD_KEY,
+                       ((FcitxFakeClientForwardKeySignal) client->forwardKey)(NULL, keyval, state, type, client->signaldata));
+}
+
+void FcitxFakeClientReply(FcitxFakeClientCall* call, const int* ret)
+{
+    if (call->batchcallback)
+        call->batchcallback(ret, call->n, call->user_data);
+    else
+        call->callback(ret[0], call->user_data);
+    if (call->notify)
+        call->notify(call->user_data);
+}
+
+boolean FcitxFakeClientAnswer(FcitxIMClient* client)
+{
+    FcitxFakeClientCall call;
+    FcitxFakeIMResult result;
+    const char* preedit = NULL;
+    int ret[FAKE_CLIENT_MAX_BATCH];
+    int i;
+
+    if (client->ncalls == 0)
+        return false;
+
+    /* the reply may queue the next keys, the slot is free by then */
+    call = client->calls[client->head];
+    client->head = (client->head + 1) % FAKE_CLIENT_MAX_CALLS;
+    client->ncalls --;
+
+    for (i = 0; i < call.n; i++) {
+        FcitxFakeIMFeed(&client->im, call.keys[i].keyval, call.keys[i].type == FCITX_RELEASE_KEY, &result);
+        ret[i] = result.ret;
+        if (result.commit)
+            FCITX_BENCH_OP(FCITX_BENCH_OP_COMMIT_STRING, FcitxFakeClientCommit(client, result.commit));
+        if (result.preedit)
+            preedit = result.preedit;
+    }
+
+    FCITX_BENCH_OP(FCITX_BENCH_OP_KEY_REPLY, FcitxFakeClientReply(&call, ret));
+
+    if (preedit && client->updatePreedit)
+        FCITX_BENCH_OP(FCITX_BENCH_OP_UPDATE_PREEDIT, FcitxFakeClientUpdatePreedit(client, preedit));
+    return true;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
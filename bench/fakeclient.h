@@ -0,0 +1,53 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_FAKE_CLIENT_H
+#define FCITX_FAKE_CLIENT_H
+
+#include "client.h"
+#include "fakeim.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * FcitxIMClient without DBus: the IC is created from an idle, keys sent
+     * asynchronously wait until FcitxFakeClientAnswer and the synchronous
+     * ones are answered inline, all by a FcitxFakeIM replaying the corpus
+     */
+    void FcitxFakeClientSetCorpus(const FcitxFakeIMCorpus* corpus);
+    /** the client opened last */
+    FcitxIMClient* FcitxFakeClientGetLast(void);
+    int FcitxFakeClientPendingCalls(FcitxIMClient* client);
+    /**
+     * answer the oldest call in the order of fcitx: CommitString while the
+     * key is processed, then the reply and then UpdatePreedit; each one is
+     * recorded as its own benchmark operation
+     */
+    boolean FcitxFakeClientAnswer(FcitxIMClient* client);
+    /** the daemon sending ForwardKey, timed as a benchmark operation */
+    void FcitxFakeClientForwardKey(FcitxIMClient* client, uint32_t keyval, uint32_t state, FcitxKeyEventType type);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
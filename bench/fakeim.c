@@ -0,0 +1,183 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <string.h>
+#include <glib.h>
+#include "fcitx-config/hotkey.h"
+
+#include "fakeim.h"
+
+typedef struct _FcitxFakeIMWord {
+    /* '\b' is BackSpace, the last key commits the word */
+    const char* keys;
+    const char* word;
+    /* preedit after each key but the last, '|' separated; NULL shows the keys */
+    const char* preedits;
+} FcitxFakeIMWord;
+
+static const FcitxFakeIMWord pinyinwords[] = {
+    { "nihao ", "你好", NULL },
+    { "jintian ", "今天", NULL },
+    { "tianqi ", "天气", NULL },
+    { "henhao ", "很好", NULL },
+    { "woxihuanchifan ", "我喜欢吃饭", NULL },
+    { "xi'an ", "西安", NULL },
+    { "pengyuo\b\bou ", "朋友", NULL },
+    { "shurufa ", "输入法", NULL },
+    { "zhonghuarenmingongheguo ", "中华人民共和国", NULL },
+    { "xiexie ", "谢谢", NULL },
+};
+
+static const FcitxFakeIMWord kanawords[] = {
+    { "watashi ", "私", "w|わ|わt|わた|わたs|わたsh|わたし" },
+    { "nihongo ", "日本語", "n|に|にh|にほ|にほn|にほんg|にほんご" },
+    { "kanji ", "漢字", "k|か|かn|かんj|かんじ" },
+    { "toukyou ", "東京", "t|と|とう|とうk|とうky|とうきょ|とうきょう" },
+    { "arigatou ", "ありがとう", "あ|あr|あり|ありg|ありが|ありがt|ありがと|ありがとう" },
+};
+
+static const FcitxFakeIMWord hangulwords[] = {
+    { "dkssudgktpdy ", "안녕하세요", "ㅇ|아|안|안ㄴ|안녀|안녕|안녕ㅎ|안녕하|안녕핫|안녕하세|안녕하셍|안녕하세요" },
+    { "gksrnr ", "한국", "ㅎ|하|한|한ㄱ|한구|한국" },
+    { "gksrmf ", "한글", "ㅎ|하|한|한ㄱ|한그|한글" },
+    { "tkfkd ", "사랑", "ㅅ|사|살|사라|사랑" },
+};
+
+static uint32_t FcitxFakeIMKeyval(char c);
+static void FcitxFakeIMCorpusAdd(GArray* keys, GString* committed, const FcitxFakeIMWord* words, int n);
+
+uint32_t FcitxFakeIMKeyval(char c)
+{
+    switch (c) {
+    case ' ':
+        return FcitxKey_space;
+    case '\b':
+        return FcitxKey_BackSpace;
+    case '\'':
+        return FcitxKey_apostrophe;
+    default:
+        return (uint32_t) c;
+    }
+}
+
+void FcitxFakeIMCorpusAdd(GArray* keys, GString* committed, const FcitxFakeIMWord* words, int n)
+{
+    GString* raw = g_string_new(NULL);
+    int i, j;
+
+    for (i = 0; i < n; i++) {
+        const char* k;
+        gchar** preedits = words[i].preedits ? g_strsplit(words[i].preedits, "|", -1) : NULL;
+
+        g_string_truncate(raw, 0);
+        for (k = words[i].keys, j = 0; *k; k++, j++) {
+            FcitxFakeIMKey key;
+            key.keyval = FcitxFakeIMKeyval(*k);
+            if (k[1] == '\0') {
+                key.preedit = g_strdup("");
+                key.commit = words[i].word;
+                g_string_append(committed, words[i].word);
+            } else {
+                if (*k == '\b')
+                    g_string_truncate(raw, raw->len ? raw->len - 1 : 0);
+                else
+                    g_string_append_c(raw, *k);
+                g_assert(!preedits || preedits[j]);
+                key.preedit = g_strdup(preedits ? preedits[j] : raw->str);
+                key.commit = NULL;
+            }
+            g_array_append_val(keys, key);
+        }
+        g_strfreev(preedits);
+    }
+    g_string_free(raw, TRUE);
+}
+
+FcitxFakeIMCorpus* FcitxFakeIMCorpusNew(const char* name)
+{
+    boolean all = strcmp(name, "all") == 0;
+    boolean known = false;
+    GArray* keys = g_array_new(FALSE, FALSE, sizeof(FcitxFakeIMKey));
+    GString* committed = g_string_new(NULL);
+    FcitxFakeIMCorpus* corpus;
+
+    if (all || strcmp(name, "pinyin") == 0) {
+        FcitxFakeIMCorpusAdd(keys, committed, pinyinwords, G_N_ELEMENTS(pinyinwords));
+        known = true;
+    }
+    if (all || strcmp(name, "kana") == 0) {
+        FcitxFakeIMCorpusAdd(keys, committed, kanawords, G_N_ELEMENTS(kanawords));
+        known = true;
+    }
+    if (all || strcmp(name, "hangul") == 0) {
+        FcitxFakeIMCorpusAdd(keys, committed, hangulwords, G_N_ELEMENTS(hangulwords));
+        known = true;
+    }
+
+    if (!known) {
+        g_array_free(keys, TRUE);
+        g_string_free(committed, TRUE);
+        return NULL;
+    }
+
+    corpus = g_new0(FcitxFakeIMCorpus, 1);
+    corpus->n = keys->len;
+    corpus->keys = (FcitxFakeIMKey*) g_array_free(keys, FALSE);
+    corpus->committed = g_string_free(committed, FALSE);
+    return corpus;
+}
+
+void FcitxFakeIMCorpusFree(FcitxFakeIMCorpus* corpus)
+{
+    int i;
+
+    for (i = 0; i < corpus->n; i++)
+        g_free(corpus->keys[i].preedit);
+    g_free(corpus->keys);
+    g_free(corpus->committed);
+    g_free(corpus);
+}
+
+void FcitxFakeIMInit(FcitxFakeIM* im, const FcitxFakeIMCorpus* corpus)
+{
+    im->corpus = corpus;
+    im->pos = 0;
+}
+
+void FcitxFakeIMFeed(FcitxFakeIM* im, uint32_t keyval, boolean release, FcitxFakeIMResult* result)
+{
+    const FcitxFakeIMKey* key;
+
+    result->ret = 0;
+    result->commit = NULL;
+    result->preedit = NULL;
+
+    if (!im->corpus)
+        return;
+
+    key = &im->corpus->keys[im->pos];
+    if (release || keyval != key->keyval)
+        return;
+
+    result->ret = 1;
+    result->commit = key->commit;
+    result->preedit = key->preedit;
+    im->pos = (im->pos + 1) % im->corpus->n;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
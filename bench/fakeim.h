@@ -0,0 +1,79 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_FAKE_IM_H
+#define FCITX_FAKE_IM_H
+
+#include <stdint.h>
+#include "fcitx-utils/utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * one key of a corpus with what the input method shows after it; the
+     * preedit is always sent, it is "" once a word got committed
+     */
+    typedef struct _FcitxFakeIMKey {
+        uint32_t keyval;
+        char* preedit;
+        const char* commit;
+    } FcitxFakeIMKey;
+
+    /**
+     * CJK typing sessions flattened to keys: pinyin with the raw letters in
+     * the preedit, romaji turned into kana and dubeolsik hangul composed in
+     * word mode; space commits every word
+     */
+    typedef struct _FcitxFakeIMCorpus {
+        FcitxFakeIMKey* keys;
+        int n;
+        /* all the words committed by one pass over the keys */
+        char* committed;
+    } FcitxFakeIMCorpus;
+
+    /**
+     * replays a corpus like a daemon would answer it: a press of the
+     * expected key is handled, anything else including releases is not
+     */
+    typedef struct _FcitxFakeIM {
+        const FcitxFakeIMCorpus* corpus;
+        int pos;
+    } FcitxFakeIM;
+
+    typedef struct _FcitxFakeIMResult {
+        int ret;
+        const char* commit;
+        const char* preedit;
+    } FcitxFakeIMResult;
+
+    /** name is pinyin, kana, hangul or all, NULL if unknown */
+    FcitxFakeIMCorpus* FcitxFakeIMCorpusNew(const char* name);
+    void FcitxFakeIMCorpusFree(FcitxFakeIMCorpus* corpus);
+
+    void FcitxFakeIMInit(FcitxFakeIM* im, const FcitxFakeIMCorpus* corpus);
+    void FcitxFakeIMFeed(FcitxFakeIM* im, uint32_t keyval, boolean release, FcitxFakeIMResult* result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
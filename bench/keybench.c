@@ -0,0 +1,283 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+/**
+ * @file keybench.c
+ *
+ * Types CJK corpora into a real FcitxIMContext backed by the fake client,
+ * no DBus and no X, and reports ns and heap allocations per context
+ * operation. Each run types the corpus the same way, only the times vary.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clutter-imcontext/clutter-imcontext.h>
+
+#include "fcitximcontext.h"
+#include "fakeclient.h"
+#include "benchstats.h"
+
+typedef struct _FcitxKeyBench {
+    ClutterIMContext* context;
+    const FcitxFakeIMCorpus* corpus;
+    GString* committed;
+    boolean preedit_changed;
+    guint32 time;
+    int burst;
+} FcitxKeyBench;
+
+static char* mode = "async";
+static gboolean local_echo = FALSE;
+static char* corpusname = "all";
+static int passes = 200;
+static int runs = 5;
+static int burst = 1;
+static gboolean check_allocations = FALSE;
+
+static GOptionEntry entries[] = {
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode, "Key processing mode: sync, async or hybrid", "MODE" },
+    { "local-echo", 'e', 0, G_OPTION_ARG_NONE, &local_echo, "Echo predicted letters before the reply", NULL },
+    { "corpus", 'c', 0, G_OPTION_ARG_STRING, &corpusname, "pinyin, kana, hangul or all", "NAME" },
+    { "passes", 'p', 0, G_OPTION_ARG_INT, &passes, "Passes over the corpus per run", "N" },
+    { "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Runs, ns/op is the best run", "N" },
+    { "burst", 'b', 0, G_OPTION_ARG_INT, &burst, "Keys typed before the daemon answers", "N" },
+    { "check-allocations", 0, 0, G_OPTION_ARG_NONE, &check_allocations, "Fail if filter_keypress, the key reply or update_preedit allocate", NULL },
+    { NULL }
+};
+
+static void FcitxKeyBenchCommitCb(ClutterIMContext* context, const char* str, gpointer user_data);
+static void FcitxKeyBenchPreeditChangedCb(ClutterIMContext* context, gpointer user_data);
+static void FcitxKeyBenchRepaint(FcitxKeyBench* bench);
+static void FcitxKeyBenchSend(FcitxKeyBench* bench, uint32_t keyval, ClutterEventType type);
+static void FcitxKeyBenchAnswer(FcitxKeyBench* bench);
+static void FcitxKeyBenchPass(FcitxKeyBench* bench);
+
+void FcitxKeyBenchCommitCb(ClutterIMContext* context, const char* str, gpointer user_data)
+{
+    FcitxKeyBench* bench = user_data;
+    g_string_append(bench->committed, str);
+}
+
+void FcitxKeyBenchPreeditChangedCb(ClutterIMContext* context, gpointer user_data)
+{
+    FcitxKeyBench* bench = user_data;
+    bench->preedit_changed = true;
+}
+
+/* what a text actor does once per change, whatever number of signals */
+void FcitxKeyBenchRepaint(FcitxKeyBench* bench)
+{
+    char* str;
+    PangoAttrList* attrs;
+    int cursor;
+
+    if (!bench->preedit_changed)
+        return;
+    bench->preedit_changed = false;
+
+    FCITX_BENCH_OP(FCITX_BENCH_OP_GET_PREEDIT_STRING,
+                   clutter_im_context_get_preedit_string(bench->context, &str, &attrs, &cursor));
+    g_free(str);
+    pango_attr_list_unref(attrs);
+}
+
+void FcitxKeyBenchSend(FcitxKeyBench* bench, uint32_t keyval, ClutterEventType type)
+{
+    ClutterKeyEvent event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    /* never the same time twice, that would be autorepeat */
+    bench->time += 10;
+    event.time = bench->time;
+    event.keyval = keyval;
+
+    FCITX_BENCH_OP(FCITX_BENCH_OP_FILTER_KEYPRESS,
+                   clutter_im_context_filter_keypress(bench->context, &event));
+    FcitxKeyBenchRepaint(bench);
+}
+
+void FcitxKeyBenchAnswer(FcitxKeyBench* bench)
+{
+    FcitxIMClient* client = FcitxFakeClientGetLast();
+
+    while (FcitxFakeClientAnswer(client))
+        FcitxKeyBenchRepaint(bench);
+}
+
+void FcitxKeyBenchPass(FcitxKeyBench* bench)
+{
+    FcitxIMClient* client = FcitxFakeClientGetLast();
+    ClutterKeyEvent event;
+    uint32_t keyval;
+    int i;
+
+    for (i = 0; i < bench->corpus->n; i++) {
+        keyval = bench->corpus->keys[i].keyval;
+        FcitxKeyBenchSend(bench, keyval, CLUTTER_KEY_PRESS);
+        FcitxKeyBenchSend(bench, keyval, CLUTTER_KEY_RELEASE);
+        if ((i + 1) % bench->burst == 0)
+            FcitxKeyBenchAnswer(bench);
+    }
+    FcitxKeyBenchAnswer(bench);
+
+    /* while fcitx is off filter_keypress is little more than FcitxIsHotKey */
+    FcitxIMClientSetEnabled(client, false);
+    memset(&event, 0, sizeof(event));
+    event.type = CLUTTER_KEY_PRESS;
+    for (i = 0; i < bench->corpus->n; i++) {
+        event.time = (bench->time += 10);
+        event.keyval = bench->corpus->keys[i].keyval;
+        FCITX_BENCH_OP(FCITX_BENCH_OP_IS_HOTKEY,
+                       clutter_im_context_filter_keypress(bench->context, &event));
+    }
+    FcitxIMClientSetEnabled(client, true);
+
+    /* the same keys handed back by the daemon, there is no stage to take them */
+    for (i = 0; i < bench->corpus->n; i++) {
+        keyval = bench->corpus->keys[i].keyval;
+        FcitxFakeClientForwardKey(client, keyval, 0, FCITX_PRESS_KEY);
+        FcitxFakeClientForwardKey(client, keyval, 0, FCITX_RELEASE_KEY);
+    }
+
+    if (strcmp(bench->committed->str, bench->corpus->committed) != 0) {
+        fprintf(stderr, "keybench: committed \"%s\", expected \"%s\"\n",
+                bench->committed->str, bench->corpus->committed);
+        exit(1);
+    }
+    g_string_truncate(bench->committed, 0);
+}
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* options;
+    GError* error = NULL;
+    FcitxFakeIMCorpus* corpus;
+    FcitxKeyBench bench;
+    FcitxBenchStat total[FCITX_BENCH_OP_LAST];
+    double best[FCITX_BENCH_OP_LAST];
+    static const FcitxBenchOp keypath[] = { FCITX_BENCH_OP_FILTER_KEYPRESS, FCITX_BENCH_OP_KEY_REPLY, FCITX_BENCH_OP_UPDATE_PREEDIT };
+    boolean failed = false;
+    int run, pass, op;
+    guint i;
+
+    /* before the first slice, so g_slice allocations are counted too */
+    g_setenv("G_SLICE", "always-malloc", TRUE);
+
+    options = g_option_context_new("- fcitx clutter context microbenchmark");
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "keybench: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+
+    if (passes < 1 || runs < 1 || burst < 1) {
+        fprintf(stderr, "keybench: passes, runs and burst must be positive\n");
+        return 1;
+    }
+
+    corpus = FcitxFakeIMCorpusNew(corpusname);
+    if (!corpus) {
+        fprintf(stderr, "keybench: unknown corpus %s\n", corpusname);
+        return 1;
+    }
+
+    /* the context reads its settings once, leave the user's file out */
+    g_setenv("XDG_CONFIG_HOME", "/nonexistent", TRUE);
+    g_setenv("FCITX_CLUTTER_MODE", mode, TRUE);
+    g_setenv("FCITX_CLUTTER_LOCAL_ECHO", local_echo ? "1" : "0", TRUE);
+    g_setenv("FCITX_CLUTTER_SHARED_IC", "0", TRUE);
+    g_setenv("FCITX_CLUTTER_CLIENT_SIDE_UI", "0", TRUE);
+    g_unsetenv("FCITX_CLUTTER_ASYNC");
+    g_unsetenv("FCITX_CLUTTER_KEY_QUEUE_DEPTH");
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    FcitxFakeClientSetCorpus(corpus);
+    memset(&bench, 0, sizeof(bench));
+    bench.corpus = corpus;
+    bench.burst = burst;
+    bench.committed = g_string_sized_new(strlen(corpus->committed) + 1);
+    bench.context = CLUTTER_IM_CONTEXT(fcitx_im_context_new());
+    g_signal_connect(bench.context, "commit", G_CALLBACK(FcitxKeyBenchCommitCb), &bench);
+    g_signal_connect(bench.context, "preedit-changed", G_CALLBACK(FcitxKeyBenchPreeditChangedCb), &bench);
+
+    /* the IC is created from an idle, clutter is never initialised */
+    while (g_main_context_iteration(NULL, FALSE));
+    clutter_im_context_focus_in(bench.context);
+    while (g_main_context_iteration(NULL, FALSE));
+
+    /* grows every buffer to the longest preedit once */
+    FcitxKeyBenchPass(&bench);
+
+    memset(total, 0, sizeof(total));
+    for (op = 0; op < FCITX_BENCH_OP_LAST; op++)
+        best[op] = -1;
+
+    for (run = 0; run < runs; run++) {
+        FcitxBenchStatsReset();
+        for (pass = 0; pass < passes; pass++)
+            FcitxKeyBenchPass(&bench);
+
+        for (op = 0; op < FCITX_BENCH_OP_LAST; op++) {
+            FcitxBenchStat* stat = &fcitx_bench_stats[op];
+            double nsec;
+            if (stat->calls == 0)
+                continue;
+            nsec = (double) stat->nsec / stat->calls;
+            if (best[op] < 0 || nsec < best[op])
+                best[op] = nsec;
+            total[op].calls += stat->calls;
+            total[op].allocs += stat->allocs;
+        }
+    }
+
+    printf("mode %s%s, corpus %s: %d keys, %d passes x %d runs, burst %d\n",
+           mode, local_echo ? " with local echo" : "", corpusname, corpus->n, passes, runs, burst);
+    printf("%-20s %12s %10s %10s\n", "operation", "calls/pass", "ns/op", "allocs/op");
+    for (op = 0; op < FCITX_BENCH_OP_LAST; op++) {
+        if (total[op].calls == 0)
+            continue;
+        printf("%-20s %12.1f %10.1f %10.2f\n",
+               FcitxBenchOpName(op),
+               (double) total[op].calls / ((double) passes * runs),
+               best[op],
+               (double) total[op].allocs / total[op].calls);
+    }
+
+    /* commit_string and get_preedit_string hand clutter strings it owns */
+    for (i = 0; check_allocations && i < G_N_ELEMENTS(keypath); i++) {
+        if (total[keypath[i]].allocs == 0)
+            continue;
+        fprintf(stderr, "keybench: %s allocates %.2f times per call\n",
+                FcitxBenchOpName(keypath[i]), (double) total[keypath[i]].allocs / total[keypath[i]].calls);
+        failed = true;
+    }
+
+    g_object_unref(bench.context);
+    g_string_free(bench.committed, TRUE);
+    FcitxFakeIMCorpusFree(corpus);
+    return failed ? 1 : 0;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,560 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+/**
+ * @file mockdaemon.c
+ *
+ * Stands in for fcitx on the session bus: it creates ICs and answers their
+ * keys from a corpus like fakeim does, over ProcessKeyEvent,
+ * ProcessKeyEventInline, ProcessKeyEventBatch and the OpenKeyChannel
+ * socket. Each extension can be turned off to look like an older daemon.
+ * "ready" is printed once the service name is owned; GetKeyCounts tells
+ * which way the keys came.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+#include <fcitx/module/dbus/dbusstuff.h>
+#include <fcitx/module/ipc/ipc.h>
+#include "fcitx/fcitx.h"
+#include "fcitx/ime.h"
+#include "fcitx-utils/utils.h"
+
+#include "fakeim.h"
+#include "mockdaemon.h"
+
+#define IC_PATH_MAX 64
+#define SERVICE_NAME_MAX 64
+/* usec the key channel reply lags behind the preedit with --preedit-first */
+#define PREEDIT_FIRST_DELAY 2000
+
+/* the records of the key channel, as client.c writes and reads them */
+typedef struct _FcitxMockKeyRequest {
+    uint32_t serial;
+    uint32_t keyval;
+    uint32_t keycode;
+    uint32_t state;
+    int32_t type;
+    uint32_t time;
+} FcitxMockKeyRequest;
+
+typedef struct _FcitxMockKeyReply {
+    uint32_t serial;
+    int32_t ret;
+} FcitxMockKeyReply;
+
+typedef struct _FcitxMockDaemon {
+    DBusConnection* conn;
+    FcitxFakeIMCorpus* corpus;
+    GHashTable* ics;
+    int nextid;
+    uint32_t counts[FCITX_MOCK_COUNT_LAST];
+} FcitxMockDaemon;
+
+typedef struct _FcitxMockIC {
+    FcitxMockDaemon* daemon;
+    int id;
+    char path[IC_PATH_MAX];
+    /* unique name of the client, signals only go there */
+    char* owner;
+    FcitxFakeIM im;
+    int keyfd;
+    guint keywatch;
+} FcitxMockIC;
+
+static int display = -1;
+static char* corpusname = "all";
+static gboolean no_key_channel = FALSE;
+static gboolean no_inline = FALSE;
+static gboolean no_batch = FALSE;
+static gboolean preedit_first = FALSE;
+static gboolean no_signals = FALSE;
+
+static GOptionEntry entries[] = {
+    { "display", 'd', 0, G_OPTION_ARG_INT, &display, "Serve this display instead of $DISPLAY", "N" },
+    { "corpus", 'c', 0, G_OPTION_ARG_STRING, &corpusname, "pinyin, kana, hangul or all", "NAME" },
+    { "no-key-channel", 0, 0, G_OPTION_ARG_NONE, &no_key_channel, "Do not know OpenKeyChannel", NULL },
+    { "no-inline", 0, 0, G_OPTION_ARG_NONE, &no_inline, "Do not know ProcessKeyEventInline", NULL },
+    { "no-batch", 0, 0, G_OPTION_ARG_NONE, &no_batch, "Do not know ProcessKeyEventBatch", NULL },
+    { "preedit-first", 0, 0, G_OPTION_ARG_NONE, &preedit_first, "Send UpdatePreedit ahead of the key channel reply", NULL },
+    { "no-signals", 0, 0, G_OPTION_ARG_NONE, &no_signals, "Answer keys without CommitString or UpdatePreedit", NULL },
+    { NULL }
+};
+
+static DBusHandlerResult FcitxMockDaemonFilter(DBusConnection* connection, DBusMessage* message, void* user_data);
+static void FcitxMockDaemonCreateIC(FcitxMockDaemon* daemon, DBusMessage* message);
+static void FcitxMockDaemonOwnerGone(FcitxMockDaemon* daemon, const char* owner);
+static void FcitxMockDaemonGetKeyCounts(FcitxMockDaemon* daemon, DBusMessage* message);
+static DBusHandlerResult FcitxMockICMethod(FcitxMockIC* ic, DBusMessage* message);
+static void FcitxMockICFree(void* data);
+static void FcitxMockICSignal(FcitxMockIC* ic, const char* member, int first_arg_type, ...);
+static int FcitxMockICFeed(FcitxMockIC* ic, uint32_t keyval, int32_t type, const char** preedit);
+static void FcitxMockICUpdatePreedit(FcitxMockIC* ic, const char* preedit);
+static void FcitxMockICProcessKey(FcitxMockIC* ic, DBusMessage* message);
+static void FcitxMockICProcessKeyInline(FcitxMockIC* ic, DBusMessage* message);
+static void FcitxMockICProcessKeyBatch(FcitxMockIC* ic, DBusMessage* message);
+static void FcitxMockICOpenKeyChannel(FcitxMockIC* ic, DBusMessage* message);
+static void FcitxMockICCloseKeyChannel(FcitxMockIC* ic);
+static gboolean FcitxMockICChannelWatch(GIOChannel* source, GIOCondition condition, gpointer user_data);
+static void FcitxMockSend(DBusConnection* conn, DBusMessage* message);
+
+void FcitxMockSend(DBusConnection* conn, DBusMessage* message)
+{
+    if (message) {
+        dbus_connection_send(conn, message, NULL);
+        dbus_message_unref(message);
+    }
+}
+
+DBusHandlerResult FcitxMockDaemonFilter(DBusConnection* connection, DBusMessage* message, void* user_data)
+{
+    FcitxMockDaemon* daemon = (FcitxMockDaemon*) user_data;
+    const char* path = dbus_message_get_path(message);
+    FcitxMockIC* ic;
+
+    if (dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged")) {
+        const char *name, *old_owner, *new_owner;
+        if (dbus_message_get_args(message, NULL,
+                                  DBUS_TYPE_STRING, &name,
+                                  DBUS_TYPE_STRING, &old_owner,
+                                  DBUS_TYPE_STRING, &new_owner,
+                                  DBUS_TYPE_INVALID)
+            && name[0] == ':' && new_owner[0] == '\0')
+            FcitxMockDaemonOwnerGone(daemon, name);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL || !path)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (dbus_message_is_method_call(message, FCITX_IM_DBUS_INTERFACE, "CreateICv2")
+        && strcmp(path, FCITX_IM_DBUS_PATH) == 0) {
+        FcitxMockDaemonCreateIC(daemon, message);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    if (dbus_message_is_method_call(message, FCITX_MOCK_DAEMON_INTERFACE, "GetKeyCounts")
+        && strcmp(path, FCITX_IM_DBUS_PATH) == 0) {
+        FcitxMockDaemonGetKeyCounts(daemon, message);
+        return DBUS_HANDLER_RESULT_HANDLED;
+    }
+
+    ic = g_hash_table_lookup(daemon->ics, path);
+    if (ic && dbus_message_has_interface(message, FCITX_IC_DBUS_INTERFACE)
+        && g_strcmp0(dbus_message_get_sender(message), ic->owner) == 0)
+        return FcitxMockICMethod(ic, message);
+
+    /* libdbus answers UnknownMethod, like an older fcitx would */
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+void FcitxMockDaemonCreateIC(FcitxMockDaemon* daemon, DBusMessage* message)
+{
+    FcitxMockIC* ic = g_slice_new0(FcitxMockIC);
+    dbus_bool_t enable = TRUE;
+    uint32_t nokey = 0;
+
+    ic->daemon = daemon;
+    ic->id = daemon->nextid++;
+    snprintf(ic->path, IC_PATH_MAX, FCITX_IC_DBUS_PATH, ic->id);
+    ic->owner = g_strdup(dbus_message_get_sender(message));
+    ic->keyfd = -1;
+    FcitxFakeIMInit(&ic->im, daemon->corpus);
+    g_hash_table_insert(daemon->ics, ic->path, ic);
+    daemon->counts[FCITX_MOCK_COUNT_IC_CREATED] ++;
+
+    /* enabled right away and no trigger keys, every key comes here */
+    DBusMessage* reply = dbus_message_new_method_return(message);
+    if (reply && !dbus_message_append_args(reply,
+                                           DBUS_TYPE_INT32, &ic->id,
+                                           DBUS_TYPE_BOOLEAN, &enable,
+                                           DBUS_TYPE_UINT32, &nokey,
+                                           DBUS_TYPE_UINT32, &nokey,
+                                           DBUS_TYPE_UINT32, &nokey,
+                                           DBUS_TYPE_UINT32, &nokey,
+                                           DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        reply = NULL;
+    }
+    FcitxMockSend(daemon->conn, reply);
+}
+
+void FcitxMockDaemonOwnerGone(FcitxMockDaemon* daemon, const char* owner)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, daemon->ics);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        if (strcmp(((FcitxMockIC*) value)->owner, owner) == 0)
+            g_hash_table_iter_remove(&iter);
+    }
+}
+
+void FcitxMockDaemonGetKeyCounts(FcitxMockDaemon* daemon, DBusMessage* message)
+{
+    DBusMessage* reply = dbus_message_new_method_return(message);
+    uint32_t* counts = daemon->counts;
+
+    if (reply)
+        dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_UINT32, &counts, FCITX_MOCK_COUNT_LAST, DBUS_TYPE_INVALID);
+    FcitxMockSend(daemon->conn, reply);
+}
+
+DBusHandlerResult FcitxMockICMethod(FcitxMockIC* ic, DBusMessage* message)
+{
+    const char* member = dbus_message_get_member(message);
+
+    if (strcmp(member, "ProcessKeyEvent") == 0) {
+        FcitxMockICProcessKey(ic, message);
+    } else if (strcmp(member, "ProcessKeyEventInline") == 0 && !no_inline) {
+        FcitxMockICProcessKeyInline(ic, message);
+    } else if (strcmp(member, "ProcessKeyEventBatch") == 0 && !no_batch) {
+        FcitxMockICProcessKeyBatch(ic, message);
+    } else if (strcmp(member, "OpenKeyChannel") == 0 && !no_key_channel) {
+        FcitxMockICOpenKeyChannel(ic, message);
+    } else if (strcmp(member, "DestroyIC") == 0) {
+        if (!dbus_message_get_no_reply(message))
+            FcitxMockSend(ic->daemon->conn, dbus_message_new_method_return(message));
+        g_hash_table_remove(ic->daemon->ics, ic->path);
+    } else if (strcmp(member, "FocusIn") == 0
+               || strcmp(member, "FocusOut") == 0
+               || strcmp(member, "Reset") == 0
+               || strcmp(member, "SetCursorLocation") == 0
+               || strcmp(member, "SetCapacity") == 0
+               || strcmp(member, "EnableIC") == 0
+               || strcmp(member, "CloseIC") == 0) {
+        /* the corpus does not depend on any of them */
+        if (!dbus_message_get_no_reply(message))
+            FcitxMockSend(ic->daemon->conn, dbus_message_new_method_return(message));
+    } else {
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+void FcitxMockICFree(void* data)
+{
+    FcitxMockIC* ic = (FcitxMockIC*) data;
+    FcitxMockICCloseKeyChannel(ic);
+    g_free(ic->owner);
+    g_slice_free(FcitxMockIC, ic);
+}
+
+void FcitxMockICSignal(FcitxMockIC* ic, const char* member, int first_arg_type, ...)
+{
+    DBusMessage* msg = dbus_message_new_signal(ic->path, FCITX_IC_DBUS_INTERFACE, member);
+    va_list args;
+
+    if (!msg)
+        return;
+
+    dbus_message_set_destination(msg, ic->owner);
+    va_start(args, first_arg_type);
+    if (!dbus_message_append_args_valist(msg, first_arg_type, args)) {
+        dbus_message_unref(msg);
+        msg = NULL;
+    }
+    va_end(args);
+    FcitxMockSend(ic->daemon->conn, msg);
+}
+
+/* like fcitx, the commit goes out while the key is processed, before the reply */
+int FcitxMockICFeed(FcitxMockIC* ic, uint32_t keyval, int32_t type, const char** preedit)
+{
+    FcitxFakeIMResult result;
+
+    FcitxFakeIMFeed(&ic->im, keyval, type == FCITX_RELEASE_KEY, &result);
+    if (result.commit && !no_signals)
+        FcitxMockICSignal(ic, "CommitString", DBUS_TYPE_STRING, &result.commit, DBUS_TYPE_INVALID);
+    if (result.preedit)
+        *preedit = result.preedit;
+    return result.ret;
+}
+
+/* and the preedit once the UI got updated, after the reply */
+void FcitxMockICUpdatePreedit(FcitxMockIC* ic, const char* preedit)
+{
+    int32_t cursor;
+
+    if (!preedit || no_signals)
+        return;
+    cursor = strlen(preedit);
+    FcitxMockICSignal(ic, "UpdatePreedit", DBUS_TYPE_STRING, &preedit, DBUS_TYPE_INT32, &cursor, DBUS_TYPE_INVALID);
+}
+
+void FcitxMockICProcessKey(FcitxMockIC* ic, DBusMessage* message)
+{
+    uint32_t keyval, keycode, state, t;
+    int32_t type, ret;
+    const char* preedit = NULL;
+    DBusMessage* reply;
+
+    if (!dbus_message_get_args(message, NULL,
+                               DBUS_TYPE_UINT32, &keyval,
+                               DBUS_TYPE_UINT32, &keycode,
+                               DBUS_TYPE_UINT32, &state,
+                               DBUS_TYPE_INT32, &type,
+                               DBUS_TYPE_UINT32, &t,
+                               DBUS_TYPE_INVALID)) {
+        FcitxMockSend(ic->daemon->conn, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, NULL));
+        return;
+    }
+
+    ic->daemon->counts[FCITX_MOCK_COUNT_PROCESS_KEY] ++;
+    ret = FcitxMockICFeed(ic, keyval, type, &preedit);
+    reply = dbus_message_new_method_return(message);
+    if (reply)
+        dbus_message_append_args(reply, DBUS_TYPE_INT32, &ret, DBUS_TYPE_INVALID);
+    FcitxMockSend(ic->daemon->conn, reply);
+    FcitxMockICUpdatePreedit(ic, preedit);
+}
+
+/* everything in the reply and no signals */
+void FcitxMockICProcessKeyInline(FcitxMockIC* ic, DBusMessage* message)
+{
+    uint32_t keyval, keycode, state, t;
+    int32_t type;
+    FcitxFakeIMResult result;
+    const char* commit;
+    const char* preedit;
+    int32_t cursor;
+    DBusMessage* reply;
+
+    if (!dbus_message_get_args(message, NULL,
+                               DBUS_TYPE_UINT32, &keyval,
+                               DBUS_TYPE_UINT32, &keycode,
+                               DBUS_TYPE_UINT32, &state,
+                               DBUS_TYPE_INT32, &type,
+                               DBUS_TYPE_UINT32, &t,
+                               DBUS_TYPE_INVALID)) {
+        FcitxMockSend(ic->daemon->conn, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, NULL));
+        return;
+    }
+
+    ic->daemon->counts[FCITX_MOCK_COUNT_INLINE] ++;
+    FcitxFakeIMFeed(&ic->im, keyval, type == FCITX_RELEASE_KEY, &result);
+    commit = result.commit ? result.commit : "";
+    preedit = result.preedit ? result.preedit : "";
+    cursor = result.preedit ? (int32_t) strlen(result.preedit) : -1;
+
+    reply = dbus_message_new_method_return(message);
+    if (reply)
+        dbus_message_append_args(reply,
+                                 DBUS_TYPE_INT32, &result.ret,
+                                 DBUS_TYPE_STRING, &commit,
+                                 DBUS_TYPE_STRING, &preedit,
+                                 DBUS_TYPE_INT32, &cursor,
+                                 DBUS_TYPE_INVALID);
+    FcitxMockSend(ic->daemon->conn, reply);
+}
+
+void FcitxMockICProcessKeyBatch(FcitxMockIC* ic, DBusMessage* message)
+{
+    DBusMessageIter args, array, entry;
+    GArray* ret = g_array_new(FALSE, FALSE, sizeof(int32_t));
+    const char* preedit = NULL;
+    DBusMessage* reply;
+
+    if (!dbus_message_iter_init(message, &args)
+        || strcmp(dbus_message_iter_get_signature(&args), "a(uuuiu)") != 0) {
+        FcitxMockSend(ic->daemon->conn, dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, NULL));
+        g_array_free(ret, TRUE);
+        return;
+    }
+
+    dbus_message_iter_recurse(&args, &array);
+    while (dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT) {
+        uint32_t keyval;
+        int32_t type, r;
+
+        dbus_message_iter_recurse(&array, &entry);
+        dbus_message_iter_get_basic(&entry, &keyval);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_next(&entry);
+        dbus_message_iter_get_basic(&entry, &type);
+
+        ic->daemon->counts[FCITX_MOCK_COUNT_BATCH] ++;
+        r = FcitxMockICFeed(ic, keyval, type, &preedit);
+        g_array_append_val(ret, r);
+        dbus_message_iter_next(&array);
+    }
+
+    reply = dbus_message_new_method_return(message);
+    if (reply) {
+        int32_t* data = (int32_t*) ret->data;
+        dbus_message_append_args(reply, DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &data, (int) ret->len, DBUS_TYPE_INVALID);
+    }
+    FcitxMockSend(ic->daemon->conn, reply);
+    FcitxMockICUpdatePreedit(ic, preedit);
+    g_array_free(ret, TRUE);
+}
+
+void FcitxMockICOpenKeyChannel(FcitxMockIC* ic, DBusMessage* message)
+{
+    DBusMessage* reply;
+    GIOChannel* channel;
+    int fds[2];
+
+    if (ic->keyfd >= 0 || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+        FcitxMockSend(ic->daemon->conn, dbus_message_new_error(message, DBUS_ERROR_FAILED, "no key channel"));
+        return;
+    }
+
+    /* libdbus passes a duplicate, the client end is not needed here */
+    reply = dbus_message_new_method_return(message);
+    if (reply)
+        dbus_message_append_args(reply, DBUS_TYPE_UNIX_FD, &fds[1], DBUS_TYPE_INVALID);
+    FcitxMockSend(ic->daemon->conn, reply);
+    close(fds[1]);
+
+    ic->daemon->counts[FCITX_MOCK_COUNT_CHANNEL_OPENED] ++;
+    ic->keyfd = fds[0];
+    channel = g_io_channel_unix_new(ic->keyfd);
+    ic->keywatch = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR, FcitxMockICChannelWatch, ic);
+    g_io_channel_unref(channel);
+}
+
+void FcitxMockICCloseKeyChannel(FcitxMockIC* ic)
+{
+    if (ic->keywatch) {
+        g_source_remove(ic->keywatch);
+        ic->keywatch = 0;
+    }
+    if (ic->keyfd >= 0) {
+        close(ic->keyfd);
+        ic->keyfd = -1;
+    }
+}
+
+gboolean FcitxMockICChannelWatch(GIOChannel* source, GIOCondition condition, gpointer user_data)
+{
+    FcitxMockIC* ic = (FcitxMockIC*) user_data;
+    FcitxMockKeyRequest req;
+    FcitxMockKeyReply reply;
+    const char* preedit = NULL;
+    ssize_t n;
+
+    if (condition & G_IO_IN) {
+        do {
+            n = recv(ic->keyfd, &req, sizeof(req), MSG_DONTWAIT);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0 && errno == EAGAIN)
+            return TRUE;
+
+        if (n == sizeof(req)) {
+            ic->daemon->counts[FCITX_MOCK_COUNT_CHANNEL] ++;
+            reply.serial = req.serial;
+            reply.ret = FcitxMockICFeed(ic, req.keyval, req.type, &preedit);
+            /*
+             * the commit is on its way to the bus before the reply; with
+             * --preedit-first the preedit is too and the reply comes late,
+             * like from a daemon serving the socket on a thread of its own
+             */
+            if (preedit_first)
+                FcitxMockICUpdatePreedit(ic, preedit);
+            dbus_connection_flush(ic->daemon->conn);
+            if (preedit_first)
+                g_usleep(PREEDIT_FIRST_DELAY);
+            if (send(ic->keyfd, &reply, sizeof(reply), MSG_NOSIGNAL) == sizeof(reply)) {
+                if (!preedit_first)
+                    FcitxMockICUpdatePreedit(ic, preedit);
+                return TRUE;
+            }
+        }
+    }
+
+    /* the client closed it or sent garbage, the IC keeps working over DBus */
+    ic->keywatch = 0;
+    FcitxMockICCloseKeyChannel(ic);
+    return FALSE;
+}
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* options;
+    GError* error = NULL;
+    DBusError err;
+    FcitxMockDaemon daemon;
+    char servicename[SERVICE_NAME_MAX];
+    GMainLoop* loop;
+
+    options = g_option_context_new("- stand-in fcitx daemon for the benchmarks");
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "mockdaemon: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+
+    memset(&daemon, 0, sizeof(daemon));
+    daemon.corpus = FcitxFakeIMCorpusNew(corpusname);
+    if (!daemon.corpus) {
+        fprintf(stderr, "mockdaemon: unknown corpus %s\n", corpusname);
+        return 1;
+    }
+    daemon.ics = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, FcitxMockICFree);
+
+    dbus_error_init(&err);
+    daemon.conn = dbus_bus_get(DBUS_BUS_SESSION, &err);
+    if (!daemon.conn) {
+        fprintf(stderr, "mockdaemon: %s\n", err.message);
+        dbus_error_free(&err);
+        return 1;
+    }
+    dbus_connection_setup_with_g_main(daemon.conn, NULL);
+
+    /* a real fcitx on this bus and display keeps its name */
+    snprintf(servicename, SERVICE_NAME_MAX, "%s-%d", FCITX_DBUS_SERVICE,
+             display >= 0 ? display : fcitx_utils_get_display_number());
+    if (dbus_bus_request_name(daemon.conn, servicename, DBUS_NAME_FLAG_DO_NOT_QUEUE, &err)
+        != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "mockdaemon: cannot own %s%s%s\n", servicename,
+                dbus_error_is_set(&err) ? ": " : "", dbus_error_is_set(&err) ? err.message : "");
+        dbus_error_free(&err);
+        return 1;
+    }
+
+    dbus_connection_add_filter(daemon.conn, FcitxMockDaemonFilter, &daemon, NULL);
+    /* ICs die with their client */
+    dbus_bus_add_match(daemon.conn,
+                       "type='signal',"
+                       "sender='" DBUS_SERVICE_DBUS "',"
+                       "interface='" DBUS_INTERFACE_DBUS "',"
+                       "member='NameOwnerChanged'",
+                       NULL);
+
+    printf("ready\n");
+    fflush(stdout);
+
+    /* libdbus exits the process when the bus goes away */
+    loop = g_main_loop_new(NULL, FALSE);
+    g_main_loop_run(loop);
+    return 0;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
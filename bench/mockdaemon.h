@@ -0,0 +1,41 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_MOCK_DAEMON_H
+#define FCITX_MOCK_DAEMON_H
+
+/**
+ * besides the fcitx interfaces the mock daemon answers GetKeyCounts on
+ * /inputmethod with this interface: an array of uint32 indexed by
+ * FcitxMockCount, summed over all ICs
+ */
+#define FCITX_MOCK_DAEMON_INTERFACE "org.fcitx.Fcitx.MockDaemon"
+
+typedef enum _FcitxMockCount {
+    FCITX_MOCK_COUNT_PROCESS_KEY,
+    FCITX_MOCK_COUNT_INLINE,
+    FCITX_MOCK_COUNT_BATCH,
+    FCITX_MOCK_COUNT_CHANNEL,
+    FCITX_MOCK_COUNT_CHANNEL_OPENED,
+    FCITX_MOCK_COUNT_IC_CREATED,
+    FCITX_MOCK_COUNT_LAST
+} FcitxMockCount;
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,87 @@
+# make pgo: builds im-fcitx three times below WORK_DIR and compares them
+#   baseline/   plain build, measured
+#   optimized/  PGO_MODE=generate, trained with the workload against the
+#               mock daemon, then reconfigured in place with PGO_MODE=use
+#               and ENABLE_LTO=On, so gcc finds the profiles of its objects,
+#               and measured
+# run with cmake -P, every variable below is set by the pgo target
+
+foreach(var SOURCE_DIR WORK_DIR GENERATOR C_COMPILER MODULE_NAME WORKLOAD DAEMON DBUS_RUN_SESSION)
+    if(NOT DEFINED ${var})
+        message(FATAL_ERROR "pgo.cmake needs -D${var}=")
+    endif()
+endforeach()
+
+set(PGO_MODES sync async echo)
+set(PROFILE_DIR "${WORK_DIR}/profile")
+
+# benchmarks on for the startup phases the workload waits on, only
+# im-fcitx is built
+function(pgo_build dir)
+    file(MAKE_DIRECTORY "${dir}")
+    execute_process(
+        COMMAND ${CMAKE_COMMAND} -G "${GENERATOR}"
+                -DCMAKE_C_COMPILER=${C_COMPILER}
+                -DCMAKE_BUILD_TYPE=${BUILD_TYPE}
+                -DENABLE_BENCHMARKS=On
+                -DPGO_PROFILE_DIR=${PROFILE_DIR}
+                ${ARGN} "${SOURCE_DIR}"
+        WORKING_DIRECTORY "${dir}"
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "configuring ${dir} failed")
+    endif()
+    execute_process(
+        COMMAND ${CMAKE_COMMAND} --build "${dir}" --target im-fcitx
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0)
+        message(FATAL_ERROR "building ${dir} failed")
+    endif()
+endfunction()
+
+# ns/key of the best run, each invocation on a session bus of its own
+function(pgo_workload module mode var)
+    if(mode STREQUAL "echo")
+        set(args --mode async --local-echo)
+    else()
+        set(args --mode ${mode})
+    endif()
+    execute_process(
+        COMMAND ${DBUS_RUN_SESSION} -- "${WORKLOAD}" --module "${module}" --daemon "${DAEMON}"
+                ${args} ${ARGN}
+        OUTPUT_VARIABLE out
+        ERROR_VARIABLE err
+        RESULT_VARIABLE result)
+    if(NOT result EQUAL 0 OR NOT out MATCHES "ns/key ([0-9]+)")
+        message(FATAL_ERROR "workload failed with ${module}, mode ${mode}:\n${out}${err}")
+    endif()
+    set(${var} ${CMAKE_MATCH_1} PARENT_SCOPE)
+endfunction()
+
+message(STATUS "pgo: baseline build")
+pgo_build("${WORK_DIR}/baseline" -DPGO_MODE= -DENABLE_LTO=Off)
+foreach(mode ${PGO_MODES})
+    pgo_workload("${WORK_DIR}/baseline/src/${MODULE_NAME}" ${mode} base_${mode})
+endforeach()
+
+# stale counters from an older tree would be merged into the new ones
+message(STATUS "pgo: instrumented build")
+file(REMOVE_RECURSE "${PROFILE_DIR}")
+pgo_build("${WORK_DIR}/optimized" -DPGO_MODE=generate -DENABLE_LTO=Off)
+
+message(STATUS "pgo: training")
+foreach(mode ${PGO_MODES})
+    pgo_workload("${WORK_DIR}/optimized/src/${MODULE_NAME}" ${mode} ignored --passes 5 --runs 1)
+endforeach()
+
+message(STATUS "pgo: rebuild with profiles and LTO")
+pgo_build("${WORK_DIR}/optimized" -DPGO_MODE=use -DENABLE_LTO=On)
+foreach(mode ${PGO_MODES})
+    pgo_workload("${WORK_DIR}/optimized/src/${MODULE_NAME}" ${mode} opt_${mode})
+endforeach()
+
+message("ns/key against the mock daemon, baseline -> pgo+lto:")
+foreach(mode ${PGO_MODES})
+    math(EXPR change "(${opt_${mode}} - ${base_${mode}}) * 100 / ${base_${mode}}")
+    message("  ${mode}: ${base_${mode}} -> ${opt_${mode}} (${change}%)")
+endforeach()
@@ -0,0 +1,351 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+/**
+ * @file startupbench.c
+ *
+ * Times what im-fcitx costs an application from g_module_open to the first
+ * key the daemon answered, phase by phase, against the mock daemon. Each
+ * cold sample is a new process opening the module; warm samples are more
+ * contexts created in that process after the first one got its reply.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clutter-imcontext/clutter-imcontext.h>
+#include "fcitx-config/hotkey.h"
+
+#include "startup.h"
+#include "benchmodule.h"
+#include "benchdaemon.h"
+
+/* ms a phase may take before the sample fails */
+#define PHASE_TIMEOUT 5000
+
+typedef enum _FcitxStartupBenchKind {
+    FCITX_STARTUP_BENCH_COLD,
+    FCITX_STARTUP_BENCH_WARM,
+    FCITX_STARTUP_BENCH_KIND_LAST
+} FcitxStartupBenchKind;
+
+static const char* kindnames[FCITX_STARTUP_BENCH_KIND_LAST] = { "cold", "warm" };
+
+/* the phase each row ends with, as src/startup.c names them */
+static const char* phasenames[FCITX_STARTUP_PHASE_LAST] = {
+    "g_module_check_init",
+    "im_module_init",
+    "im_module_create",
+    "FcitxIMClientOpen",
+    "CreateICv2 reply",
+    "first key",
+    "first key reply"
+};
+
+static char* modulepath = NULL;
+static char* daemonpath = NULL;
+static char* mode = "sync";
+static int runs = 20;
+static int warm = 20;
+static gboolean child = FALSE;
+
+static GOptionEntry entries[] = {
+    { "module", 'M', 0, G_OPTION_ARG_STRING, &modulepath, "The im-fcitx module to load", "PATH" },
+    { "daemon", 'D', 0, G_OPTION_ARG_STRING, &daemonpath, "The mock daemon to start", "PATH" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode, "Key processing mode: sync, async or hybrid", "MODE" },
+    { "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Processes, one cold sample each", "N" },
+    { "warm", 'w', 0, G_OPTION_ARG_INT, &warm, "Warm samples per process", "N" },
+    { "child", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_NONE, &child, "Take the samples of one process", NULL },
+    { NULL }
+};
+
+static FcitxStartupTimeFunc startup_time = NULL;
+static FcitxStartupRearmFunc startup_rearm = NULL;
+
+static gboolean FcitxStartupBenchExpire(gpointer user_data);
+static gboolean FcitxStartupBenchWait(FcitxStartupPhase phase);
+static ClutterIMContext* FcitxStartupBenchContext(FcitxBenchModule* module);
+static void FcitxStartupBenchPrint(FcitxStartupBenchKind kind, gint64 base);
+static int FcitxStartupBenchChild(void);
+static boolean FcitxStartupBenchParse(const char* out, GArray* samples[][FCITX_STARTUP_PHASE_LAST + 1]);
+static int FcitxStartupBenchCompare(const void* a, const void* b);
+static gint64 FcitxStartupBenchMedian(GArray* samples);
+static int FcitxStartupBenchParent(const char* self);
+
+gboolean FcitxStartupBenchExpire(gpointer user_data)
+{
+    *(gboolean*) user_data = TRUE;
+    return FALSE;
+}
+
+gboolean FcitxStartupBenchWait(FcitxStartupPhase phase)
+{
+    gboolean expired = FALSE;
+    guint timeout = g_timeout_add(PHASE_TIMEOUT, FcitxStartupBenchExpire, &expired);
+
+    while (!startup_time(phase) && !expired)
+        g_main_context_iteration(NULL, TRUE);
+
+    if (expired) {
+        fprintf(stderr, "startupbench: no %s within %dms\n", phasenames[phase], PHASE_TIMEOUT);
+        return FALSE;
+    }
+    g_source_remove(timeout);
+    return TRUE;
+}
+
+/* what a text actor does when it gets focus and the user starts typing */
+ClutterIMContext* FcitxStartupBenchContext(FcitxBenchModule* module)
+{
+    ClutterIMContext* context = FcitxBenchModuleCreate(module);
+    ClutterKeyEvent event;
+
+    if (!context)
+        return NULL;
+
+    clutter_im_context_focus_in(context);
+    if (!FcitxStartupBenchWait(FCITX_STARTUP_IC_CREATED)) {
+        g_object_unref(context);
+        return NULL;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.type = CLUTTER_KEY_PRESS;
+    event.time = 1;
+    event.keyval = FcitxKey_a;
+    clutter_im_context_filter_keypress(context, &event);
+
+    /* sync mode already has it, async gets it from the main loop */
+    if (!FcitxStartupBenchWait(FCITX_STARTUP_FIRST_KEY_REPLY)) {
+        g_object_unref(context);
+        return NULL;
+    }
+    return context;
+}
+
+/* "cold" or "warm" and usec since base per phase, -1 for phases before it */
+void FcitxStartupBenchPrint(FcitxStartupBenchKind kind, gint64 base)
+{
+    int phase;
+
+    printf("%s", kindnames[kind]);
+    for (phase = 0; phase < FCITX_STARTUP_PHASE_LAST; phase++) {
+        gint64 t = startup_time(phase);
+        printf(" %" G_GINT64_FORMAT, t >= base ? t - base : -1);
+    }
+    printf("\n");
+}
+
+int FcitxStartupBenchChild(void)
+{
+    FcitxBenchModule* module;
+    ClutterIMContext* first;
+    ClutterIMContext* context;
+    gint64 base;
+    int i;
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    base = g_get_monotonic_time();
+    module = FcitxBenchModuleLoad(modulepath);
+    if (!module)
+        return 1;
+
+    if (!FcitxBenchModuleSymbol(module, "fcitx_clutter_startup_time", (gpointer*) &startup_time)
+        || !FcitxBenchModuleSymbol(module, "fcitx_clutter_startup_rearm", (gpointer*) &startup_rearm)) {
+        fprintf(stderr, "startupbench: %s does not export its startup phases\n", modulepath);
+        return 1;
+    }
+
+    first = FcitxStartupBenchContext(module);
+    if (!first)
+        return 1;
+    FcitxStartupBenchPrint(FCITX_STARTUP_BENCH_COLD, base);
+
+    /* the first context stays, like the window the application opened first */
+    for (i = 0; i < warm; i++) {
+        startup_rearm();
+        base = g_get_monotonic_time();
+        context = FcitxStartupBenchContext(module);
+        if (!context)
+            return 1;
+        FcitxStartupBenchPrint(FCITX_STARTUP_BENCH_WARM, base);
+        g_object_unref(context);
+    }
+
+    g_object_unref(first);
+    return 0;
+}
+
+/* each phase is counted from the previous one reached, the last slot is the total */
+boolean FcitxStartupBenchParse(const char* out, GArray* samples[][FCITX_STARTUP_PHASE_LAST + 1])
+{
+    gchar** lines = g_strsplit(out, "\n", -1);
+    boolean ok = true;
+    int i, kind, phase;
+
+    for (i = 0; ok && lines[i]; i++) {
+        char* p = lines[i];
+        gint64 last = 0;
+
+        if (!*p)
+            continue;
+        for (kind = 0; kind < FCITX_STARTUP_BENCH_KIND_LAST; kind++) {
+            if (strncmp(p, kindnames[kind], strlen(kindnames[kind])) == 0)
+                break;
+        }
+        if (kind == FCITX_STARTUP_BENCH_KIND_LAST) {
+            ok = false;
+            break;
+        }
+        p += strlen(kindnames[kind]);
+
+        for (phase = 0; phase < FCITX_STARTUP_PHASE_LAST; phase++) {
+            char* end;
+            gint64 t = g_ascii_strtoll(p, &end, 10);
+            if (end == p) {
+                ok = false;
+                break;
+            }
+            p = end;
+            if (t < 0)
+                continue;
+            t -= last;
+            g_array_append_val(samples[kind][phase], t);
+            last += t;
+        }
+        g_array_append_val(samples[kind][FCITX_STARTUP_PHASE_LAST], last);
+    }
+    g_strfreev(lines);
+    return ok;
+}
+
+int FcitxStartupBenchCompare(const void* a, const void* b)
+{
+    gint64 x = *(const gint64*) a;
+    gint64 y = *(const gint64*) b;
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+gint64 FcitxStartupBenchMedian(GArray* samples)
+{
+    if (samples->len == 0)
+        return -1;
+    g_array_sort(samples, FcitxStartupBenchCompare);
+    return g_array_index(samples, gint64, samples->len / 2);
+}
+
+int FcitxStartupBenchParent(const char* self)
+{
+    GArray* samples[FCITX_STARTUP_BENCH_KIND_LAST][FCITX_STARTUP_PHASE_LAST + 1];
+    char warmarg[16];
+    const char* argv[] = { self, "--child", "--module", modulepath, "--warm", warmarg, NULL };
+    boolean failed = false;
+    GPid daemon;
+    int kind, phase, run;
+
+    /* the children inherit the settings the context reads once */
+    g_setenv("XDG_CONFIG_HOME", "/nonexistent", TRUE);
+    g_setenv("FCITX_CLUTTER_MODE", mode, TRUE);
+    g_setenv("FCITX_CLUTTER_LOCAL_ECHO", "0", TRUE);
+    g_setenv("FCITX_CLUTTER_SHARED_IC", "0", TRUE);
+    g_setenv("FCITX_CLUTTER_CLIENT_SIDE_UI", "0", TRUE);
+    g_unsetenv("FCITX_CLUTTER_ASYNC");
+    g_unsetenv("FCITX_CLUTTER_KEY_QUEUE_DEPTH");
+    snprintf(warmarg, sizeof(warmarg), "%d", warm);
+
+    daemon = FcitxBenchDaemonStart(daemonpath, NULL);
+    if (daemon < 0) {
+        fprintf(stderr, "startupbench: the mock daemon did not start\n");
+        return 1;
+    }
+
+    for (kind = 0; kind < FCITX_STARTUP_BENCH_KIND_LAST; kind++)
+        for (phase = 0; phase <= FCITX_STARTUP_PHASE_LAST; phase++)
+            samples[kind][phase] = g_array_new(FALSE, FALSE, sizeof(gint64));
+
+    for (run = 0; run < runs && !failed; run++) {
+        GError* error = NULL;
+        char* out = NULL;
+        int status;
+
+        if (!g_spawn_sync(NULL, (gchar**) argv, NULL, 0, NULL, NULL, &out, NULL, &status, &error)) {
+            fprintf(stderr, "startupbench: %s\n", error->message);
+            g_error_free(error);
+            failed = true;
+        } else if (!g_spawn_check_exit_status(status, NULL) || !FcitxStartupBenchParse(out, samples)) {
+            fprintf(stderr, "startupbench: sample %d failed\n", run);
+            failed = true;
+        }
+        g_free(out);
+    }
+    FcitxBenchDaemonStop(daemon);
+
+    if (!failed) {
+        printf("startup, mode %s: %d cold processes, %d warm contexts each\n", mode, runs, warm);
+        printf("%-24s %10s %10s\n", "median usec to", "cold", "warm");
+        for (phase = 0; phase <= FCITX_STARTUP_PHASE_LAST; phase++) {
+            printf("%-24s", phase < FCITX_STARTUP_PHASE_LAST ? phasenames[phase] : "total");
+            for (kind = 0; kind < FCITX_STARTUP_BENCH_KIND_LAST; kind++) {
+                gint64 median = FcitxStartupBenchMedian(samples[kind][phase]);
+                if (median < 0)
+                    printf(" %10s", "-");
+                else
+                    printf(" %10" G_GINT64_FORMAT, median);
+            }
+            printf("\n");
+        }
+    }
+
+    for (kind = 0; kind < FCITX_STARTUP_BENCH_KIND_LAST; kind++)
+        for (phase = 0; phase <= FCITX_STARTUP_PHASE_LAST; phase++)
+            g_array_free(samples[kind][phase], TRUE);
+    return failed ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* options;
+    GError* error = NULL;
+
+    options = g_option_context_new("- fcitx clutter module startup benchmark");
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "startupbench: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+
+    if (!modulepath || (!child && !daemonpath)) {
+        fprintf(stderr, "startupbench: --module and --daemon are required\n");
+        return 1;
+    }
+    if (runs < 1 || warm < 0) {
+        fprintf(stderr, "startupbench: runs must be positive\n");
+        return 1;
+    }
+
+    if (child)
+        return FcitxStartupBenchChild();
+    return FcitxStartupBenchParent(argv[0]);
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,291 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+/**
+ * @file workload.c
+ *
+ * Drives the built im-fcitx the way a text actor does, against the mock
+ * daemon: focus in, type the corpus with a repaint after every preedit
+ * change, focus out, once per pass. Used to train the profile guided
+ * build and to compare module builds by their ns per key, daemon and
+ * DBus round trips included.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <clutter-imcontext/clutter-imcontext.h>
+#include "fcitx-config/hotkey.h"
+
+#include "startup.h"
+#include "fakeim.h"
+#include "benchmodule.h"
+#include "benchdaemon.h"
+
+/* ms to wait for the IC or for the commits of a pass */
+#define WAIT_TIMEOUT 5000
+
+typedef struct _FcitxWorkload {
+    ClutterIMContext* context;
+    const FcitxFakeIMCorpus* corpus;
+    GString* committed;
+    boolean preedit_changed;
+    guint32 time;
+} FcitxWorkload;
+
+static char* modulepath = NULL;
+static char* daemonpath = NULL;
+static char* mode = "async";
+static gboolean local_echo = FALSE;
+static char* corpusname = "all";
+static int passes = 20;
+static int runs = 5;
+
+static GOptionEntry entries[] = {
+    { "module", 'M', 0, G_OPTION_ARG_STRING, &modulepath, "The im-fcitx module to load", "PATH" },
+    { "daemon", 'D', 0, G_OPTION_ARG_STRING, &daemonpath, "The mock daemon to start", "PATH" },
+    { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode, "Key processing mode: sync, async or hybrid", "MODE" },
+    { "local-echo", 'e', 0, G_OPTION_ARG_NONE, &local_echo, "Echo predicted letters before the reply", NULL },
+    { "corpus", 'c', 0, G_OPTION_ARG_STRING, &corpusname, "pinyin, kana, hangul or all", "NAME" },
+    { "passes", 'p', 0, G_OPTION_ARG_INT, &passes, "Passes over the corpus per run", "N" },
+    { "runs", 'r', 0, G_OPTION_ARG_INT, &runs, "Runs, ns/key is the best run", "N" },
+    { NULL }
+};
+
+static gboolean FcitxWorkloadExpire(gpointer user_data);
+static boolean FcitxWorkloadWait(FcitxWorkload* workload, FcitxStartupTimeFunc startup_time);
+static void FcitxWorkloadCommitCb(ClutterIMContext* context, const char* str, gpointer user_data);
+static void FcitxWorkloadPreeditChangedCb(ClutterIMContext* context, gpointer user_data);
+static void FcitxWorkloadRepaint(FcitxWorkload* workload);
+static void FcitxWorkloadSend(FcitxWorkload* workload, uint32_t keyval, ClutterEventType type);
+static boolean FcitxWorkloadPass(FcitxWorkload* workload);
+static int FcitxWorkloadRun(FcitxBenchModule* module, const FcitxFakeIMCorpus* corpus);
+
+gboolean FcitxWorkloadExpire(gpointer user_data)
+{
+    *(gboolean*) user_data = TRUE;
+    return FALSE;
+}
+
+/* the IC when startup_time is given, else all the commits of a pass */
+boolean FcitxWorkloadWait(FcitxWorkload* workload, FcitxStartupTimeFunc startup_time)
+{
+    gboolean expired = FALSE;
+    guint timeout = g_timeout_add(WAIT_TIMEOUT, FcitxWorkloadExpire, &expired);
+
+    while (!expired) {
+        if (startup_time ? startup_time(FCITX_STARTUP_IC_CREATED) != 0
+            : workload->committed->len >= strlen(workload->corpus->committed))
+            break;
+        g_main_context_iteration(NULL, TRUE);
+        FcitxWorkloadRepaint(workload);
+    }
+
+    if (expired) {
+        fprintf(stderr, "workload: no %s within %dms\n", startup_time ? "IC" : "commits", WAIT_TIMEOUT);
+        return false;
+    }
+    g_source_remove(timeout);
+    return true;
+}
+
+void FcitxWorkloadCommitCb(ClutterIMContext* context, const char* str, gpointer user_data)
+{
+    FcitxWorkload* workload = user_data;
+    g_string_append(workload->committed, str);
+}
+
+void FcitxWorkloadPreeditChangedCb(ClutterIMContext* context, gpointer user_data)
+{
+    FcitxWorkload* workload = user_data;
+    workload->preedit_changed = true;
+}
+
+/* what a text actor does once per change, whatever number of signals */
+void FcitxWorkloadRepaint(FcitxWorkload* workload)
+{
+    char* str;
+    PangoAttrList* attrs;
+    int cursor;
+
+    if (!workload->preedit_changed)
+        return;
+    workload->preedit_changed = false;
+
+    clutter_im_context_get_preedit_string(workload->context, &str, &attrs, &cursor);
+    g_free(str);
+    pango_attr_list_unref(attrs);
+}
+
+void FcitxWorkloadSend(FcitxWorkload* workload, uint32_t keyval, ClutterEventType type)
+{
+    ClutterKeyEvent event;
+
+    memset(&event, 0, sizeof(event));
+    event.type = type;
+    /* never the same time twice, that would be autorepeat */
+    workload->time += 10;
+    event.time = workload->time;
+    event.keyval = keyval;
+
+    clutter_im_context_filter_keypress(workload->context, &event);
+    /* the replies that came in meanwhile, like the actor's main loop */
+    while (g_main_context_iteration(NULL, FALSE));
+    FcitxWorkloadRepaint(workload);
+}
+
+boolean FcitxWorkloadPass(FcitxWorkload* workload)
+{
+    int i;
+    boolean ok;
+
+    clutter_im_context_focus_in(workload->context);
+    for (i = 0; i < workload->corpus->n; i++) {
+        FcitxWorkloadSend(workload, workload->corpus->keys[i].keyval, CLUTTER_KEY_PRESS);
+        FcitxWorkloadSend(workload, workload->corpus->keys[i].keyval, CLUTTER_KEY_RELEASE);
+    }
+
+    ok = FcitxWorkloadWait(workload, NULL);
+    if (ok && strcmp(workload->committed->str, workload->corpus->committed) != 0) {
+        fprintf(stderr, "workload: committed \"%s\", expected \"%s\"\n",
+                workload->committed->str, workload->corpus->committed);
+        ok = false;
+    }
+    g_string_truncate(workload->committed, 0);
+    clutter_im_context_focus_out(workload->context);
+    return ok;
+}
+
+int FcitxWorkloadRun(FcitxBenchModule* module, const FcitxFakeIMCorpus* corpus)
+{
+    FcitxStartupTimeFunc startup_time;
+    FcitxWorkload workload;
+    double best = -1;
+    boolean ok;
+    int run, pass;
+
+    if (!FcitxBenchModuleSymbol(module, "fcitx_clutter_startup_time", (gpointer*) &startup_time)) {
+        fprintf(stderr, "workload: %s does not export its startup phases\n", modulepath);
+        return 1;
+    }
+
+    memset(&workload, 0, sizeof(workload));
+    workload.corpus = corpus;
+    workload.committed = g_string_sized_new(strlen(corpus->committed) + 1);
+    workload.context = FcitxBenchModuleCreate(module);
+    if (!workload.context)
+        return 1;
+    g_signal_connect(workload.context, "commit", G_CALLBACK(FcitxWorkloadCommitCb), &workload);
+    g_signal_connect(workload.context, "preedit-changed", G_CALLBACK(FcitxWorkloadPreeditChangedCb), &workload);
+
+    clutter_im_context_focus_in(workload.context);
+    ok = FcitxWorkloadWait(&workload, startup_time);
+    clutter_im_context_focus_out(workload.context);
+
+    /* grows every buffer to the longest preedit once */
+    ok = ok && FcitxWorkloadPass(&workload);
+
+    for (run = 0; ok && run < runs; run++) {
+        gint64 start = g_get_monotonic_time();
+        double nsec;
+
+        for (pass = 0; ok && pass < passes; pass++)
+            ok = FcitxWorkloadPass(&workload);
+
+        nsec = (double) (g_get_monotonic_time() - start) * 1000 / ((double) passes * corpus->n * 2);
+        if (best < 0 || nsec < best)
+            best = nsec;
+    }
+
+    if (ok) {
+        printf("mode %s%s, corpus %s: %d keys, %d passes x %d runs\n",
+               mode, local_echo ? " with local echo" : "", corpusname, corpus->n, passes, runs);
+        /* the line the pgo target reads */
+        printf("ns/key %.0f\n", best);
+    }
+
+    g_object_unref(workload.context);
+    g_string_free(workload.committed, TRUE);
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char* argv[])
+{
+    GOptionContext* options;
+    GError* error = NULL;
+    FcitxFakeIMCorpus* corpus;
+    FcitxBenchModule* module;
+    const char* daemonargs[] = { "--corpus", NULL, NULL };
+    GPid daemon;
+    int ret;
+
+    options = g_option_context_new("- fcitx clutter module workload");
+    g_option_context_add_main_entries(options, entries, NULL);
+    if (!g_option_context_parse(options, &argc, &argv, &error)) {
+        fprintf(stderr, "workload: %s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(options);
+
+    if (!modulepath || !daemonpath) {
+        fprintf(stderr, "workload: --module and --daemon are required\n");
+        return 1;
+    }
+    if (passes < 1 || runs < 1) {
+        fprintf(stderr, "workload: passes and runs must be positive\n");
+        return 1;
+    }
+
+    corpus = FcitxFakeIMCorpusNew(corpusname);
+    if (!corpus) {
+        fprintf(stderr, "workload: unknown corpus %s\n", corpusname);
+        return 1;
+    }
+
+    /* the context reads its settings once, leave the user's file out */
+    g_setenv("XDG_CONFIG_HOME", "/nonexistent", TRUE);
+    g_setenv("FCITX_CLUTTER_MODE", mode, TRUE);
+    g_setenv("FCITX_CLUTTER_LOCAL_ECHO", local_echo ? "1" : "0", TRUE);
+    g_setenv("FCITX_CLUTTER_SHARED_IC", "0", TRUE);
+    g_setenv("FCITX_CLUTTER_CLIENT_SIDE_UI", "0", TRUE);
+    g_unsetenv("FCITX_CLUTTER_ASYNC");
+    g_unsetenv("FCITX_CLUTTER_KEY_QUEUE_DEPTH");
+
+#if !GLIB_CHECK_VERSION(2, 35, 0)
+    g_type_init();
+#endif
+
+    daemonargs[1] = corpusname;
+    daemon = FcitxBenchDaemonStart(daemonpath, daemonargs);
+    if (daemon < 0) {
+        fprintf(stderr, "workload: the mock daemon did not start\n");
+        FcitxFakeIMCorpusFree(corpus);
+        return 1;
+    }
+
+    /* never unloaded, an instrumented module writes its profile at exit */
+    module = FcitxBenchModuleLoad(modulepath);
+    ret = module ? FcitxWorkloadRun(module, corpus) : 1;
+
+    FcitxBenchDaemonStop(daemon);
+    FcitxFakeIMCorpusFree(corpus);
+    return ret;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,208 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <string.h>
+#include <clutter/clutter.h>
+
+#include "candidatepanel.h"
+
+#define CANDIDATE_PANEL_KEY "fcitx-candidate-panel"
+#define CANDIDATE_PANEL_FONT "Sans 12"
+#define CANDIDATE_PANEL_PADDING 4
+#define CANDIDATE_PANEL_SPACING 8
+
+struct _FcitxCandidatePanel {
+    ClutterActor* stage;
+    ClutterActor* group;
+    ClutterActor* background;
+    ClutterActor* aux;
+    GPtrArray* candidates;
+    guint used;
+};
+
+static const ClutterColor panelcolor = { 0xf4, 0xf4, 0xf4, 0xf0 };
+static const ClutterColor textcolor = { 0x20, 0x20, 0x20, 0xff };
+static const ClutterColor auxcolor = { 0xc0, 0x30, 0x30, 0xff };
+
+static void FcitxCandidatePanelFree(gpointer data);
+static ClutterActor* FcitxCandidatePanelNewText(FcitxCandidatePanel* panel, const ClutterColor* color);
+static ClutterActor* FcitxCandidatePanelCandidate(FcitxCandidatePanel* panel, guint i);
+static const char* FcitxCandidatePanelNextLabel(const char* p);
+
+FcitxCandidatePanel* FcitxCandidatePanelLookup(ClutterActor* stage)
+{
+    return g_object_get_data(G_OBJECT(stage), CANDIDATE_PANEL_KEY);
+}
+
+FcitxCandidatePanel* FcitxCandidatePanelGet(ClutterActor* stage)
+{
+    FcitxCandidatePanel* panel = FcitxCandidatePanelLookup(stage);
+    if (panel)
+        return panel;
+
+    panel = g_new0(FcitxCandidatePanel, 1);
+    panel->stage = stage;
+    panel->group = clutter_group_new();
+    panel->background = clutter_rectangle_new_with_color(&panelcolor);
+    panel->candidates = g_ptr_array_new();
+    clutter_container_add_actor(CLUTTER_CONTAINER(panel->group), panel->background);
+    panel->aux = FcitxCandidatePanelNewText(panel, &auxcolor);
+
+    /* the stage owns the actors, the panel only keeps pointers to them */
+    clutter_actor_hide(panel->group);
+    clutter_container_add_actor(CLUTTER_CONTAINER(stage), panel->group);
+    g_object_set_data_full(G_OBJECT(stage), CANDIDATE_PANEL_KEY, panel, FcitxCandidatePanelFree);
+    return panel;
+}
+
+void FcitxCandidatePanelFree(gpointer data)
+{
+    FcitxCandidatePanel* panel = data;
+    g_ptr_array_free(panel->candidates, TRUE);
+    g_free(panel);
+}
+
+ClutterActor* FcitxCandidatePanelNewText(FcitxCandidatePanel* panel, const ClutterColor* color)
+{
+    ClutterActor* text = clutter_text_new();
+    clutter_text_set_font_name(CLUTTER_TEXT(text), CANDIDATE_PANEL_FONT);
+    clutter_text_set_color(CLUTTER_TEXT(text), color);
+    clutter_container_add_actor(CLUTTER_CONTAINER(panel->group), text);
+    return text;
+}
+
+ClutterActor* FcitxCandidatePanelCandidate(FcitxCandidatePanel* panel, guint i)
+{
+    if (i >= panel->candidates->len)
+        g_ptr_array_add(panel->candidates, FcitxCandidatePanelNewText(panel, &textcolor));
+    return g_ptr_array_index(panel->candidates, i);
+}
+
+/* the " 2." after the candidate whose label starts at p, or the end of the string */
+const char* FcitxCandidatePanelNextLabel(const char* p)
+{
+    const char* q = p + 1;
+
+    while ((q = strchr(q, ' ')) != NULL) {
+        if (q[1] && q[1] != ' ' && q[2] == '.')
+            return q;
+        q++;
+    }
+    return p + strlen(p);
+}
+
+/*
+ * the daemon sends the candidates as one "1.foo 2.bar " string, each
+ * labelled candidate goes into its own text actor so an update only
+ * relayouts the candidates that changed; a candidate may contain spaces
+ */
+void FcitxCandidatePanelUpdate(FcitxCandidatePanel* panel, const char* auxup, const char* auxdown, const char* candidates)
+{
+    float x, y, width, height, rowheight;
+    const char* p;
+    guint n = 0;
+    guint i;
+
+    auxup = auxup ? auxup : "";
+    auxdown = auxdown ? auxdown : "";
+    candidates = candidates ? candidates : "";
+
+    if (!auxup[0] && !auxdown[0] && !candidates[0]) {
+        FcitxCandidatePanelHide(panel);
+        return;
+    }
+
+    char* aux = g_strconcat(auxup, auxdown, NULL);
+    clutter_text_set_text(CLUTTER_TEXT(panel->aux), aux);
+    g_free(aux);
+    clutter_actor_set_position(panel->aux, CANDIDATE_PANEL_PADDING, CANDIDATE_PANEL_PADDING);
+    width = clutter_actor_get_width(panel->aux);
+    y = CANDIDATE_PANEL_PADDING + clutter_actor_get_height(panel->aux);
+
+    x = CANDIDATE_PANEL_PADDING;
+    rowheight = 0;
+    for (p = candidates; *p; ) {
+        const char* end;
+        const char* old;
+        ClutterActor* text;
+        size_t len;
+
+        while (*p == ' ')
+            p++;
+        if (!*p)
+            break;
+        end = FcitxCandidatePanelNextLabel(p);
+        for (len = end - p; p[len - 1] == ' '; len--);
+
+        /* unchanged candidates are left alone without copying them */
+        text = FcitxCandidatePanelCandidate(panel, n++);
+        old = clutter_text_get_text(CLUTTER_TEXT(text));
+        if (!old || strncmp(old, p, len) != 0 || old[len] != '\0') {
+            char* word = g_strndup(p, len);
+            clutter_text_set_text(CLUTTER_TEXT(text), word);
+            g_free(word);
+        }
+
+        clutter_actor_set_position(text, x, y);
+        clutter_actor_show(text);
+        x += clutter_actor_get_width(text) + CANDIDATE_PANEL_SPACING;
+        if (clutter_actor_get_height(text) > rowheight)
+            rowheight = clutter_actor_get_height(text);
+        p = end;
+    }
+
+    for (i = n; i < panel->used; i++)
+        clutter_actor_hide(g_ptr_array_index(panel->candidates, i));
+    panel->used = n;
+
+    if (x - CANDIDATE_PANEL_SPACING > width)
+        width = x - CANDIDATE_PANEL_SPACING;
+    height = y + rowheight + CANDIDATE_PANEL_PADDING;
+    clutter_actor_set_size(panel->background, width + CANDIDATE_PANEL_PADDING, height);
+
+    clutter_actor_raise_top(panel->group);
+    clutter_actor_show(panel->group);
+}
+
+/* x, y is the top left corner of the cursor in stage coordinates */
+void FcitxCandidatePanelMove(FcitxCandidatePanel* panel, float x, float y, float cursorheight)
+{
+    float stagewidth, stageheight, width, height;
+
+    clutter_actor_get_size(panel->stage, &stagewidth, &stageheight);
+    clutter_actor_get_size(panel->background, &width, &height);
+
+    /* keep it inside the stage, flipping above the cursor if needed */
+    if (x + width > stagewidth)
+        x = stagewidth - width;
+    if (x < 0)
+        x = 0;
+    if (y + cursorheight + height > stageheight && y - height >= 0)
+        y = y - height;
+    else
+        y = y + cursorheight;
+
+    clutter_actor_set_position(panel->group, x, y);
+}
+
+void FcitxCandidatePanelHide(FcitxCandidatePanel* panel)
+{
+    clutter_actor_hide(panel->group);
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
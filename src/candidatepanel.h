@@ -0,0 +1,49 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_CANDIDATE_PANEL_H
+#define FCITX_CANDIDATE_PANEL_H
+
+#include <clutter/clutter.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * candidate window drawn inside the stage when the daemon leaves the
+     * UI to the client, so it paints in the same frame as the preedit.
+     * There is one panel per stage, created on first use and destroyed with
+     * the stage; its text actors are reused between updates.
+     */
+    typedef struct _FcitxCandidatePanel FcitxCandidatePanel;
+
+    FcitxCandidatePanel* FcitxCandidatePanelGet(ClutterActor* stage);
+    /* like FcitxCandidatePanelGet, but never creates one */
+    FcitxCandidatePanel* FcitxCandidatePanelLookup(ClutterActor* stage);
+    void FcitxCandidatePanelUpdate(FcitxCandidatePanel* panel, const char* auxup, const char* auxdown, const char* candidates);
+    void FcitxCandidatePanelMove(FcitxCandidatePanel* panel, float x, float y, float cursorheight);
+    void FcitxCandidatePanelHide(FcitxCandidatePanel* panel);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
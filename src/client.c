@@ -18,7 +18,11 @@
  ***************************************************************************/
 
 #include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <dbus/dbus.h>
 #include <dbus/dbus-glib.h>
+#include <dbus/dbus-glib-lowlevel.h>
 #include <fcitx/module/dbus/dbusstuff.h>
 #include <fcitx/module/ipc/ipc.h>
 #include "fcitx/fcitx.h"
@@ -28,41 +32,247 @@
 #include "fcitx-utils/utils.h"
 
 #include "client.h"
-#include "marshall.h"
+#include "probes.h"
+#include "startup.h"
 #include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <signal.h>
 
 #define LOG_LEVEL DEBUG
 #define IC_NAME_MAX 64
+#define MATCH_RULE_MAX 256
+/* while fcitx restarts there is no owner or IC and keys fail right away */
+#define KEY_CALL_TIMEOUT FCITX_IM_CLIENT_KEY_TIMEOUT
+/* finished key calls kept for the next keys, enough for a full key queue */
+#define KEY_CALL_CACHE_SIZE 32
+
+typedef struct _FcitxIMClientHub FcitxIMClientHub;
+typedef struct _FcitxIMClientKeyBatch FcitxIMClientKeyBatch;
+
+/* what the current owner of the service answered to an optional method */
+typedef enum _FcitxIMClientSupport {
+    FCITX_IM_CLIENT_SUPPORT_UNKNOWN,
+    FCITX_IM_CLIENT_SUPPORT_YES,
+    FCITX_IM_CLIENT_SUPPORT_NO
+} FcitxIMClientSupport;
 
 struct _FcitxIMClient {
+    FcitxIMClientHub* hub;
     DBusGConnection* conn;
     DBusGProxy* proxy;
-    DBusGProxy* icproxy;
+    boolean hasic;
     char icname[IC_NAME_MAX];
     int id;
-    DBusGProxy* dbusproxy;
     FcitxIMClientConnectCallback connectcb;
     FcitxIMClientDestroyCallback destroycb;
     void *data;
     FcitxHotkey triggerkey[2];
-    char servicename[IC_NAME_MAX];
     boolean enable;
+    /* the caller takes key results inline, see FcitxIMClientSetInlineResult */
+    boolean inlineresult;
+    GList* keybatches;
+    boolean focus;
+    boolean serverfocus;
+    /*
+     * what the context asked for, and the shadow of what the daemon was
+     * last told for the current IC; only differences are sent
+     */
+    uint32_t capacity;
+    boolean capacityset;
+    uint32_t servercapacity;
+    boolean servercapacityvalid;
+    int32_t cursorx;
+    int32_t cursory;
+    boolean cursorset;
+    int32_t servercursorx;
+    int32_t servercursory;
+    boolean servercursorvalid;
+    guint stateidle;
+    int keyfd;
+    uint32_t keyserial;
+    guint keywatch;
+    guint keydeliveridle;
+    GQueue* keycalls;
+    DBusPendingCall* keychannelcall;
+    GCallback enableIM;
+    GCallback closeIM;
+    GCallback commitString;
+    GCallback forwardKey;
+    GCallback updatePreedit;
+    GCallback updateClientSideUI;
+    void* signaldata;
+    GClosureNotify signalfree;
+};
+
+typedef void (*FcitxIMClientVoidSignal)(DBusGProxy* proxy, void* user_data);
+typedef void (*FcitxIMClientStringSignal)(DBusGProxy* proxy, char* str, void* user_data);
+typedef void (*FcitxIMClientPreeditSignal)(DBusGProxy* proxy, char* str, int cursor, void* user_data);
+typedef void (*FcitxIMClientForwardKeySignal)(DBusGProxy* proxy, guint keyval, guint state, gint type, void* user_data);
+typedef void (*FcitxIMClientClientSideUISignal)(DBusGProxy* proxy, char* auxup, char* auxdown, char* preedit,
+        char* candidateword, char* imname, int cursorpos, void* user_data);
+
+/**
+ * one hub per X display: it owns the connection to the bus the fcitx of
+ * that display is on, caches its service name and holds a single
+ * NameOwnerChanged match rule for it, filtered on arg0 so the bus daemon
+ * only wakes us for fcitx itself.
+ *
+ * IC signals of all the clients come in through one match rule for the
+ * whole interface and are routed by object path, instead of five rules
+ * and five dbus-glib proxy subscriptions per IC.
+ *
+ * It also resolves the owner of that name once and creates the ICs of all
+ * the clients opened in one main loop iteration together, so a window with
+ * many entries waits for one GetNameOwner and one CreateICv2 round trip.
+ */
+struct _FcitxIMClientHub {
+    DBusGConnection* conn;
+    GList* clients;
+    char servicename[IC_NAME_MAX];
+    char matchrule[MATCH_RULE_MAX];
+    char icmatchrule[MATCH_RULE_MAX];
+    GHashTable* ics;
+    char* newowner;
+    guint owneridle;
+    DBusGProxy* proxy;
+    GList* pending;
+    guint createidle;
+    /*
+     * ProcessKeyEventBatch is tried by one batch per daemon, keys of its
+     * client must not overtake it while it may still fall back to singles
+     */
+    FcitxIMClientSupport batchkeys;
+    FcitxIMClientKeyBatch* batchprobe;
+    /* ProcessKeyEventInline, advertised to every IC until it is known missing */
+    FcitxIMClientSupport inlineresult;
+};
+
+/* an asynchronous key event waiting for its reply */
+typedef struct _FcitxIMClientKeyCall {
+    FcitxIMClientProcessKeyCallback callback;
+    void* user_data;
+    GDestroyNotify notify;
+    int id;
+    uint32_t serial;
+    /* reply read off the key channel, not delivered yet */
+    boolean answered;
+    int ret;
+    gint64 start;
+    /* keycalls node, or the next call of the free list */
+    GList link;
+} FcitxIMClientKeyCall;
+
+/* keys sent together, either in one ProcessKeyEventBatch or pipelined */
+struct _FcitxIMClientKeyBatch {
+    FcitxIMClient* client;
+    DBusPendingCall* pending;
+    FcitxIMClientProcessKeyBatchCallback callback;
+    void* user_data;
+    GDestroyNotify notify;
+    FcitxIMClientKeyEvent* keys;
+    int* ret;
+    int n;
+    int remaining;
+    boolean delivered;
+    int id;
+    gint64 start;
 };
 
+typedef struct _FcitxIMClientKeyBatchSlot {
+    FcitxIMClientKeyBatch* batch;
+    int index;
+} FcitxIMClientKeyBatchSlot;
+
+/*
+ * fixed size records on the optional SOCK_SEQPACKET key channel, one per
+ * datagram in host byte order since both ends are on the same machine;
+ * replies come back in request order and echo the serial
+ */
+typedef struct _FcitxIMClientKeyRequest {
+    uint32_t serial;
+    uint32_t keyval;
+    uint32_t keycode;
+    uint32_t state;
+    int32_t type;
+    uint32_t time;
+} FcitxIMClientKeyRequest;
+
+typedef struct _FcitxIMClientKeyReply {
+    uint32_t serial;
+    int32_t ret;
+} FcitxIMClientKeyReply;
+
+/* service name -> hub */
+static GHashTable* hubs = NULL;
+/* reading /proc once is enough, the name does not change */
+static char* processname = NULL;
+/* recycled key calls, chained through their link */
+static GList* freekeycalls = NULL;
+static int nfreekeycalls = 0;
+
 static void FcitxIMClientCreateIC(FcitxIMClient* client);
 
 static void _destroy_cb(DBusGProxy *proxy, gpointer user_data);
-static void _changed_cb(DBusGProxy* proxy, char* service, char* old_owner, char* new_owner, gpointer user_data);
+static void _changed_cb(FcitxIMClient* client, const char* new_owner);
+static int FcitxIMClientParseDisplayNumber(const char* display);
+static char* FcitxIMClientGetAddress(int displaynumber);
+static DBusGConnection* FcitxIMClientConnect(int displaynumber);
+static FcitxIMClientHub* FcitxIMClientHubGet(const char* display);
+static void FcitxIMClientHubRelease(FcitxIMClientHub* hub, FcitxIMClient* client);
+static DBusHandlerResult FcitxIMClientHubFilter(DBusConnection* connection, DBusMessage* message, void* user_data);
+static gboolean FcitxIMClientHubCreateIdle(gpointer user_data);
+static gboolean FcitxIMClientHubOwnerIdle(gpointer user_data);
+static void FcitxIMClientHubResetProxy(FcitxIMClientHub* hub);
+static void _hub_destroy_cb(DBusGProxy *proxy, gpointer user_data);
+static void FcitxIMClientDispatchSignal(FcitxIMClient* client, DBusMessage* message);
+static void FcitxIMClientDropIC(FcitxIMClient* client);
+static void FcitxIMClientCallNoReply(FcitxIMClient* client, const char* method, int first_arg_type, ...);
 
 static void FcitxIMClientCreateICCallback(DBusGProxy *proxy,
         DBusGProxyCall *call_id,
         gpointer user_data);
+static void FcitxIMClientScheduleState(FcitxIMClient* client);
+static boolean FcitxIMClientUseInline(FcitxIMClient* client);
+static DBusMessage* FcitxIMClientNewKeyMessage(FcitxIMClient* client, const char* method,
+        uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t);
+static DBusMessage* FcitxIMClientCallKey(FcitxIMClient* client, const char* method,
+        uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+        DBusError* error);
+static void FcitxIMClientProcessKeyNotify(DBusPendingCall* pending, void* user_data);
+static FcitxIMClientKeyCall* FcitxIMClientKeyCallNew(void);
+static void FcitxIMClientKeyCallFree(void* data);
+static gboolean FcitxIMClientStateIdle(gpointer user_data);
+static void FcitxIMClientFlushState(FcitxIMClient* client);
+static void FcitxIMClientOpenKeyChannel(FcitxIMClient* client);
+static void FcitxIMClientOpenKeyChannelNotify(DBusPendingCall* pending, void* user_data);
+static void FcitxIMClientCloseKeyChannel(FcitxIMClient* client);
+static boolean FcitxIMClientChannelSend(FcitxIMClient* client,
+        uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t);
+static boolean FcitxIMClientChannelKeySync(FcitxIMClient* client,
+        uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+        int* ret);
+static boolean FcitxIMClientChannelRecv(FcitxIMClient* client, FcitxIMClientKeyReply* reply);
+static GList* FcitxIMClientChannelFirstUnanswered(FcitxIMClient* client);
+static void FcitxIMClientChannelDeliver(FcitxIMClient* client);
+static gboolean FcitxIMClientChannelDeliverIdle(gpointer user_data);
+static gboolean FcitxIMClientChannelWatch(GIOChannel* source, GIOCondition condition, gpointer user_data);
+static FcitxIMClientKeyBatch* FcitxIMClientKeyBatchNew(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+        FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify);
+static void FcitxIMClientKeyBatchFree(void* data);
+static void FcitxIMClientKeyBatchRelease(FcitxIMClientKeyBatch* batch);
+static void FcitxIMClientKeyBatchNotify(DBusPendingCall* pending, void* user_data);
+static void FcitxIMClientKeyBatchSlotCallback(int ret, void* user_data);
+static void FcitxIMClientKeyBatchSlotFree(void* data);
+static void FcitxIMClientProcessKeyPipelined(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+        FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify);
 
 boolean IsFcitxIMClientValid(FcitxIMClient* client)
 {
     if (client == NULL)
         return false;
-    if (client->proxy == NULL || client->icproxy == NULL)
+    if (client->proxy == NULL || !client->hasic)
         return false;
 
     return true;
@@ -75,70 +285,365 @@ boolean IsFcitxIMClientEnabled(FcitxIMClient* client)
     return client->enable;
 }
 
+boolean FcitxIMClientIsProbingBatch(FcitxIMClient* client)
+{
+    if (client == NULL || client->hub->batchprobe == NULL)
+        return false;
+    return client->hub->batchprobe->client == client;
+}
+
+boolean FcitxIMClientHasKeyChannel(FcitxIMClient* client)
+{
+    if (client == NULL)
+        return false;
+    return client->keyfd >= 0;
+}
+
 void FcitxIMClientSetEnabled(FcitxIMClient* client, boolean enable)
 {
     if (client)
-        client->enable = true;
+        client->enable = enable;
+}
+
+FcitxIMClient* FcitxIMClientOpen(FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data)
+{
+    return FcitxIMClientOpenForDisplay(NULL, connectcb, destroycb, data);
 }
 
-FcitxIMClient* FcitxIMClientOpen(FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, GObject* data)
+FcitxIMClient* FcitxIMClientOpenForDisplay(const char* display, FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data)
 {
+    FcitxIMClientHub* hub;
+
+    FcitxStartupMark(FCITX_STARTUP_CLIENT_OPEN);
+    hub = FcitxIMClientHubGet(display);
+
+    /* You must have dbus to make it works */
+    if (hub == NULL)
+        return NULL;
+
     FcitxIMClient* client = fcitx_utils_malloc0(sizeof(FcitxIMClient));
-    GError *error = NULL;
+    client->hub = hub;
     client->connectcb = connectcb;
     client->destroycb = destroycb;
     client->data = data;
-    client->conn = dbus_g_bus_get(DBUS_BUS_SESSION, &error);
+    client->conn = hub->conn;
     client->id = -1;
+    client->keyfd = -1;
+    client->keycalls = g_queue_new();
 
-    /* You must have dbus to make it works */
-    if (client->conn == NULL) {
-        g_warning("%s", error->message);
-        free(client);
+    hub->clients = g_list_prepend(hub->clients, client);
+
+    client->triggerkey[0].sym = client->triggerkey[0].state = client->triggerkey[1].sym = client->triggerkey[1].state = 0;
+
+    FcitxIMClientCreateIC(client);
+    return client;
+}
+
+int FcitxIMClientParseDisplayNumber(const char* display)
+{
+    const char* p;
+
+    if (display == NULL)
+        return fcitx_utils_get_display_number();
+
+    /* [host]:number[.screen] */
+    p = strrchr(display, ':');
+    if (p == NULL)
+        return 0;
+    return atoi(p + 1);
+}
+
+/*
+ * the bus fcitx announced for that display, the same way fcitx's own
+ * clients find it: $FCITX_DBUS_ADDRESS for the display in $DISPLAY, else
+ * the address file a running fcitx wrote, holding the address, a NUL and
+ * the pids of its dbus-daemon and of itself; NULL for the session bus
+ */
+char* FcitxIMClientGetAddress(int displaynumber)
+{
+    const char* env = getenv("FCITX_DBUS_ADDRESS");
+    char* machineid;
+    char* name;
+    char* path;
+    gchar* buffer = NULL;
+    gsize size = 0;
+    char* address = NULL;
+    pid_t pids[2];
+    size_t len;
+
+    if (env && displaynumber == fcitx_utils_get_display_number())
+        return g_strdup(env);
+
+    machineid = dbus_get_local_machine_id();
+    if (!machineid)
         return NULL;
+    name = g_strdup_printf("%s-%d", machineid, displaynumber);
+    dbus_free(machineid);
+    path = g_build_filename(g_get_user_config_dir(), "fcitx", "dbus", name, NULL);
+    g_free(name);
+
+    if (g_file_get_contents(path, &buffer, &size, NULL)) {
+        len = strnlen(buffer, size);
+        if (len > 0 && size >= len + 1 + sizeof(pids)) {
+            memcpy(pids, buffer + len + 1, sizeof(pids));
+            /* a stale file of an fcitx that is gone */
+            if (kill(pids[0], 0) == 0 && kill(pids[1], 0) == 0)
+                address = g_strndup(buffer, len);
+        }
+    }
+    g_free(buffer);
+    g_free(path);
+    return address;
+}
+
+DBusGConnection* FcitxIMClientConnect(int displaynumber)
+{
+    char* address = FcitxIMClientGetAddress(displaynumber);
+    DBusGConnection* conn;
+    GError *error = NULL;
+
+    if (address == NULL) {
+        conn = dbus_g_bus_get(DBUS_BUS_SESSION, &error);
+    } else {
+        /* usually the bus fcitx started for a display without a session bus */
+        conn = dbus_g_connection_open(address, &error);
+        if (conn && !dbus_bus_register(dbus_g_connection_get_connection(conn), NULL)) {
+            dbus_g_connection_unref(conn);
+            conn = dbus_g_bus_get(DBUS_BUS_SESSION, &error);
+        }
+        g_free(address);
+    }
+
+    if (conn == NULL) {
+        g_warning("%s", error->message);
+        g_error_free(error);
     }
+    return conn;
+}
 
-    client->dbusproxy = dbus_g_proxy_new_for_name(client->conn,
-                        DBUS_SERVICE_DBUS,
-                        DBUS_PATH_DBUS,
-                        DBUS_INTERFACE_DBUS);
+FcitxIMClientHub* FcitxIMClientHubGet(const char* display)
+{
+    char servicename[IC_NAME_MAX];
+    int displaynumber = FcitxIMClientParseDisplayNumber(display);
+    FcitxIMClientHub* hub;
+    DBusGConnection* conn;
+
+    snprintf(servicename, IC_NAME_MAX, "%s-%d", FCITX_DBUS_SERVICE, displaynumber);
 
-    if (!client->dbusproxy) {
-        g_object_unref(client->conn);
-        free(client);
+    if (hubs) {
+        hub = g_hash_table_lookup(hubs, servicename);
+        if (hub)
+            return hub;
+    }
+
+    conn = FcitxIMClientConnect(displaynumber);
+    if (conn == NULL)
+        return NULL;
+
+    hub = fcitx_utils_malloc0(sizeof(FcitxIMClientHub));
+    /* hubs sharing the session bus each see all of its signals */
+    if (!dbus_connection_add_filter(dbus_g_connection_get_connection(conn), FcitxIMClientHubFilter, hub, NULL)) {
+        dbus_g_connection_unref(conn);
+        free(hub);
         return NULL;
     }
-    sprintf(client->servicename, "%s-%d", FCITX_DBUS_SERVICE, fcitx_utils_get_display_number());
-    dbus_g_object_register_marshaller(fcitx_marshall_VOID__STRING_STRING_STRING, G_TYPE_NONE, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INVALID);
-    dbus_g_proxy_add_signal(client->dbusproxy, "NameOwnerChanged", G_TYPE_STRING, G_TYPE_STRING, G_TYPE_STRING, G_TYPE_INVALID);
-    dbus_g_proxy_connect_signal(client->dbusproxy, "NameOwnerChanged",
-                                G_CALLBACK(_changed_cb), client, NULL);
+    if (hubs == NULL)
+        hubs = g_hash_table_new(g_str_hash, g_str_equal);
 
-    client->triggerkey[0].sym = client->triggerkey[0].state = client->triggerkey[1].sym = client->triggerkey[1].state = 0;
+    hub->conn = conn;
+    strcpy(hub->servicename, servicename);
+    snprintf(hub->matchrule, MATCH_RULE_MAX,
+             "type='signal',"
+             "sender='" DBUS_SERVICE_DBUS "',"
+             "interface='" DBUS_INTERFACE_DBUS "',"
+             "path='" DBUS_PATH_DBUS "',"
+             "member='NameOwnerChanged',"
+             "arg0='%s'",
+             hub->servicename);
+    snprintf(hub->icmatchrule, MATCH_RULE_MAX,
+             "type='signal',"
+             "sender='%s',"
+             "interface='" FCITX_IC_DBUS_INTERFACE "'",
+             hub->servicename);
+    /* no error pointer, so this does not block on the bus daemon */
+    dbus_bus_add_match(dbus_g_connection_get_connection(conn), hub->matchrule, NULL);
+    dbus_bus_add_match(dbus_g_connection_get_connection(conn), hub->icmatchrule, NULL);
+    hub->ics = g_hash_table_new(g_str_hash, g_str_equal);
 
-    FcitxIMClientCreateIC(client);
-    return client;
+    g_hash_table_insert(hubs, hub->servicename, hub);
+    return hub;
 }
 
-static void _changed_cb(DBusGProxy* proxy, char* service, char* old_owner, char* new_owner, gpointer user_data)
+void FcitxIMClientHubRelease(FcitxIMClientHub* hub, FcitxIMClient* client)
+{
+    hub->clients = g_list_remove(hub->clients, client);
+    if (hub->clients)
+        return;
+
+    g_hash_table_remove(hubs, hub->servicename);
+    if (hub->createidle)
+        g_source_remove(hub->createidle);
+    if (hub->owneridle)
+        g_source_remove(hub->owneridle);
+    g_free(hub->newowner);
+    g_list_free(hub->pending);
+    FcitxIMClientHubResetProxy(hub);
+    dbus_bus_remove_match(dbus_g_connection_get_connection(hub->conn), hub->matchrule, NULL);
+    dbus_bus_remove_match(dbus_g_connection_get_connection(hub->conn), hub->icmatchrule, NULL);
+    g_hash_table_destroy(hub->ics);
+    dbus_connection_remove_filter(dbus_g_connection_get_connection(hub->conn), FcitxIMClientHubFilter, hub);
+    dbus_g_connection_unref(hub->conn);
+    free(hub);
+
+    if (g_hash_table_size(hubs) == 0) {
+        g_hash_table_destroy(hubs);
+        hubs = NULL;
+    }
+}
+
+DBusHandlerResult FcitxIMClientHubFilter(DBusConnection* connection, DBusMessage* message, void* user_data)
+{
+    const char* service = NULL;
+    const char* old_owner = NULL;
+    const char* new_owner = NULL;
+    FcitxIMClientHub* hub = (FcitxIMClientHub*) user_data;
+
+    if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (dbus_message_has_interface(message, FCITX_IC_DBUS_INTERFACE)) {
+        const char* path = dbus_message_get_path(message);
+        FcitxIMClient* client;
+
+        if (!path)
+            return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+        /* the sender tells apart the ICs of two daemons on one bus */
+        client = g_hash_table_lookup(hub->ics, path);
+        if (client && client->proxy
+            && g_strcmp0(dbus_message_get_sender(message), dbus_g_proxy_get_bus_name(client->proxy)) == 0)
+            FcitxIMClientDispatchSignal(client, message);
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+    }
+
+    if (!dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged"))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (!dbus_message_get_args(message, NULL,
+                               DBUS_TYPE_STRING, &service,
+                               DBUS_TYPE_STRING, &old_owner,
+                               DBUS_TYPE_STRING, &new_owner,
+                               DBUS_TYPE_INVALID))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if (strcmp(service, hub->servicename) != 0)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    /* the cached owner is gone, resolve the new one on the next creation */
+    FcitxIMClientHubResetProxy(hub);
+    /* and the new one may know other methods */
+    hub->batchkeys = FCITX_IM_CLIENT_SUPPORT_UNKNOWN;
+    hub->batchprobe = NULL;
+    hub->inlineresult = FCITX_IM_CLIENT_SUPPORT_UNKNOWN;
+
+    /*
+     * recreating the ICs is housekeeping, let pending key replies and
+     * commits go first; only the last owner of a burst matters
+     */
+    g_free(hub->newowner);
+    hub->newowner = g_strdup(new_owner);
+    if (hub->owneridle == 0)
+        hub->owneridle = g_idle_add_full(G_PRIORITY_DEFAULT_IDLE, FcitxIMClientHubOwnerIdle, hub, NULL);
+
+    /* other users of the bus connection may want it too */
+    return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+gboolean FcitxIMClientHubOwnerIdle(gpointer user_data)
+{
+    FcitxIMClientHub* hub = (FcitxIMClientHub*) user_data;
+    char* new_owner = hub->newowner;
+    GList* iter;
+
+    hub->owneridle = 0;
+    hub->newowner = NULL;
+    for (iter = hub->clients; iter; iter = g_list_next(iter))
+        _changed_cb((FcitxIMClient*) iter->data, new_owner);
+    g_free(new_owner);
+    return FALSE;
+}
+
+void FcitxIMClientDispatchSignal(FcitxIMClient* client, DBusMessage* message)
+{
+    const char* member = dbus_message_get_member(message);
+    const char* str = NULL;
+    int32_t cursor, type;
+    uint32_t keyval, state;
+
+    if (!member || !client->signaldata)
+        return;
+
+    if (strcmp(member, "CommitString") == 0) {
+        if (client->commitString
+            && dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &str, DBUS_TYPE_INVALID))
+            ((FcitxIMClientStringSignal) client->commitString)(NULL, (char*) str, client->signaldata);
+    } else if (strcmp(member, "UpdatePreedit") == 0) {
+        if (client->updatePreedit
+            && dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &str, DBUS_TYPE_INT32, &cursor, DBUS_TYPE_INVALID))
+            ((FcitxIMClientPreeditSignal) client->updatePreedit)(NULL, (char*) str, cursor, client->signaldata);
+    } else if (strcmp(member, "ForwardKey") == 0) {
+        if (client->forwardKey
+            && dbus_message_get_args(message, NULL,
+                                     DBUS_TYPE_UINT32, &keyval,
+                                     DBUS_TYPE_UINT32, &state,
+                                     DBUS_TYPE_INT32, &type,
+                                     DBUS_TYPE_INVALID))
+            ((FcitxIMClientForwardKeySignal) client->forwardKey)(NULL, keyval, state, type, client->signaldata);
+    } else if (strcmp(member, "UpdateClientSideUI") == 0) {
+        const char *auxup, *auxdown, *preedit, *candidateword, *imname;
+        if (client->updateClientSideUI
+            && dbus_message_get_args(message, NULL,
+                                     DBUS_TYPE_STRING, &auxup,
+                                     DBUS_TYPE_STRING, &auxdown,
+                                     DBUS_TYPE_STRING, &preedit,
+                                     DBUS_TYPE_STRING, &candidateword,
+                                     DBUS_TYPE_STRING, &imname,
+                                     DBUS_TYPE_INT32, &cursor,
+                                     DBUS_TYPE_INVALID))
+            ((FcitxIMClientClientSideUISignal) client->updateClientSideUI)(NULL, (char*) auxup, (char*) auxdown, (char*) preedit,
+                    (char*) candidateword, (char*) imname, cursor, client->signaldata);
+    } else if (strcmp(member, "EnableIM") == 0) {
+        if (client->enableIM)
+            ((FcitxIMClientVoidSignal) client->enableIM)(NULL, client->signaldata);
+    } else if (strcmp(member, "CloseIM") == 0) {
+        if (client->closeIM)
+            ((FcitxIMClientVoidSignal) client->closeIM)(NULL, client->signaldata);
+    }
+}
+
+void FcitxIMClientDropIC(FcitxIMClient* client)
+{
+    if (!client->hasic)
+        return;
+    g_hash_table_remove(client->hub->ics, client->icname);
+    client->hasic = false;
+}
+
+static void _changed_cb(FcitxIMClient* client, const char* new_owner)
 {
     FcitxLog(LOG_LEVEL, "_changed_cb");
-    FcitxIMClient* client = (FcitxIMClient*) user_data;
-    if (g_str_equal(service, client->servicename)) {
-        gboolean new_owner_good = new_owner && (new_owner[0] != '\0');
-        if (new_owner_good) {
-            if (client->proxy) {
-                g_object_unref(client->proxy);
-                client->proxy = NULL;
-            }
-
-            if (client->icproxy) {
-                g_object_unref(client->icproxy);
-                client->icproxy = NULL;
-            }
-
-            FcitxIMClientCreateIC(client);
+    gboolean new_owner_good = new_owner && (new_owner[0] != '\0');
+    if (new_owner_good) {
+        FCITX_CLUTTER_PROBE1(ic_reconnect, client->id);
+        FcitxIMClientCloseKeyChannel(client);
+        if (client->proxy) {
+            g_object_unref(client->proxy);
+            client->proxy = NULL;
         }
+
+        FcitxIMClientDropIC(client);
+
+        FcitxIMClientCreateIC(client);
     }
 }
 
@@ -147,33 +652,89 @@ static void _destroy_cb(DBusGProxy *proxy, gpointer user_data)
     FcitxLog(LOG_LEVEL, "_destroy_cb");
     FcitxIMClient* client = (FcitxIMClient*) user_data;
     if (client->proxy == proxy) {
+        FcitxIMClientCloseKeyChannel(client);
         g_object_unref(client->proxy);
-        g_object_unref(client->icproxy);
         client->proxy = NULL;
-        client->icproxy = NULL;
+        FcitxIMClientDropIC(client);
         client->triggerkey[0].sym = client->triggerkey[0].state = client->triggerkey[1].sym = client->triggerkey[1].state = 0;
     }
     client->destroycb(client, client->data);
 }
 
+const char* FcitxIMClientGetProcessName(void)
+{
+    if (!processname)
+        processname = fcitx_utils_get_process_name();
+    return processname;
+}
+
 void FcitxIMClientCreateIC(FcitxIMClient* client)
 {
+    FcitxIMClientHub* hub = client->hub;
+
+    if (g_list_find(hub->pending, client))
+        return;
+
+    hub->pending = g_list_append(hub->pending, client);
+    if (hub->createidle == 0)
+        hub->createidle = g_idle_add_full(G_PRIORITY_HIGH_IDLE, FcitxIMClientHubCreateIdle, hub, NULL);
+}
+
+gboolean FcitxIMClientHubCreateIdle(gpointer user_data)
+{
+    FcitxIMClientHub* hub = (FcitxIMClientHub*) user_data;
     GError* error = NULL;
+    GList* pending;
+    GList* iter;
+
+    hub->createidle = 0;
+    pending = hub->pending;
+    hub->pending = NULL;
+
+    if (!hub->proxy) {
+        hub->proxy = dbus_g_proxy_new_for_name_owner(hub->conn,
+                     hub->servicename,
+                     FCITX_IM_DBUS_PATH,
+                     FCITX_IM_DBUS_INTERFACE,
+                     &error);
+        if (!hub->proxy) {
+            g_error_free(error);
+            g_list_free(pending);
+            return FALSE;
+        }
+        g_signal_connect(hub->proxy, "destroy", G_CALLBACK(_hub_destroy_cb), hub);
+    }
 
-    client->proxy = dbus_g_proxy_new_for_name_owner(client->conn,
-                    client->servicename,
-                    FCITX_IM_DBUS_PATH,
-                    FCITX_IM_DBUS_INTERFACE,
-                    &error);
+    /* all requests go out before the first reply is read */
+    for (iter = pending; iter; iter = g_list_next(iter)) {
+        FcitxIMClient* client = (FcitxIMClient*) iter->data;
+        if (client->proxy)
+            continue;
 
-    if (!client->proxy)
+        client->proxy = dbus_g_proxy_new_from_proxy(hub->proxy, NULL, NULL);
+        g_signal_connect(client->proxy, "destroy", G_CALLBACK(_destroy_cb), client);
+        dbus_g_proxy_begin_call(client->proxy, "CreateICv2", FcitxIMClientCreateICCallback, client, NULL,
+                                G_TYPE_STRING, FcitxIMClientGetProcessName(), G_TYPE_INVALID);
+    }
+    g_list_free(pending);
+    return FALSE;
+}
+
+void FcitxIMClientHubResetProxy(FcitxIMClientHub* hub)
+{
+    if (!hub->proxy)
         return;
 
-    g_signal_connect(client->proxy, "destroy", G_CALLBACK(_destroy_cb), client);
+    g_signal_handlers_disconnect_by_func(hub->proxy, G_CALLBACK(_hub_destroy_cb), hub);
+    g_object_unref(hub->proxy);
+    hub->proxy = NULL;
+}
 
-    char* appname = fcitx_utils_get_process_name();
-    dbus_g_proxy_begin_call(client->proxy, "CreateICv2", FcitxIMClientCreateICCallback, client, NULL, G_TYPE_STRING, appname, G_TYPE_INVALID);
-    free(appname);
+static void _hub_destroy_cb(DBusGProxy *proxy, gpointer user_data)
+{
+    FcitxIMClientHub* hub = (FcitxIMClientHub*) user_data;
+    if (hub->proxy == proxy)
+        FcitxIMClientHubResetProxy(hub);
 }
 
 void FcitxIMClientCreateICCallback(DBusGProxy *proxy,
@@ -200,6 +761,10 @@ void FcitxIMClientCreateICCallback(DBusGProxy *proxy,
     client->triggerkey[1].sym = arg3;
     client->triggerkey[1].state = arg4;
     client->enable = enable;
+    /* a new IC starts unfocused and with no capacity or cursor on the daemon side */
+    client->serverfocus = false;
+    client->servercapacityvalid = false;
+    client->servercursorvalid = false;
 
 
     if (id >= 0)
@@ -207,195 +772,1003 @@ void FcitxIMClientCreateICCallback(DBusGProxy *proxy,
     else
         return;
 
-    sprintf(client->icname, FCITX_IC_DBUS_PATH, client->id);
+    FCITX_CLUTTER_PROBE1(ic_create, client->id);
+    FcitxStartupMark(FCITX_STARTUP_IC_CREATED);
 
-    client->icproxy = dbus_g_proxy_new_for_name_owner(client->conn,
-                      client->servicename,
-                      client->icname,
-                      FCITX_IC_DBUS_INTERFACE,
-                      &error
-                                                     );
-    if (!client->icproxy)
-        return;
-
-    dbus_g_proxy_add_signal(client->icproxy, "EnableIM", G_TYPE_INVALID);
-    dbus_g_proxy_add_signal(client->icproxy, "CloseIM", G_TYPE_INVALID);
-    dbus_g_proxy_add_signal(client->icproxy, "CommitString", G_TYPE_STRING, G_TYPE_INVALID);
-
-    dbus_g_object_register_marshaller(fcitx_marshall_VOID__STRING_INT, G_TYPE_NONE, G_TYPE_STRING, G_TYPE_INT, G_TYPE_INVALID);
+    FcitxIMClientDropIC(client);
+    sprintf(client->icname, FCITX_IC_DBUS_PATH, client->id);
+    g_hash_table_insert(client->hub->ics, client->icname, client);
+    client->hasic = true;
 
-    dbus_g_proxy_add_signal(client->icproxy, "UpdatePreedit", G_TYPE_STRING, G_TYPE_INT, G_TYPE_INVALID);
+    client->connectcb(client, client->data);
 
-    dbus_g_object_register_marshaller(fcitx_marshall_VOID__UINT_UINT_INT, G_TYPE_NONE, G_TYPE_UINT, G_TYPE_UINT, G_TYPE_INT, G_TYPE_INVALID);
+    /* anything set while there was no IC goes out now */
+    if (client->focus || client->capacityset || client->cursorset)
+        FcitxIMClientScheduleState(client);
 
-    dbus_g_proxy_add_signal(client->icproxy, "ForwardKey", G_TYPE_UINT, G_TYPE_UINT, G_TYPE_INT, G_TYPE_INVALID);
-    client->connectcb(client, client->data);
+    FcitxIMClientOpenKeyChannel(client);
 }
 
 void FcitxIMClientClose(FcitxIMClient* client)
 {
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "DestroyIC", G_TYPE_INVALID);
+    FCITX_CLUTTER_PROBE1(ic_destroy, client->id);
+    if (client->stateidle)
+        g_source_remove(client->stateidle);
+    FcitxIMClientCloseKeyChannel(client);
+    g_queue_free(client->keycalls);
+    /* batches still waiting report every key as not handled */
+    GList* batches = client->keybatches;
+    GList* iter;
+    client->keybatches = NULL;
+    for (iter = batches; iter; iter = g_list_next(iter)) {
+        FcitxIMClientKeyBatch* batch = (FcitxIMClientKeyBatch*) iter->data;
+        if (client->hub->batchprobe == batch)
+            client->hub->batchprobe = NULL;
+        batch->client = NULL;
+        dbus_pending_call_cancel(batch->pending);
     }
-    DBusGProxy* icproxy = client->icproxy;
+    g_list_free(batches);
+    FcitxIMClientCallNoReply(client, "DestroyIC", DBUS_TYPE_INVALID);
+    FcitxIMClientDisconnectSignal(client, NULL);
+    FcitxIMClientDropIC(client);
     DBusGProxy* proxy = client->proxy;
-    client->icproxy = NULL;
     client->proxy = NULL;
-    if (client->dbusproxy)
-        g_object_unref(client->dbusproxy);
+    client->hub->pending = g_list_remove(client->hub->pending, client);
+    FcitxIMClientHubRelease(client->hub, client);
     if (proxy)
         g_signal_handlers_disconnect_by_func(proxy, G_CALLBACK(_destroy_cb), client);
-    if (icproxy)
-        g_object_unref(icproxy);
     if (proxy)
         g_object_unref(proxy);
     free(client);
 }
 
 
-void FcitxIMClientEnableIC(FcitxIMClient* client)
+/* fire and forget call on the IC object */
+void FcitxIMClientCallNoReply(FcitxIMClient* client, const char* method, int first_arg_type, ...)
 {
-    if (client->icproxy)
-    {
-        dbus_g_proxy_call_no_reply(client->icproxy, "EnableIC", G_TYPE_INVALID);
+    DBusMessage* msg;
+    va_list args;
+
+    if (!client->hasic || !client->proxy)
+        return;
+
+    msg = dbus_message_new_method_call(dbus_g_proxy_get_bus_name(client->proxy),
+                                       client->icname,
+                                       FCITX_IC_DBUS_INTERFACE,
+                                       method);
+    if (!msg)
+        return;
+
+    va_start(args, first_arg_type);
+    if (dbus_message_append_args_valist(msg, first_arg_type, args)) {
+        dbus_message_set_no_reply(msg, TRUE);
+        dbus_connection_send(dbus_g_connection_get_connection(client->conn), msg, NULL);
     }
+    va_end(args);
+    dbus_message_unref(msg);
+}
+
+/* enable follows the daemon's EnableIM/CloseIM signals, so it is the shadow */
+void FcitxIMClientEnableIC(FcitxIMClient* client)
+{
+    if (!client->enable)
+        FcitxIMClientCallNoReply(client, "EnableIC", DBUS_TYPE_INVALID);
 }
 
 void FcitxIMClientCloseIC(FcitxIMClient* client)
 {
-    if (client->icproxy)
-    {
-        dbus_g_proxy_call_no_reply(client->icproxy, "CloseIC", G_TYPE_INVALID);
-    }
+    if (client->enable)
+        FcitxIMClientCallNoReply(client, "CloseIC", DBUS_TYPE_INVALID);
 }
 
+/*
+ * focus, capacity and cursor location are only recorded here and sent once
+ * the main loop is idle, or right before the next key, so a FocusOut/FocusIn
+ * pair within one iteration never reaches the daemon and a burst of cursor
+ * moves costs one message that never sits in front of a key event
+ */
 void FcitxIMClientFocusIn(FcitxIMClient* client)
 {
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "FocusIn", G_TYPE_INVALID);
-    }
+    client->focus = true;
+    FcitxIMClientScheduleState(client);
 }
 
 void FcitxIMClientFocusOut(FcitxIMClient* client)
 {
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "FocusOut", G_TYPE_INVALID);
+    client->focus = false;
+    FcitxIMClientScheduleState(client);
+}
+
+void FcitxIMClientScheduleState(FcitxIMClient* client)
+{
+    if (client->stateidle == 0)
+        client->stateidle = g_idle_add_full(G_PRIORITY_HIGH_IDLE, FcitxIMClientStateIdle, client, NULL);
+}
+
+gboolean FcitxIMClientStateIdle(gpointer user_data)
+{
+    FcitxIMClient* client = (FcitxIMClient*) user_data;
+    client->stateidle = 0;
+    FcitxIMClientFlushState(client);
+    return FALSE;
+}
+
+void FcitxIMClientFlushState(FcitxIMClient* client)
+{
+    if (client->stateidle) {
+        g_source_remove(client->stateidle);
+        client->stateidle = 0;
+    }
+
+    if (!client->hasic)
+        return;
+
+    if (client->capacityset) {
+        uint32_t iflags = client->capacity;
+        if (FcitxIMClientUseInline(client))
+            iflags |= FCITX_IM_CLIENT_CAPACITY_INLINE_RESULT;
+        if (!client->servercapacityvalid || client->servercapacity != iflags) {
+            client->servercapacity = iflags;
+            client->servercapacityvalid = true;
+            FcitxIMClientCallNoReply(client, "SetCapacity", DBUS_TYPE_UINT32, &iflags, DBUS_TYPE_INVALID);
+        }
+    }
+
+    if (client->cursorset
+        && (!client->servercursorvalid
+            || client->servercursorx != client->cursorx
+            || client->servercursory != client->cursory)) {
+        client->servercursorx = client->cursorx;
+        client->servercursory = client->cursory;
+        client->servercursorvalid = true;
+        FcitxIMClientCallNoReply(client, "SetCursorLocation",
+                                 DBUS_TYPE_INT32, &client->cursorx,
+                                 DBUS_TYPE_INT32, &client->cursory,
+                                 DBUS_TYPE_INVALID);
+    }
+
+    if (client->focus != client->serverfocus) {
+        client->serverfocus = client->focus;
+        FcitxIMClientCallNoReply(client, client->focus ? "FocusIn" : "FocusOut", DBUS_TYPE_INVALID);
     }
 }
 
 void FcitxIMClientReset(FcitxIMClient* client)
 {
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "Reset", G_TYPE_INVALID);
-    }
+    FcitxIMClientCallNoReply(client, "Reset", DBUS_TYPE_INVALID);
 }
 
 void FcitxIMClientSetCapacity(FcitxIMClient* client, FcitxCapacityFlags flags)
 {
-    uint32_t iflags = flags;
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "SetCapacity", G_TYPE_UINT, iflags, G_TYPE_INVALID);
-    }
+    client->capacity = flags;
+    client->capacityset = true;
+    if (!client->servercapacityvalid || (client->servercapacity & ~FCITX_IM_CLIENT_CAPACITY_INLINE_RESULT) != flags)
+        FcitxIMClientScheduleState(client);
+}
+
+void FcitxIMClientSetInlineResult(FcitxIMClient* client, boolean inlineresult)
+{
+    if (client->inlineresult == inlineresult)
+        return;
+    client->inlineresult = inlineresult;
+    if (client->capacityset)
+        FcitxIMClientScheduleState(client);
+}
+
+/* assume the daemon knows ProcessKeyEventInline until it tells otherwise */
+boolean FcitxIMClientUseInline(FcitxIMClient* client)
+{
+    return client->inlineresult && client->hub->inlineresult != FCITX_IM_CLIENT_SUPPORT_NO;
 }
 
 void FcitxIMClientSetCursorLocation(FcitxIMClient* client, int x, int y)
 {
-    if (client->icproxy) {
-        dbus_g_proxy_call_no_reply(client->icproxy, "SetCursorLocation", G_TYPE_INT, x, G_TYPE_INT, y, G_TYPE_INVALID);
+    client->cursorx = x;
+    client->cursory = y;
+    client->cursorset = true;
+    if (!client->servercursorvalid || client->servercursorx != x || client->servercursory != y)
+        FcitxIMClientScheduleState(client);
+}
+
+/*
+ * the key path talks to libdbus directly: messages come from libdbus' own
+ * message cache and the arguments are read in place, so a keystroke does
+ * not go through GValue arrays, DBusGProxyCall objects or string copies
+ */
+DBusMessage* FcitxIMClientNewKeyMessage(FcitxIMClient* client, const char* method,
+                                        uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
+{
+    int32_t itype = type;
+    DBusMessage* msg;
+
+    if (!client->hasic || !client->proxy)
+        return NULL;
+
+    msg = dbus_message_new_method_call(dbus_g_proxy_get_bus_name(client->proxy),
+                                                    client->icname,
+                                                    FCITX_IC_DBUS_INTERFACE,
+                                                    method);
+    if (!msg)
+        return NULL;
+
+    if (!dbus_message_append_args(msg,
+                                  DBUS_TYPE_UINT32, &keyval,
+                                  DBUS_TYPE_UINT32, &keycode,
+                                  DBUS_TYPE_UINT32, &state,
+                                  DBUS_TYPE_INT32, &itype,
+                                  DBUS_TYPE_UINT32, &t,
+                                  DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        return NULL;
     }
+    return msg;
+}
+
+DBusMessage* FcitxIMClientCallKey(FcitxIMClient* client, const char* method,
+                                  uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+                                  DBusError* error)
+{
+    DBusMessage* msg;
+    DBusMessage* reply;
+
+    FcitxIMClientFlushState(client);
+    msg = FcitxIMClientNewKeyMessage(client, method, keyval, keycode, state, type, t);
+    if (!msg)
+        return NULL;
+
+    reply = dbus_connection_send_with_reply_and_block(dbus_g_connection_get_connection(client->conn),
+                                                      msg, KEY_CALL_TIMEOUT, error);
+    dbus_message_unref(msg);
+    return reply;
+}
+
+/*
+ * the daemon may hand out a socket for key events next to the IC: a key then
+ * costs one small datagram each way instead of a marshalled DBus message
+ * routed through the bus daemon. DBus keeps carrying everything else, and
+ * any failure on the socket drops it for good and falls back to DBus.
+ */
+void FcitxIMClientOpenKeyChannel(FcitxIMClient* client)
+{
+    DBusMessage* msg;
+    DBusConnection* dbusconn = dbus_g_connection_get_connection(client->conn);
+
+    if (!client->hasic || client->keychannelcall
+        || !dbus_connection_can_send_type(dbusconn, DBUS_TYPE_UNIX_FD))
+        return;
+
+    msg = dbus_message_new_method_call(dbus_g_proxy_get_bus_name(client->proxy),
+                                       client->icname,
+                                       FCITX_IC_DBUS_INTERFACE,
+                                       "OpenKeyChannel");
+    if (!msg)
+        return;
+
+    dbus_connection_send_with_reply(dbusconn, msg, &client->keychannelcall, -1);
+    dbus_message_unref(msg);
+    if (client->keychannelcall)
+        dbus_pending_call_set_notify(client->keychannelcall, FcitxIMClientOpenKeyChannelNotify, client, NULL);
+}
+
+void FcitxIMClientOpenKeyChannelNotify(DBusPendingCall* pending, void* user_data)
+{
+    FcitxIMClient* client = (FcitxIMClient*) user_data;
+    DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+    int fd = -1;
+    int type = 0;
+    socklen_t len = sizeof(type);
+
+    dbus_pending_call_unref(client->keychannelcall);
+    client->keychannelcall = NULL;
+
+    if (!reply)
+        return;
+
+    /* an old daemon answers UnknownMethod, just keep using DBus */
+    if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN
+        || !dbus_message_get_args(reply, NULL, DBUS_TYPE_UNIX_FD, &fd, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        return;
+    }
+    dbus_message_unref(reply);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 || type != SOCK_SEQPACKET) {
+        FcitxLog(WARNING, "key channel is not a seqpacket socket");
+        close(fd);
+        return;
+    }
+
+    GIOChannel* channel = g_io_channel_unix_new(fd);
+    client->keyfd = fd;
+    client->keyserial = 0;
+    /* key replies go before redraws and other main loop housekeeping */
+    client->keywatch = g_io_add_watch_full(channel, G_PRIORITY_HIGH, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                           FcitxIMClientChannelWatch, client, NULL);
+    g_io_channel_unref(channel);
+    FcitxLog(LOG_LEVEL, "key channel opened for ic %d", client->id);
+}
+
+void FcitxIMClientCloseKeyChannel(FcitxIMClient* client)
+{
+    FcitxIMClientKeyCall* call;
+    GList* link;
+
+    if (client->keychannelcall) {
+        dbus_pending_call_cancel(client->keychannelcall);
+        dbus_pending_call_unref(client->keychannelcall);
+        client->keychannelcall = NULL;
+    }
+
+    if (client->keywatch) {
+        g_source_remove(client->keywatch);
+        client->keywatch = 0;
+    }
+
+    if (client->keydeliveridle) {
+        g_source_remove(client->keydeliveridle);
+        client->keydeliveridle = 0;
+    }
+
+    if (client->keyfd >= 0) {
+        close(client->keyfd);
+        client->keyfd = -1;
+    }
+
+    /* keys still waiting on the socket will never get an answer */
+    while ((link = g_queue_pop_head_link(client->keycalls))) {
+        call = (FcitxIMClientKeyCall*) link->data;
+        call->callback(call->answered ? call->ret : -1, call->user_data);
+        FcitxIMClientKeyCallFree(call);
+    }
+}
+
+boolean FcitxIMClientChannelSend(FcitxIMClient* client,
+                                 uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
+{
+    FcitxIMClientKeyRequest req;
+    ssize_t n;
+
+    req.serial = ++client->keyserial;
+    req.keyval = keyval;
+    req.keycode = keycode;
+    req.state = state;
+    req.type = type;
+    req.time = t;
+
+    do {
+        n = send(client->keyfd, &req, sizeof(req), MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != sizeof(req)) {
+        FcitxIMClientCloseKeyChannel(client);
+        return false;
+    }
+    return true;
+}
+
+boolean FcitxIMClientChannelRecv(FcitxIMClient* client, FcitxIMClientKeyReply* reply)
+{
+    struct pollfd pfd;
+    ssize_t n;
+    int r;
+
+    pfd.fd = client->keyfd;
+    pfd.events = POLLIN;
+    do {
+        r = poll(&pfd, 1, KEY_CALL_TIMEOUT);
+    } while (r < 0 && errno == EINTR);
+
+    if (r <= 0 || !(pfd.revents & POLLIN))
+        return false;
+
+    do {
+        n = recv(client->keyfd, reply, sizeof(*reply), 0);
+    } while (n < 0 && errno == EINTR);
+    return n == sizeof(*reply);
+}
+
+GList* FcitxIMClientChannelFirstUnanswered(FcitxIMClient* client)
+{
+    GList* iter = g_queue_peek_head_link(client->keycalls);
+    while (iter && ((FcitxIMClientKeyCall*) iter->data)->answered)
+        iter = g_list_next(iter);
+    return iter;
+}
+
+/*
+ * the key queues up on the socket behind the keys still in flight, so it
+ * can't overtake them; their replies come first and are kept for the main
+ * loop, no callback runs inside the blocking call
+ */
+boolean FcitxIMClientChannelKeySync(FcitxIMClient* client,
+                                    uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+                                    int* ret)
+{
+    FcitxIMClientKeyReply reply;
+    FcitxIMClientKeyCall* call;
+    GList* next;
+
+    if (client->keyfd < 0)
+        return false;
+
+    if (!FcitxIMClientChannelSend(client, keyval, keycode, state, type, t))
+        return false;
+
+    next = FcitxIMClientChannelFirstUnanswered(client);
+    while (FcitxIMClientChannelRecv(client, &reply)) {
+        if (reply.serial == client->keyserial) {
+            call = g_queue_peek_head(client->keycalls);
+            if (call && call->answered && !client->keydeliveridle)
+                client->keydeliveridle = g_idle_add_full(G_PRIORITY_HIGH, FcitxIMClientChannelDeliverIdle, client, NULL);
+            *ret = reply.ret;
+            return true;
+        }
+
+        call = next ? (FcitxIMClientKeyCall*) next->data : NULL;
+        if (!call || call->serial != reply.serial)
+            break;
+        call->ret = reply.ret;
+        call->answered = true;
+        next = g_list_next(next);
+    }
+
+    /* the key was sent, so it is not retried over DBus */
+    FcitxIMClientCloseKeyChannel(client);
+    *ret = -1;
+    return true;
+}
+
+void FcitxIMClientChannelDeliver(FcitxIMClient* client)
+{
+    FcitxIMClientKeyCall* call;
+
+    while ((call = g_queue_peek_head(client->keycalls)) && call->answered) {
+        g_queue_pop_head_link(client->keycalls);
+        FCITX_CLUTTER_PROBE3(key_reply, call->id, call->ret, FCITX_CLUTTER_PROBE_SINCE(call->start));
+        call->callback(call->ret, call->user_data);
+        FcitxIMClientKeyCallFree(call);
+    }
+}
+
+gboolean FcitxIMClientChannelDeliverIdle(gpointer user_data)
+{
+    FcitxIMClient* client = (FcitxIMClient*) user_data;
+    client->keydeliveridle = 0;
+    FcitxIMClientChannelDeliver(client);
+    return FALSE;
+}
+
+gboolean FcitxIMClientChannelWatch(GIOChannel* source, GIOCondition condition, gpointer user_data)
+{
+    FcitxIMClient* client = (FcitxIMClient*) user_data;
+    FcitxIMClientKeyReply reply;
+    FcitxIMClientKeyCall* call;
+    GList* next;
+    ssize_t n;
+
+    if (condition & G_IO_IN) {
+        n = recv(client->keyfd, &reply, sizeof(reply), MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR))
+            return TRUE;
+
+        next = FcitxIMClientChannelFirstUnanswered(client);
+        call = next ? (FcitxIMClientKeyCall*) next->data : NULL;
+        if (n == sizeof(reply) && call && reply.serial == call->serial) {
+            call->ret = reply.ret;
+            call->answered = true;
+            FcitxIMClientChannelDeliver(client);
+            return TRUE;
+        }
+    }
+
+    /* hangup, error or a reply out of sequence */
+    client->keywatch = 0;
+    FcitxIMClientCloseKeyChannel(client);
+    return FALSE;
+}
+
+boolean FcitxIMClientWaitKeyReplies(FcitxIMClient* client, int timeout)
+{
+    DBusConnection* conn;
+    FcitxIMClientKeyReply reply;
+    FcitxIMClientKeyCall* call;
+    GList* next;
+    struct pollfd pfd;
+    ssize_t n;
+    int r;
+
+    if (!IsFcitxIMClientValid(client))
+        return false;
+    conn = dbus_g_connection_get_connection(client->conn);
+
+    /* replies a synchronous key already read go first */
+    call = g_queue_peek_head(client->keycalls);
+    if (call && call->answered) {
+        FcitxIMClientChannelDeliver(client);
+        return true;
+    }
+
+    next = client->keyfd >= 0 ? FcitxIMClientChannelFirstUnanswered(client) : NULL;
+    if (!next)
+        return dbus_connection_read_write_dispatch(conn, timeout);
+
+    pfd.fd = client->keyfd;
+    pfd.events = POLLIN;
+    do {
+        r = poll(&pfd, 1, timeout);
+    } while (r < 0 && errno == EINTR);
+    if (r == 0)
+        return true;
+    if (r < 0 || !(pfd.revents & POLLIN))
+        return false;
+
+    do {
+        n = recv(client->keyfd, &reply, sizeof(reply), MSG_DONTWAIT);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && errno == EAGAIN)
+        return true;
+
+    call = (FcitxIMClientKeyCall*) next->data;
+    if (n != sizeof(reply) || reply.serial != call->serial) {
+        FcitxIMClientCloseKeyChannel(client);
+        return false;
+    }
+    call->ret = reply.ret;
+    call->answered = true;
+
+    /* the daemon flushed the commits of the key before its reply */
+    dbus_connection_read_write(conn, 0);
+    while (dbus_connection_dispatch(conn) == DBUS_DISPATCH_DATA_REMAINS);
+    FcitxIMClientChannelDeliver(client);
+    return true;
+}
+
+void FcitxIMClientProcessKeyNotify(DBusPendingCall* pending, void* user_data)
+{
+    FcitxIMClientKeyCall* call = (FcitxIMClientKeyCall*) user_data;
+    DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+    int32_t ret = -1;
+
+    if (reply) {
+        if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN
+            || !dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &ret, DBUS_TYPE_INVALID))
+            ret = -1;
+        dbus_message_unref(reply);
+    }
+
+    FCITX_CLUTTER_PROBE3(key_reply, call->id, ret, FCITX_CLUTTER_PROBE_SINCE(call->start));
+    call->callback(ret, call->user_data);
+}
+
+FcitxIMClientKeyCall* FcitxIMClientKeyCallNew(void)
+{
+    GList* link = freekeycalls;
+    FcitxIMClientKeyCall* call;
+
+    if (!link) {
+        call = g_slice_new(FcitxIMClientKeyCall);
+        call->link.data = call;
+        return call;
+    }
+
+    freekeycalls = link->next;
+    nfreekeycalls --;
+    return (FcitxIMClientKeyCall*) link->data;
+}
+
+void FcitxIMClientKeyCallFree(void* data)
+{
+    FcitxIMClientKeyCall* call = (FcitxIMClientKeyCall*) data;
+    if (call->notify)
+        call->notify(call->user_data);
+
+    if (nfreekeycalls >= KEY_CALL_CACHE_SIZE) {
+        g_slice_free(FcitxIMClientKeyCall, call);
+        return;
+    }
+    call->link.prev = NULL;
+    call->link.next = freekeycalls;
+    freekeycalls = &call->link;
+    nfreekeycalls ++;
 }
 
 void FcitxIMClientProcessKey(FcitxIMClient* client,
-                             DBusGProxyCallNotify callback,
+                             FcitxIMClientProcessKeyCallback callback,
                              void* user_data,
                              GDestroyNotify notify,
                              uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
 {
-    int itype = type;
-    dbus_g_proxy_begin_call(client->icproxy, "ProcessKeyEvent",
-                            callback,
-                            user_data,
-                            notify,
-                            G_TYPE_UINT, keyval,
-                            G_TYPE_UINT, keycode,
-                            G_TYPE_UINT, state,
-                            G_TYPE_INT, itype,
-                            G_TYPE_UINT, t,
-                            G_TYPE_INVALID
-                           );
+    DBusMessage* msg;
+    DBusPendingCall* pending = NULL;
+    FcitxIMClientKeyCall* call;
+
+    FcitxIMClientFlushState(client);
+    FCITX_CLUTTER_PROBE4(key_in, client->id, keyval, state, type);
+
+    call = FcitxIMClientKeyCallNew();
+    call->callback = callback;
+    call->user_data = user_data;
+    call->notify = notify;
+    call->id = client->id;
+    call->serial = 0;
+    call->answered = false;
+    call->ret = -1;
+    call->start = FCITX_CLUTTER_PROBE_TIME();
+
+    if (client->keyfd >= 0 && FcitxIMClientChannelSend(client, keyval, keycode, state, type, t)) {
+        call->serial = client->keyserial;
+        g_queue_push_tail_link(client->keycalls, &call->link);
+        return;
+    }
+
+    msg = FcitxIMClientNewKeyMessage(client, "ProcessKeyEvent", keyval, keycode, state, type, t);
+    if (msg) {
+        dbus_connection_send_with_reply(dbus_g_connection_get_connection(client->conn), msg, &pending, KEY_CALL_TIMEOUT);
+        dbus_message_unref(msg);
+    }
+
+    /* the connection is gone, report the key as not handled */
+    if (!pending) {
+        callback(-1, user_data);
+        FcitxIMClientKeyCallFree(call);
+        return;
+    }
+
+    dbus_pending_call_set_notify(pending, FcitxIMClientProcessKeyNotify, call, FcitxIMClientKeyCallFree);
+    dbus_pending_call_unref(pending);
+}
+
+FcitxIMClientKeyBatch* FcitxIMClientKeyBatchNew(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+        FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify)
+{
+    FcitxIMClientKeyBatch* batch = g_slice_new0(FcitxIMClientKeyBatch);
+    int i;
+
+    batch->callback = callback;
+    batch->user_data = user_data;
+    batch->notify = notify;
+    batch->keys = g_new(FcitxIMClientKeyEvent, n);
+    memcpy(batch->keys, keys, sizeof(FcitxIMClientKeyEvent) * n);
+    batch->ret = g_new(int, n);
+    batch->n = n;
+    batch->id = client->id;
+    batch->start = FCITX_CLUTTER_PROBE_TIME();
+    for (i = 0; i < n; i++)
+        batch->ret[i] = -1;
+    return batch;
+}
+
+void FcitxIMClientKeyBatchFree(void* data)
+{
+    FcitxIMClientKeyBatch* batch = (FcitxIMClientKeyBatch*) data;
+
+    if (!batch->delivered)
+        batch->callback(batch->ret, batch->n, batch->user_data);
+    if (batch->client)
+        batch->client->keybatches = g_list_remove(batch->client->keybatches, batch);
+    if (batch->notify)
+        batch->notify(batch->user_data);
+    g_free(batch->keys);
+    g_free(batch->ret);
+    g_slice_free(FcitxIMClientKeyBatch, batch);
+}
+
+void FcitxIMClientKeyBatchRelease(FcitxIMClientKeyBatch* batch)
+{
+    batch->remaining --;
+    if (batch->remaining == 0)
+        FcitxIMClientKeyBatchFree(batch);
+}
+
+void FcitxIMClientKeyBatchSlotCallback(int ret, void* user_data)
+{
+    FcitxIMClientKeyBatchSlot* slot = (FcitxIMClientKeyBatchSlot*) user_data;
+    slot->batch->ret[slot->index] = ret;
+}
+
+void FcitxIMClientKeyBatchSlotFree(void* data)
+{
+    FcitxIMClientKeyBatchSlot* slot = (FcitxIMClientKeyBatchSlot*) data;
+    FcitxIMClientKeyBatchRelease(slot->batch);
+    g_slice_free(FcitxIMClientKeyBatchSlot, slot);
+}
+
+/* every key is sent before the first reply is read, results are gathered */
+void FcitxIMClientProcessKeyPipelined(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+                                      FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify)
+{
+    FcitxIMClientKeyBatch* batch = FcitxIMClientKeyBatchNew(client, keys, n, callback, user_data, notify);
+    int i;
+
+    /* one extra reference so keys failing right away cannot finish it early */
+    batch->remaining = n + 1;
+    for (i = 0; i < n; i++) {
+        FcitxIMClientKeyBatchSlot* slot = g_slice_new(FcitxIMClientKeyBatchSlot);
+        slot->batch = batch;
+        slot->index = i;
+        FcitxIMClientProcessKey(client, FcitxIMClientKeyBatchSlotCallback, slot, FcitxIMClientKeyBatchSlotFree,
+                                batch->keys[i].keyval, batch->keys[i].keycode, batch->keys[i].state,
+                                batch->keys[i].type, batch->keys[i].time);
+    }
+    FcitxIMClientKeyBatchRelease(batch);
+}
+
+void FcitxIMClientProcessKeyBatch(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+                                  FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify)
+{
+    DBusMessage* msg = NULL;
+    DBusMessageIter args, array, entry;
+    DBusPendingCall* pending = NULL;
+    FcitxIMClientKeyBatch* batch;
+    FcitxIMClientHub* hub = client->hub;
+    int i;
+
+    /*
+     * a single key or the socket gain nothing from the batch call; while
+     * another client finds out whether the daemon knows it, pipeline
+     */
+    if (hub->batchkeys == FCITX_IM_CLIENT_SUPPORT_NO
+        || (hub->batchkeys == FCITX_IM_CLIENT_SUPPORT_UNKNOWN && hub->batchprobe)
+        || client->keyfd >= 0 || n < 2) {
+        FcitxIMClientProcessKeyPipelined(client, keys, n, callback, user_data, notify);
+        return;
+    }
+
+    FcitxIMClientFlushState(client);
+    batch = FcitxIMClientKeyBatchNew(client, keys, n, callback, user_data, notify);
+
+    if (client->hasic && client->proxy)
+        msg = dbus_message_new_method_call(dbus_g_proxy_get_bus_name(client->proxy),
+                                           client->icname,
+                                           FCITX_IC_DBUS_INTERFACE,
+                                           "ProcessKeyEventBatch");
+    if (msg) {
+        boolean ok = true;
+        dbus_message_iter_init_append(msg, &args);
+        ok = dbus_message_iter_open_container(&args, DBUS_TYPE_ARRAY, "(uuuiu)", &array);
+        for (i = 0; ok && i < n; i++) {
+            int32_t type = keys[i].type;
+            FCITX_CLUTTER_PROBE4(key_in, client->id, keys[i].keyval, keys[i].state, keys[i].type);
+            ok = dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry)
+                 && dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &keys[i].keyval)
+                 && dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &keys[i].keycode)
+                 && dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &keys[i].state)
+                 && dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT32, &type)
+                 && dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT32, &keys[i].time)
+                 && dbus_message_iter_close_container(&array, &entry);
+        }
+        if (ok && dbus_message_iter_close_container(&args, &array))
+            dbus_connection_send_with_reply(dbus_g_connection_get_connection(client->conn), msg, &pending, KEY_CALL_TIMEOUT);
+        dbus_message_unref(msg);
+    }
+
+    /* the connection is gone, report every key as not handled */
+    if (!pending) {
+        FcitxIMClientKeyBatchFree(batch);
+        return;
+    }
+
+    batch->client = client;
+    batch->pending = pending;
+    if (hub->batchkeys == FCITX_IM_CLIENT_SUPPORT_UNKNOWN)
+        hub->batchprobe = batch;
+    client->keybatches = g_list_prepend(client->keybatches, batch);
+    dbus_pending_call_set_notify(pending, FcitxIMClientKeyBatchNotify, batch, FcitxIMClientKeyBatchFree);
+    dbus_pending_call_unref(pending);
+}
+
+void FcitxIMClientKeyBatchNotify(DBusPendingCall* pending, void* user_data)
+{
+    FcitxIMClientKeyBatch* batch = (FcitxIMClientKeyBatch*) user_data;
+    DBusMessage* reply = dbus_pending_call_steal_reply(pending);
+    FcitxIMClientHub* hub = batch->client ? batch->client->hub : NULL;
+    int32_t* ret = NULL;
+    int len = 0;
+    int i;
+
+    if (!reply)
+        return;
+
+    /* no answer either way leaves it to the next batch to find out */
+    if (hub && hub->batchprobe == batch) {
+        hub->batchprobe = NULL;
+        if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN)
+            hub->batchkeys = FCITX_IM_CLIENT_SUPPORT_YES;
+    }
+
+    if (dbus_message_is_error(reply, DBUS_ERROR_UNKNOWN_METHOD) && hub) {
+        /* old daemon, hand the keys and the callback over to single calls */
+        FcitxLog(LOG_LEVEL, "ProcessKeyEventBatch is not supported");
+        hub->batchkeys = FCITX_IM_CLIENT_SUPPORT_NO;
+        FcitxIMClientProcessKeyPipelined(batch->client, batch->keys, batch->n,
+                                         batch->callback, batch->user_data, batch->notify);
+        batch->delivered = true;
+        batch->notify = NULL;
+        dbus_message_unref(reply);
+        return;
+    }
+
+    if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN
+        && dbus_message_get_args(reply, NULL, DBUS_TYPE_ARRAY, DBUS_TYPE_INT32, &ret, &len, DBUS_TYPE_INVALID)
+        && len == batch->n) {
+        for (i = 0; i < len; i++) {
+            batch->ret[i] = ret[i];
+            FCITX_CLUTTER_PROBE3(key_reply, batch->id, ret[i], FCITX_CLUTTER_PROBE_SINCE(batch->start));
+        }
+    }
+    dbus_message_unref(reply);
+
+    batch->delivered = true;
+    batch->callback(batch->ret, batch->n, batch->user_data);
 }
 
 int FcitxIMClientProcessKeySync(FcitxIMClient* client,
                                 uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t)
 {
-    int itype = type;
-    GError *error = NULL;
-    int ret = -1;
-    if (!dbus_g_proxy_call(client->icproxy, "ProcessKeyEvent",
-                           &error,
-                           G_TYPE_UINT, keyval,
-                           G_TYPE_UINT, keycode,
-                           G_TYPE_UINT, state,
-                           G_TYPE_INT, itype,
-                           G_TYPE_UINT, t,
-                           G_TYPE_INVALID,
-                           G_TYPE_INT, &ret,
-                           G_TYPE_INVALID
-                          )) {
+    DBusError error;
+    DBusMessage* reply;
+    int32_t ret = -1;
+    gint64 start = FCITX_CLUTTER_PROBE_TIME();
+
+    FCITX_CLUTTER_PROBE4(key_in, client->id, keyval, state, type);
+    FcitxIMClientFlushState(client);
+    if (FcitxIMClientChannelKeySync(client, keyval, keycode, state, type, t, &ret)) {
+        FCITX_CLUTTER_PROBE3(key_reply, client->id, ret, FCITX_CLUTTER_PROBE_SINCE(start));
+        return ret;
+    }
+
+    dbus_error_init(&error);
+    reply = FcitxIMClientCallKey(client, "ProcessKeyEvent", keyval, keycode, state, type, t, &error);
+    if (!reply) {
+        dbus_error_free(&error);
+        FCITX_CLUTTER_PROBE3(key_reply, client->id, -1, FCITX_CLUTTER_PROBE_SINCE(start));
         return -1;
     }
 
+    if (!dbus_message_get_args(reply, NULL, DBUS_TYPE_INT32, &ret, DBUS_TYPE_INVALID))
+        ret = -1;
+    dbus_message_unref(reply);
+
+    FCITX_CLUTTER_PROBE3(key_reply, client->id, ret, FCITX_CLUTTER_PROBE_SINCE(start));
     return ret;
 }
 
+int FcitxIMClientProcessKeySyncInline(FcitxIMClient* client,
+                                      uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+                                      FcitxIMClientKeyResult* result)
+{
+    DBusError error;
+    DBusMessage* reply;
+    int32_t ret = -1;
+    const char* commit = NULL;
+    const char* preedit = NULL;
+    int32_t cursor = -1;
+    gint64 start;
+
+    result->ret = -1;
+    result->isinline = false;
+    result->commit = NULL;
+    result->preedit = NULL;
+    result->cursor = -1;
+    result->reply = NULL;
+
+    /* the socket is cheaper than an inline reply, results come as signals */
+    if (!FcitxIMClientUseInline(client) || client->keyfd >= 0) {
+        result->ret = FcitxIMClientProcessKeySync(client, keyval, keycode, state, type, t);
+        return result->ret;
+    }
+
+    start = FCITX_CLUTTER_PROBE_TIME();
+    FCITX_CLUTTER_PROBE4(key_in, client->id, keyval, state, type);
+    dbus_error_init(&error);
+    reply = FcitxIMClientCallKey(client, "ProcessKeyEventInline", keyval, keycode, state, type, t, &error);
+    if (!reply) {
+        boolean unknown = dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD);
+        dbus_error_free(&error);
+        FCITX_CLUTTER_PROBE3(key_reply, client->id, -1, FCITX_CLUTTER_PROBE_SINCE(start));
+        /* old daemon, fall back to the ProcessKeyEvent reply plus signals */
+        if (unknown) {
+            GList* iter;
+            FcitxLog(LOG_LEVEL, "ProcessKeyEventInline is not supported");
+            client->hub->inlineresult = FCITX_IM_CLIENT_SUPPORT_NO;
+            /* stop advertising it on every IC, the shadows see the changed flags */
+            for (iter = client->hub->clients; iter; iter = g_list_next(iter))
+                FcitxIMClientScheduleState((FcitxIMClient*) iter->data);
+            result->ret = FcitxIMClientProcessKeySync(client, keyval, keycode, state, type, t);
+        }
+        return result->ret;
+    }
+
+    if (!dbus_message_get_args(reply, NULL,
+                               DBUS_TYPE_INT32, &ret,
+                               DBUS_TYPE_STRING, &commit,
+                               DBUS_TYPE_STRING, &preedit,
+                               DBUS_TYPE_INT32, &cursor,
+                               DBUS_TYPE_INVALID)) {
+        dbus_message_unref(reply);
+        FCITX_CLUTTER_PROBE3(key_reply, client->id, -1, FCITX_CLUTTER_PROBE_SINCE(start));
+        return -1;
+    }
+
+    FCITX_CLUTTER_PROBE3(key_reply, client->id, ret, FCITX_CLUTTER_PROBE_SINCE(start));
+    client->hub->inlineresult = FCITX_IM_CLIENT_SUPPORT_YES;
+    /* the strings point into the reply, which lives until the result is cleared */
+    result->ret = ret;
+    result->isinline = true;
+    result->commit = commit;
+    result->preedit = preedit;
+    result->cursor = cursor;
+    result->reply = reply;
+    return ret;
+}
+
+void FcitxIMClientKeyResultClear(FcitxIMClientKeyResult* result)
+{
+    if (result->reply)
+        dbus_message_unref((DBusMessage*) result->reply);
+    result->reply = NULL;
+    result->commit = NULL;
+    result->preedit = NULL;
+    result->isinline = false;
+}
+
+/*
+ * only one set of callbacks per client, signals are delivered by
+ * FcitxIMClientHubFilter with a NULL proxy
+ */
 void FcitxIMClientConnectSignal(FcitxIMClient* imclient,
                                 GCallback enableIM,
                                 GCallback closeIM,
                                 GCallback commitString,
                                 GCallback forwardKey,
                                 GCallback updatePreedit,
+                                GCallback updateClientSideUI,
                                 void* user_data,
                                 GClosureNotify freefunc
                                )
 {
-    dbus_g_proxy_connect_signal(imclient->icproxy,
-                                "EnableIM",
-                                enableIM,
-                                user_data,
-                                freefunc
-                               );
-
-    dbus_g_proxy_connect_signal(imclient->icproxy,
-                                "CloseIM",
-                                closeIM,
-                                user_data,
-                                freefunc
-                               );
-
-    dbus_g_proxy_connect_signal(imclient->icproxy,
-                                "CommitString",
-                                commitString,
-                                user_data,
-                                freefunc
-                               );
-
-    dbus_g_proxy_connect_signal(imclient->icproxy,
-                                "ForwardKey",
-                                forwardKey,
-                                user_data,
-                                freefunc
-                               );
-
-    dbus_g_proxy_connect_signal(imclient->icproxy,
-                                "UpdatePreedit",
-                                updatePreedit,
-                                user_data,
-                                freefunc
-                               );
+    FcitxIMClientDisconnectSignal(imclient, NULL);
+
+    imclient->enableIM = enableIM;
+    imclient->closeIM = closeIM;
+    imclient->commitString = commitString;
+    imclient->forwardKey = forwardKey;
+    imclient->updatePreedit = updatePreedit;
+    imclient->updateClientSideUI = updateClientSideUI;
+    imclient->signaldata = user_data;
+    imclient->signalfree = freefunc;
+}
+
+void FcitxIMClientDisconnectSignal(FcitxIMClient* imclient, void* user_data)
+{
+    GClosureNotify freefunc = imclient->signalfree;
+    void* data = imclient->signaldata;
+
+    if (user_data && user_data != data)
+        return;
+
+    imclient->enableIM = NULL;
+    imclient->closeIM = NULL;
+    imclient->commitString = NULL;
+    imclient->forwardKey = NULL;
+    imclient->updatePreedit = NULL;
+    imclient->updateClientSideUI = NULL;
+    imclient->signaldata = NULL;
+    imclient->signalfree = NULL;
+
+    if (freefunc && data)
+        freefunc(data, NULL);
 }
 
 FcitxHotkey* FcitxIMClientGetTriggerKey(FcitxIMClient* client)
 {
     return client->triggerkey;
 }
+
+int FcitxIMClientGetID(FcitxIMClient* client)
+{
+    if (client == NULL)
+        return -1;
+    return client->id;
+}
 // kate: indent-mode cstyle; space-indent on; indent-width 0;
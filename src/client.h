@@ -29,14 +29,60 @@
 extern "C" {
 #endif
 
+    /**
+     * capacity bit advertised to the daemon when the client accepts the
+     * commit string and preedit inline in the ProcessKeyEventInline reply
+     */
+#define FCITX_IM_CLIENT_CAPACITY_INLINE_RESULT (1u << 31)
+
+    /**
+     * ms a key may take; a slow but live daemon still processes it, giving
+     * up early would deliver it a second time as raw input
+     */
+#define FCITX_IM_CLIENT_KEY_TIMEOUT 25000
+
     typedef struct _FcitxIMClient FcitxIMClient;
+
+    /**
+     * result of a key event, commit and preedit are only filled when
+     * isinline is true, cursor < 0 means preedit is not changed
+     */
+    typedef struct _FcitxIMClientKeyResult {
+        int ret;
+        boolean isinline;
+        const char* commit;
+        const char* preedit;
+        int cursor;
+        void* reply;
+    } FcitxIMClientKeyResult;
+
     typedef void (*FcitxIMClientDestroyCallback)(FcitxIMClient* client, void* data);
     typedef void (*FcitxIMClientConnectCallback)(FcitxIMClient* client, void* data);
+    typedef void (*FcitxIMClientProcessKeyCallback)(int ret, void* user_data);
+    typedef void (*FcitxIMClientProcessKeyBatchCallback)(const int* ret, int n, void* user_data);
+
+    /** one entry of FcitxIMClientProcessKeyBatch */
+    typedef struct _FcitxIMClientKeyEvent {
+        uint32_t keyval;
+        uint32_t keycode;
+        uint32_t state;
+        FcitxKeyEventType type;
+        uint32_t time;
+    } FcitxIMClientKeyEvent;
 
 
-    FcitxIMClient* FcitxIMClientOpen(FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, GObject* data);
+    FcitxIMClient* FcitxIMClientOpen(FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data);
+    FcitxIMClient* FcitxIMClientOpenForDisplay(const char* display, FcitxIMClientConnectCallback connectcb, FcitxIMClientDestroyCallback destroycb, void* data);
     boolean IsFcitxIMClientValid(FcitxIMClient* client);
     boolean IsFcitxIMClientEnabled(FcitxIMClient* client);
+    /** whether keys currently go over the key channel instead of DBus */
+    boolean FcitxIMClientHasKeyChannel(FcitxIMClient* client);
+    /**
+     * whether the client's first ProcessKeyEventBatch is still in flight;
+     * an older daemon turns it into single keys, sent only once it says
+     * so, and keys sent directly meanwhile would overtake them
+     */
+    boolean FcitxIMClientIsProbingBatch(FcitxIMClient* client);
     void FcitxIMClientSetEnabled(FcitxIMClient* client, boolean enable);
     void FcitxIMClientClose(FcitxIMClient* client);
     void FcitxIMClientEnableIC(FcitxIMClient* client);
@@ -45,20 +91,46 @@ extern "C" {
     void FcitxIMClientFocusOut(FcitxIMClient* client);
     void FcitxIMClientSetCursorLocation(FcitxIMClient* client, int x, int y);
     void FcitxIMClientSetCapacity(FcitxIMClient* client, FcitxCapacityFlags flags);
+    /**
+     * whether the caller sends keys with FcitxIMClientProcessKeySyncInline,
+     * FCITX_IM_CLIENT_CAPACITY_INLINE_RESULT is advertised only then
+     */
+    void FcitxIMClientSetInlineResult(FcitxIMClient* client, boolean inlineresult);
     void FcitxIMClientReset(FcitxIMClient* client);
-    void FcitxIMClientProcessKey(FcitxIMClient* client, DBusGProxyCallNotify callback, void* user_data, GDestroyNotify notify, uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t);
+    void FcitxIMClientProcessKey(FcitxIMClient* client, FcitxIMClientProcessKeyCallback callback, void* user_data, GDestroyNotify notify, uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t);
+    /**
+     * send keys in order as one ProcessKeyEventBatch call, callback gets one
+     * result per key; daemons without it get the keys pipelined one by one
+     */
+    void FcitxIMClientProcessKeyBatch(FcitxIMClient* client, const FcitxIMClientKeyEvent* keys, int n,
+                                      FcitxIMClientProcessKeyBatchCallback callback, void* user_data, GDestroyNotify notify);
     int FcitxIMClientProcessKeySync(FcitxIMClient* client,
                                     uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t);
+    /**
+     * block up to timeout ms for what the daemon sent about keys in flight
+     * and deliver it, replies on the key channel with the commits before
+     * them or else whatever comes in on the bus; false once that is gone
+     */
+    boolean FcitxIMClientWaitKeyReplies(FcitxIMClient* client, int timeout);
+    int FcitxIMClientProcessKeySyncInline(FcitxIMClient* client,
+                                          uint32_t keyval, uint32_t keycode, uint32_t state, FcitxKeyEventType type, uint32_t t,
+                                          FcitxIMClientKeyResult* result);
+    void FcitxIMClientKeyResultClear(FcitxIMClientKeyResult* result);
     void FcitxIMClientConnectSignal(FcitxIMClient* imclient,
                                     GCallback enableIM,
                                     GCallback closeIM,
                                     GCallback commitString,
                                     GCallback forwardKey,
                                     GCallback updatePreedit,
+                                    GCallback updateClientSideUI,
                                     void* user_data,
                                     GClosureNotify freefunc
                                    );
+    /** drop the callbacks connected with user_data, or any with NULL */
+    void FcitxIMClientDisconnectSignal(FcitxIMClient* imclient, void* user_data);
     FcitxHotkey* FcitxIMClientGetTriggerKey(FcitxIMClient* client);
+    int FcitxIMClientGetID(FcitxIMClient* client);
+    const char* FcitxIMClientGetProcessName(void);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,403 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <locale.h>
+#include <glib.h>
+#include <X11/Xlib.h>
+#include "fcitx-utils/log.h"
+
+#include "compose.h"
+
+#define LOG_LEVEL DEBUG
+#define COMPOSE_SEQUENCE_MAX 8
+#define COMPOSE_INCLUDE_DEPTH 8
+#define DEFAULT_X11_LOCALEDIR "/usr/share/X11/locale"
+
+/**
+ * node of the trie, children of a node are chained through sibling,
+ * node 0 is the root and result is an offset into the string pool
+ */
+typedef struct _FcitxComposeNode {
+    uint32_t keysym;
+    int32_t child;
+    int32_t sibling;
+    int32_t result;
+} FcitxComposeNode;
+
+struct _FcitxComposeTable {
+    FcitxComposeNode* nodes;
+    int nnodes;
+    char* strings;
+};
+
+typedef struct _FcitxComposeBuilder {
+    GArray* nodes;
+    GString* strings;
+} FcitxComposeBuilder;
+
+static void FcitxComposeParseFile(FcitxComposeBuilder* builder, const char* path, int depth);
+static void FcitxComposeParseLine(FcitxComposeBuilder* builder, char* line, int depth);
+static char* FcitxComposeParseString(char** p);
+static char* FcitxComposeExpandPath(const char* path);
+static char* FcitxComposeSystemFile(void);
+static void FcitxComposeInsert(FcitxComposeBuilder* builder, const uint32_t* seq, int len, const char* result);
+static int32_t FcitxComposeFindChild(const FcitxComposeNode* nodes, int32_t parent, uint32_t keysym);
+static gboolean FcitxComposeIsModifier(uint32_t keysym);
+
+FcitxComposeTable* FcitxComposeTableLoad(void)
+{
+    FcitxComposeBuilder builder;
+    FcitxComposeNode root = { 0, -1, -1, -1 };
+    FcitxComposeTable* table;
+    const char* env = getenv("XCOMPOSEFILE");
+    char* path = NULL;
+
+    builder.nodes = g_array_new(FALSE, FALSE, sizeof(FcitxComposeNode));
+    builder.strings = g_string_new(NULL);
+    g_array_append_val(builder.nodes, root);
+
+    /* same lookup order as Xlib */
+    if (env) {
+        path = g_strdup(env);
+    } else {
+        path = g_build_filename(g_get_home_dir(), ".XCompose", NULL);
+        if (!g_file_test(path, G_FILE_TEST_EXISTS)) {
+            g_free(path);
+            path = FcitxComposeSystemFile();
+        }
+    }
+
+    if (path)
+        FcitxComposeParseFile(&builder, path, 0);
+    g_free(path);
+
+    if (builder.nodes->len == 1) {
+        g_array_free(builder.nodes, TRUE);
+        g_string_free(builder.strings, TRUE);
+        return NULL;
+    }
+
+    table = g_new0(FcitxComposeTable, 1);
+    table->nnodes = builder.nodes->len;
+    table->nodes = (FcitxComposeNode*) g_array_free(builder.nodes, FALSE);
+    table->strings = g_string_free(builder.strings, FALSE);
+    FcitxLog(LOG_LEVEL, "compose table with %d nodes", table->nnodes);
+    return table;
+}
+
+void FcitxComposeTableFree(FcitxComposeTable* table)
+{
+    if (!table)
+        return;
+    g_free(table->nodes);
+    g_free(table->strings);
+    g_free(table);
+}
+
+FcitxComposeResult FcitxComposeTableFeed(FcitxComposeTable* table, int* state, uint32_t keysym, const char** result)
+{
+    int32_t node;
+
+    /* shift and friends are pressed in the middle of sequences */
+    if (FcitxComposeIsModifier(keysym))
+        return COMPOSE_NONE;
+
+    node = FcitxComposeFindChild(table->nodes, *state, keysym);
+    if (node < 0) {
+        if (*state == FCITX_COMPOSE_STATE_INIT)
+            return COMPOSE_NONE;
+        *state = FCITX_COMPOSE_STATE_INIT;
+        return COMPOSE_CANCEL;
+    }
+
+    if (table->nodes[node].child >= 0) {
+        *state = node;
+        return COMPOSE_PARTIAL;
+    }
+
+    *state = FCITX_COMPOSE_STATE_INIT;
+    if (table->nodes[node].result < 0)
+        return COMPOSE_CANCEL;
+    *result = table->strings + table->nodes[node].result;
+    return COMPOSE_COMMIT;
+}
+
+int32_t FcitxComposeFindChild(const FcitxComposeNode* nodes, int32_t parent, uint32_t keysym)
+{
+    int32_t node;
+    for (node = nodes[parent].child; node >= 0; node = nodes[node].sibling) {
+        if (nodes[node].keysym == keysym)
+            return node;
+    }
+    return -1;
+}
+
+gboolean FcitxComposeIsModifier(uint32_t keysym)
+{
+    /* Shift_L .. Hyper_R, ISO_Lock .. ISO_Last_Group_Lock, Mode_switch, Num_Lock */
+    return (keysym >= 0xffe1 && keysym <= 0xffee)
+           || (keysym >= 0xfe01 && keysym <= 0xfe0f)
+           || keysym == 0xff7e || keysym == 0xff7f;
+}
+
+void FcitxComposeInsert(FcitxComposeBuilder* builder, const uint32_t* seq, int len, const char* result)
+{
+    int32_t cur = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        FcitxComposeNode* nodes = (FcitxComposeNode*) builder->nodes->data;
+        int32_t next = FcitxComposeFindChild(nodes, cur, seq[i]);
+        if (next < 0) {
+            FcitxComposeNode node = { seq[i], -1, nodes[cur].child, -1 };
+            next = builder->nodes->len;
+            g_array_append_val(builder->nodes, node);
+            g_array_index(builder->nodes, FcitxComposeNode, cur).child = next;
+        }
+        cur = next;
+    }
+
+    g_array_index(builder->nodes, FcitxComposeNode, cur).result = builder->strings->len;
+    g_string_append_len(builder->strings, result, strlen(result) + 1);
+}
+
+void FcitxComposeParseFile(FcitxComposeBuilder* builder, const char* path, int depth)
+{
+    FILE* fp;
+    char* line = NULL;
+    size_t size = 0;
+
+    if (depth > COMPOSE_INCLUDE_DEPTH)
+        return;
+
+    fp = fopen(path, "r");
+    if (!fp)
+        return;
+
+    while (getline(&line, &size, fp) != -1)
+        FcitxComposeParseLine(builder, line, depth);
+
+    free(line);
+    fclose(fp);
+}
+
+/*
+ * <Multi_key> <apostrophe> <e> : "é" eacute
+ * include "%L"
+ */
+void FcitxComposeParseLine(FcitxComposeBuilder* builder, char* line, int depth)
+{
+    uint32_t seq[COMPOSE_SEQUENCE_MAX];
+    int len = 0;
+    char* p = line;
+    char* str;
+
+    while (isspace((unsigned char) *p))
+        p++;
+
+    if (strncmp(p, "include", strlen("include")) == 0) {
+        p += strlen("include");
+        while (isspace((unsigned char) *p))
+            p++;
+        str = FcitxComposeParseString(&p);
+        if (str) {
+            char* path = FcitxComposeExpandPath(str);
+            if (path)
+                FcitxComposeParseFile(builder, path, depth + 1);
+            g_free(path);
+            g_free(str);
+        }
+        return;
+    }
+
+    while (*p == '<') {
+        char* end = strchr(p, '>');
+        KeySym keysym;
+        if (!end || len == COMPOSE_SEQUENCE_MAX)
+            return;
+        *end = '\0';
+        keysym = XStringToKeysym(p + 1);
+        if (keysym == NoSymbol)
+            return;
+        seq[len++] = keysym;
+        p = end + 1;
+        while (isspace((unsigned char) *p))
+            p++;
+    }
+
+    if (len == 0 || *p != ':')
+        return;
+    p++;
+    while (isspace((unsigned char) *p))
+        p++;
+
+    /* lines that only give a keysym as result are not useful without X */
+    str = FcitxComposeParseString(&p);
+    if (!str)
+        return;
+    if (str[0] && g_utf8_validate(str, -1, NULL))
+        FcitxComposeInsert(builder, seq, len, str);
+    g_free(str);
+}
+
+char* FcitxComposeParseString(char** pp)
+{
+    GString* str;
+    char* p = *pp;
+
+    if (*p != '"')
+        return NULL;
+    p++;
+
+    str = g_string_new(NULL);
+    while (*p && *p != '"') {
+        if (*p != '\\') {
+            g_string_append_c(str, *p++);
+            continue;
+        }
+
+        p++;
+        if (*p == 'n') {
+            g_string_append_c(str, '\n');
+            p++;
+        } else if (*p == 'x' || *p == 'X') {
+            int value = 0, i;
+            p++;
+            for (i = 0; i < 2 && isxdigit((unsigned char) *p); i++, p++)
+                value = value * 16 + g_ascii_xdigit_value(*p);
+            g_string_append_c(str, (char) value);
+        } else if (*p >= '0' && *p <= '7') {
+            int value = 0, i;
+            for (i = 0; i < 3 && *p >= '0' && *p <= '7'; i++, p++)
+                value = value * 8 + (*p - '0');
+            g_string_append_c(str, (char) value);
+        } else if (*p) {
+            g_string_append_c(str, *p++);
+        }
+    }
+
+    if (*p != '"') {
+        g_string_free(str, TRUE);
+        return NULL;
+    }
+    *pp = p + 1;
+    return g_string_free(str, FALSE);
+}
+
+char* FcitxComposeExpandPath(const char* path)
+{
+    GString* result = g_string_new(NULL);
+    const char* p;
+
+    for (p = path; *p; p++) {
+        if (*p != '%') {
+            g_string_append_c(result, *p);
+            continue;
+        }
+        p++;
+        if (*p == 'H') {
+            g_string_append(result, g_get_home_dir());
+        } else if (*p == 'L') {
+            char* system = FcitxComposeSystemFile();
+            if (!system) {
+                g_string_free(result, TRUE);
+                return NULL;
+            }
+            g_string_append(result, system);
+            g_free(system);
+        } else if (*p == 'S') {
+            const char* dir = getenv("XLOCALEDIR");
+            g_string_append(result, dir ? dir : DEFAULT_X11_LOCALEDIR);
+        } else if (*p == '%') {
+            g_string_append_c(result, '%');
+        } else {
+            break;
+        }
+    }
+
+    return g_string_free(result, FALSE);
+}
+
+/* en_US.UTF-8 and en_US.utf8 are the same locale */
+static char* FcitxComposeNormalizeLocale(const char* locale)
+{
+    GString* result = g_string_new(NULL);
+    for (; *locale; locale++) {
+        if (*locale != '-')
+            g_string_append_c(result, g_ascii_tolower(*locale));
+    }
+    return g_string_free(result, FALSE);
+}
+
+/* look the locale up in compose.dir, as Xlib does for %L */
+char* FcitxComposeSystemFile(void)
+{
+    const char* dir = getenv("XLOCALEDIR");
+    const char* locale = setlocale(LC_CTYPE, NULL);
+    char* composedir;
+    char* wanted;
+    char* line = NULL;
+    char* result = NULL;
+    size_t size = 0;
+    FILE* fp;
+
+    if (!dir)
+        dir = DEFAULT_X11_LOCALEDIR;
+
+    if (!locale || strcmp(locale, "C") == 0 || strcmp(locale, "POSIX") == 0) {
+        locale = getenv("LC_ALL");
+        if (!locale || !locale[0])
+            locale = getenv("LC_CTYPE");
+        if (!locale || !locale[0])
+            locale = getenv("LANG");
+        if (!locale || !locale[0])
+            locale = "en_US.UTF-8";
+    }
+
+    composedir = g_build_filename(dir, "compose.dir", NULL);
+    fp = fopen(composedir, "r");
+    g_free(composedir);
+    if (!fp)
+        return NULL;
+
+    wanted = FcitxComposeNormalizeLocale(locale);
+    while (!result && getline(&line, &size, fp) != -1) {
+        char file[256], name[256];
+        char* normalized;
+        if (line[0] == '#' || sscanf(line, "%255s %255s", file, name) != 2)
+            continue;
+        if (file[strlen(file) - 1] == ':')
+            file[strlen(file) - 1] = '\0';
+        normalized = FcitxComposeNormalizeLocale(name);
+        if (strcmp(normalized, wanted) == 0)
+            result = g_build_filename(dir, file, NULL);
+        g_free(normalized);
+    }
+
+    free(line);
+    fclose(fp);
+    g_free(wanted);
+    return result;
+}
+
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
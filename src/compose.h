@@ -0,0 +1,54 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_COMPOSE_H
+#define FCITX_COMPOSE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * X Compose sequences compiled into a trie, used to keep dead keys and
+     * Multi_key working while the fcitx daemon is not there
+     */
+    typedef struct _FcitxComposeTable FcitxComposeTable;
+
+    typedef enum _FcitxComposeResult {
+        COMPOSE_NONE,       /* not part of any sequence, pass the key on */
+        COMPOSE_PARTIAL,    /* sequence goes on, eat the key */
+        COMPOSE_COMMIT,     /* sequence finished, commit the result */
+        COMPOSE_CANCEL      /* sequence broken, eat the key */
+    } FcitxComposeResult;
+
+    /* the initial state, also what a finished or broken sequence returns to */
+#define FCITX_COMPOSE_STATE_INIT 0
+
+    FcitxComposeTable* FcitxComposeTableLoad(void);
+    void FcitxComposeTableFree(FcitxComposeTable* table);
+    FcitxComposeResult FcitxComposeTableFeed(FcitxComposeTable* table, int* state, uint32_t keysym, const char** result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
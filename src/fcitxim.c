@@ -23,6 +23,7 @@
 #include <clutter-imcontext/clutter-immodule.h>
 #include "fcitx/fcitx.h"
 #include "fcitximcontext.h"
+#include "startup.h"
 
 static const ClutterIMContextInfo fcitx_im_info = {
     "fcitx",
@@ -40,6 +41,7 @@ FCITX_EXPORT_API
 G_MODULE_EXPORT const gchar*
 g_module_check_init(GModule *module)
 {
+    FcitxStartupMark(FCITX_STARTUP_CHECK_INIT);
     return glib_check_version(GLIB_MAJOR_VERSION,
                               GLIB_MINOR_VERSION,
                               0);
@@ -49,8 +51,10 @@ FCITX_EXPORT_API
 G_MODULE_EXPORT void
 im_module_init(GTypeModule *type_module)
 {
+    FcitxStartupMark(FCITX_STARTUP_MODULE_INIT);
     /* make module resident */
     g_type_module_use(type_module);
+    fcitx_im_context_load_settings();
     fcitx_im_context_register_type(type_module);
 }
 
@@ -66,6 +70,7 @@ im_module_create(const gchar *context_id)
 {
     if (context_id != NULL && strcmp(context_id, "fcitx") == 0) {
         FcitxIMContext *context;
+        FcitxStartupMark(FCITX_STARTUP_CONTEXT_CREATE);
         context = fcitx_im_context_new();
         return (ClutterIMContext *) context;
     }
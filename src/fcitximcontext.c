@@ -32,17 +32,46 @@
 #include <stdlib.h>
 #include <string.h>
 #include <clutter/x11/clutter-x11.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <clutter-imcontext/clutter-imcontext.h>
 #include <clutter/clutter-keysyms.h>
 #include "fcitx/fcitx.h"
 #include "fcitximcontext.h"
 #include "fcitx-config/fcitx-config.h"
 #include "client.h"
+#include "probes.h"
+#include "utf8index.h"
+#include "compose.h"
+#include "startup.h"
+#include "candidatepanel.h"
+#include "latency.h"
 #include <fcitx-utils/log.h>
 #include <dbus/dbus-glib.h>
 #include <sys/time.h>
 
 #define LOG_LEVEL DEBUG
+/* ms to wait for the X server to place the stage */
+#define GEOMETRY_TIMEOUT 1000
+/* finished key structs kept for the next keys, enough for a full key queue */
+#define KEY_STRUCT_CACHE_SIZE 32
+/* keys per ProcessKeyEventBatch, a longer backlog takes several */
+#define KEY_BATCH_MAX 16
+/* ms a key may wait before filter_keypress and still be timed from its X stamp */
+#define KEY_TIME_MAX_AGE 1000
+
+/*
+ * typing latency, all measured from the key press as stamped by the X
+ * server: until the daemon answered, until the first commit/preedit
+ * change caused by the key and until the stage painted that change
+ */
+typedef enum _FcitxIMContextLatency {
+    FCITX_IM_CONTEXT_LATENCY_REPLY,
+    FCITX_IM_CONTEXT_LATENCY_CHANGE,
+    FCITX_IM_CONTEXT_LATENCY_PAINT,
+    FCITX_IM_CONTEXT_LATENCY_LAST
+} FcitxIMContextLatency;
 
 struct _FcitxIMContext {
     ClutterIMContext parent;
@@ -52,15 +81,66 @@ struct _FcitxIMContext {
     guint32 time;
     gboolean use_preedit;
     gboolean is_inpreedit;
-    char* preedit_string;
+    GString* preedit;
+    FcitxUtf8Index preedit_index;
     int cursor_pos;
+    guint cursor_location_idle_id;
+    xcb_connection_t* geometry_conn;
+    unsigned int geometry_sequence;
+    GSource* geometry_source;
+    GString* echo;
+    /* leading echo characters whose keys the daemon already answered */
+    int echo_answered;
+    /* bumped whenever the echo is thrown away */
+    guint echo_serial;
+    struct _FcitxIMStageIC* stageic;
+    int inflight;
+    GQueue* waiting;
+    int compose_state;
+    ClutterIMRectangle cursor_area;
+    FcitxLatencyHistogram latency[FCITX_IM_CONTEXT_LATENCY_LAST];
+    gint64 key_start;
+    /* the key behind key_start got its reply, its change must come next */
+    gboolean key_answered;
+    gint64 paint_start;
+    ClutterActor* paint_stage;
+    gulong paint_handler;
 };
 
+/* one server side IC multiplexed between all the contexts of a stage */
+typedef struct _FcitxIMStageIC {
+    FcitxIMClient* client;
+    FcitxIMContext* owner;
+    ClutterActor* stage;
+    int ref;
+} FcitxIMStageIC;
+
+#define STAGE_IC_KEY "fcitx-stage-ic"
+
 typedef struct _ProcessKeyStruct {
     FcitxIMContext* context;
-    ClutterKeyEvent* event;
+    ClutterKeyEvent event;
+    gboolean predicted;
+    guint echo_serial;
+    gint64 start;
+    /* node in waiting or in a batch, or the next struct of the free list */
+    GList link;
 } ProcessKeyStruct;
 
+/*
+ * waits for the stage origin on the X connection; clutter reads the same
+ * socket and may have queued the reply already, so it is looked for on
+ * every iteration, not only when the fd is readable
+ */
+typedef struct _FcitxGeometrySource {
+    GSource source;
+    GPollFD pollfd;
+    FcitxIMContext* context;
+    gint64 deadline;
+    gboolean done;
+    xcb_translate_coordinates_reply_t* reply;
+} FcitxGeometrySource;
+
 struct _FcitxIMContextClass {
     ClutterIMContextClass parent;
     /* klass members */
@@ -70,6 +150,10 @@ struct _FcitxIMContextClass {
 static void     fcitx_im_context_class_init(FcitxIMContextClass   *klass);
 static void     fcitx_im_context_init(FcitxIMContext        *im_context);
 static void     fcitx_im_context_finalize(GObject               *obj);
+static void     fcitx_im_context_get_property(GObject *object,
+        guint prop_id,
+        GValue *value,
+        GParamSpec *pspec);
 static gboolean fcitx_im_context_filter_keypress(ClutterIMContext          *context,
         ClutterKeyEvent           *key);
 static void     fcitx_im_context_reset(ClutterIMContext          *context);
@@ -89,6 +173,22 @@ static void     fcitx_im_context_get_preedit_string(ClutterIMContext          *c
 
 static void
 _set_cursor_location_internal(FcitxIMContext *fcitxcontext);
+static gboolean
+_set_cursor_location_idle_cb(gpointer user_data);
+static void
+_cancel_cursor_location_idle(FcitxIMContext *fcitxcontext);
+static gboolean
+_geometry_source_prepare(GSource* source, gint* timeout);
+static gboolean
+_geometry_source_check(GSource* source);
+static gboolean
+_geometry_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data);
+static void
+_geometry_source_finalize(GSource* source);
+static void
+_cancel_geometry_request(FcitxIMContext *fcitxcontext);
+static void
+_set_cursor_location_with_origin(FcitxIMContext *fcitxcontext, int origin_x, int origin_y);
 static void
 _fcitx_im_context_enable_im_cb(DBusGProxy* proxy, void* user_data);
 static void
@@ -100,11 +200,74 @@ _fcitx_im_context_forward_key_cb(DBusGProxy* proxy, guint keyval, guint state, g
 static void
 _fcitx_im_context_update_preedit_cb(DBusGProxy* proxy, char* str, int cursor_pos, void* user_data);
 static void
+_fcitx_im_context_update_client_side_ui_cb(DBusGProxy* proxy, char* auxup, char* auxdown, char* preedit,
+        char* candidateword, char* imname, int cursorpos, void* user_data);
+static void
+_fcitx_im_context_hide_candidates(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_context_latency_changed(FcitxIMContext* fcitxcontext);
+static gint64
+_fcitx_im_context_key_start(ClutterKeyEvent* event);
+static void
+_fcitx_im_context_key_answered(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, int ret, gboolean done);
+static void
+_fcitx_im_context_latency_paint_cb(ClutterActor* stage, gpointer user_data);
+static void
+_fcitx_im_context_latency_unhook(FcitxIMContext* fcitxcontext);
+static void
 _fcitx_im_context_connect_cb(FcitxIMClient* client, void* user_data);
 static void
 _fcitx_im_context_destroy_cb(FcitxIMClient* client, void* user_data);
 static void
 _fcitx_im_context_set_capacity(FcitxIMContext* fcitxcontext);
+static gboolean
+_fcitx_im_context_preedit_visible(FcitxIMContext* fcitxcontext);
+static gboolean
+_fcitx_im_context_can_predict(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event);
+static void
+_fcitx_im_context_clear_echo(FcitxIMContext* fcitxcontext, gboolean notify);
+static void
+_fcitx_im_context_drop_answered_echo(FcitxIMContext* fcitxcontext, gboolean notify);
+static void
+_fcitx_im_context_process_key_async(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, gboolean predicted);
+static gboolean
+_fcitx_im_context_drain_keys(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_context_process_key_cb(int ret, void* user_data);
+static ProcessKeyStruct*
+_process_key_struct_new(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, gboolean predicted);
+static void
+_process_key_struct_free(gpointer data);
+static void
+_fcitx_im_context_send_key(ProcessKeyStruct* pks);
+static void
+_fcitx_im_context_pump_keys(FcitxIMContext* fcitxcontext);
+static void
+_process_key_struct_done(gpointer data);
+static void
+_fcitx_im_context_send_key_batch(FcitxIMContext* fcitxcontext, int n);
+static void
+_fcitx_im_context_process_key_batch_cb(const int* ret, int n, void* user_data);
+static void
+_process_key_batch_done(gpointer data);
+static gboolean
+_is_same_key(ClutterKeyEvent* a, ClutterKeyEvent* b);
+static gboolean
+_fcitx_im_context_compress_key(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event);
+static void
+_fcitx_im_context_emit_key_event(ClutterIMContext* context, ClutterKeyEvent* event);
+static void
+_fcitx_im_context_connect_signals(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_context_disconnect_signals(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_context_attach_stage_ic(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_context_detach_stage_ic(FcitxIMContext* fcitxcontext);
+static void
+_fcitx_im_stage_ic_connect_cb(FcitxIMClient* client, void* user_data);
+static gboolean
+_fcitx_im_context_filter_compose(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event);
 
 static GType _fcitx_type_im_context = 0;
 
@@ -115,9 +278,57 @@ static guint _signal_preedit_end_id = 0;
 static guint _signal_delete_surrounding_id = 0;
 static guint _signal_retrieve_surrounding_id = 0;
 
+/* show printable keys in the preedit before the daemon answers */
+static gboolean _local_echo = FALSE;
+/* let all the contexts of a stage share one IC */
+static gboolean _shared_ic = FALSE;
+typedef enum _FcitxIMContextMode {
+    /* block in filter_keypress until the daemon answers */
+    FCITX_IM_CONTEXT_MODE_SYNC,
+    /* send every key asynchronously and re-emit the unhandled ones */
+    FCITX_IM_CONTEXT_MODE_ASYNC,
+    /* async, except for keys that may move the focus away */
+    FCITX_IM_CONTEXT_MODE_HYBRID
+} FcitxIMContextMode;
+
+static FcitxIMContextMode _process_mode = FCITX_IM_CONTEXT_MODE_SYNC;
+/* draw the candidate list on the stage instead of the daemon's window */
+static gboolean _client_side_ui = FALSE;
+/* keys waiting for a reply before new ones are held back and compressed */
+static int _key_queue_depth = 8;
+/* recycled key structs, chained through their link */
+static GList* _key_struct_cache = NULL;
+static int _key_struct_cached = 0;
+
+static GSourceFuncs _geometry_source_funcs = {
+    _geometry_source_prepare,
+    _geometry_source_check,
+    _geometry_source_dispatch,
+    _geometry_source_finalize,
+    NULL,
+    NULL
+};
+
+/* Compose table used while the daemon is away, loaded on first need */
+static FcitxComposeTable* _compose_table = NULL;
+static gboolean _compose_loaded = FALSE;
+
+static gboolean _settings_loaded = FALSE;
+
+/* read-only properties, latency-<stage>-<count|p50|p90|p99> in microseconds */
+static const char* _latency_stage_names[FCITX_IM_CONTEXT_LATENCY_LAST] = { "reply", "change", "paint" };
+static const double _latency_percents[] = { 50, 90, 99 };
+#define LATENCY_PROPS_PER_STAGE (1 + G_N_ELEMENTS(_latency_percents))
+
 
 static
 boolean FcitxIsHotKey(FcitxKeySym sym, int state, FcitxHotkey * hotkey);
+static gboolean
+_fcitx_im_context_parse_mode(const char* str, FcitxIMContextMode* mode);
+static void
+_fcitx_im_context_load_group(GKeyFile* keyfile, const char* group);
+static gboolean
+_fcitx_im_context_is_focus_key(ClutterKeyEvent* event);
 
 static
 boolean FcitxIsHotKey(FcitxKeySym sym, int state, FcitxHotkey * hotkey)
@@ -199,6 +410,25 @@ fcitx_im_context_class_init(FcitxIMContextClass *klass)
     im_context_class->show = fcitx_im_context_show;
     im_context_class->hide = fcitx_im_context_hide;
     gobject_class->finalize = fcitx_im_context_finalize;
+    gobject_class->get_property = fcitx_im_context_get_property;
+
+    int stage;
+    guint i;
+    for (stage = 0; stage < FCITX_IM_CONTEXT_LATENCY_LAST; stage++) {
+        guint prop = 1 + stage * LATENCY_PROPS_PER_STAGE;
+        char* name = g_strdup_printf("latency-%s-count", _latency_stage_names[stage]);
+        g_object_class_install_property(gobject_class, prop,
+                                        g_param_spec_uint64(name, name, "Number of samples",
+                                                            0, G_MAXUINT64, 0,
+                                                            G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+        for (i = 0; i < G_N_ELEMENTS(_latency_percents); i++) {
+            char* pname = g_strdup_printf("latency-%s-p%d", _latency_stage_names[stage], (int) _latency_percents[i]);
+            g_object_class_install_property(gobject_class, prop + 1 + i,
+                                            g_param_spec_int64(pname, pname, "Percentile in microseconds",
+                                                               0, G_MAXINT64, 0,
+                                                               G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+        }
+    }
 
     _signal_commit_id =
         g_signal_lookup("commit", G_TYPE_FROM_CLASS(klass));
@@ -223,6 +453,117 @@ fcitx_im_context_class_init(FcitxIMContextClass *klass)
     _signal_retrieve_surrounding_id =
         g_signal_lookup("retrieve-surrounding", G_TYPE_FROM_CLASS(klass));
     g_assert(_signal_retrieve_surrounding_id != 0);
+
+    /* im_module_init normally did this already */
+    fcitx_im_context_load_settings();
+}
+
+/*
+ * settings come from $XDG_CONFIG_HOME/fcitx/clutter-im.conf, the [Default]
+ * group first and then the group named after the process, e.g.
+ *
+ *   [Default]
+ *   Mode=hybrid
+ *
+ *   [mygame]
+ *   Mode=sync
+ *
+ * the FCITX_CLUTTER_* environment variables win over the file
+ */
+void
+fcitx_im_context_load_settings(void)
+{
+    GKeyFile* keyfile;
+    char* path;
+
+    if (_settings_loaded)
+        return;
+    _settings_loaded = TRUE;
+
+    keyfile = g_key_file_new();
+    path = g_build_filename(g_get_user_config_dir(), "fcitx", "clutter-im.conf", NULL);
+    if (g_key_file_load_from_file(keyfile, path, G_KEY_FILE_NONE, NULL)) {
+        const char* name = FcitxIMClientGetProcessName();
+        _fcitx_im_context_load_group(keyfile, "Default");
+        if (name && g_key_file_has_group(keyfile, name))
+            _fcitx_im_context_load_group(keyfile, name);
+    }
+    g_free(path);
+    g_key_file_free(keyfile);
+
+    const char* local_echo = getenv("FCITX_CLUTTER_LOCAL_ECHO");
+    if (local_echo)
+        _local_echo = strcmp(local_echo, "1") == 0;
+    const char* shared_ic = getenv("FCITX_CLUTTER_SHARED_IC");
+    if (shared_ic)
+        _shared_ic = strcmp(shared_ic, "1") == 0;
+    const char* async_mode = getenv("FCITX_CLUTTER_ASYNC");
+    if (async_mode)
+        _process_mode = strcmp(async_mode, "1") == 0 ? FCITX_IM_CONTEXT_MODE_ASYNC : FCITX_IM_CONTEXT_MODE_SYNC;
+    const char* client_side_ui = getenv("FCITX_CLUTTER_CLIENT_SIDE_UI");
+    if (client_side_ui)
+        _client_side_ui = strcmp(client_side_ui, "1") == 0;
+    const char* mode = getenv("FCITX_CLUTTER_MODE");
+    if (mode)
+        _fcitx_im_context_parse_mode(mode, &_process_mode);
+    const char* key_queue_depth = getenv("FCITX_CLUTTER_KEY_QUEUE_DEPTH");
+    if (key_queue_depth && atoi(key_queue_depth) > 0)
+        _key_queue_depth = atoi(key_queue_depth);
+}
+
+static gboolean
+_fcitx_im_context_parse_mode(const char* str, FcitxIMContextMode* mode)
+{
+    if (g_ascii_strcasecmp(str, "sync") == 0)
+        *mode = FCITX_IM_CONTEXT_MODE_SYNC;
+    else if (g_ascii_strcasecmp(str, "async") == 0)
+        *mode = FCITX_IM_CONTEXT_MODE_ASYNC;
+    else if (g_ascii_strcasecmp(str, "hybrid") == 0)
+        *mode = FCITX_IM_CONTEXT_MODE_HYBRID;
+    else {
+        FcitxLog(WARNING, "unknown processing mode %s", str);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+_fcitx_im_context_load_group(GKeyFile* keyfile, const char* group)
+{
+    GError* error = NULL;
+    char* mode;
+    int depth;
+    gboolean value;
+
+    mode = g_key_file_get_string(keyfile, group, "Mode", NULL);
+    if (mode) {
+        _fcitx_im_context_parse_mode(mode, &_process_mode);
+        g_free(mode);
+    }
+
+    depth = g_key_file_get_integer(keyfile, group, "KeyQueueDepth", &error);
+    if (error)
+        g_clear_error(&error);
+    else if (depth > 0)
+        _key_queue_depth = depth;
+
+    value = g_key_file_get_boolean(keyfile, group, "LocalEcho", &error);
+    if (error)
+        g_clear_error(&error);
+    else
+        _local_echo = value;
+
+    value = g_key_file_get_boolean(keyfile, group, "SharedIC", &error);
+    if (error)
+        g_clear_error(&error);
+    else
+        _shared_ic = value;
+
+    value = g_key_file_get_boolean(keyfile, group, "ClientSideUI", &error);
+    if (error)
+        g_clear_error(&error);
+    else
+        _client_side_ui = value;
 }
 
 
@@ -235,13 +576,34 @@ fcitx_im_context_init(FcitxIMContext *context)
     context->area.y = -1;
     context->area.width = 0;
     context->area.height = 0;
+    context->cursor_area = context->area;
     context->use_preedit = TRUE;
     context->cursor_pos = 0;
-    context->preedit_string = NULL;
+    context->preedit = g_string_sized_new(64);
+    FcitxUtf8IndexInit(&context->preedit_index);
+    context->cursor_location_idle_id = 0;
+    context->geometry_conn = NULL;
+    context->geometry_sequence = 0;
+    context->geometry_source = NULL;
+    context->echo = g_string_new(NULL);
+    context->stageic = NULL;
+    context->inflight = 0;
+    context->waiting = g_queue_new();
+    context->compose_state = FCITX_COMPOSE_STATE_INIT;
 
     context->time = CLUTTER_CURRENT_TIME;
 
-    context->client = FcitxIMClientOpen(_fcitx_im_context_connect_cb, _fcitx_im_context_destroy_cb, G_OBJECT(context));
+    /* the shared IC is picked up on focus in, when the stage is known */
+    if (_shared_ic)
+        return;
+
+    /* clutter drives every stage through the same X connection, route to
+     * the fcitx of that display rather than the one in $DISPLAY */
+    Display* xdpy = clutter_x11_get_default_display();
+    context->client = FcitxIMClientOpenForDisplay(xdpy ? DisplayString(xdpy) : NULL,
+                                                  _fcitx_im_context_connect_cb,
+                                                  _fcitx_im_context_destroy_cb,
+                                                  G_OBJECT(context));
 }
 
 static void
@@ -250,12 +612,26 @@ fcitx_im_context_finalize(GObject *obj)
     FcitxLog(LOG_LEVEL, "fcitx_im_context_finalize");
     FcitxIMContext *context = FCITX_IM_CONTEXT(obj);
 
-    FcitxIMClientClose(context->client);
+    _cancel_cursor_location_idle(context);
+    _cancel_geometry_request(context);
+    _fcitx_im_context_latency_unhook(context);
+
+    if (context->stageic)
+        _fcitx_im_context_detach_stage_ic(context);
+    else if (context->client)
+        FcitxIMClientClose(context->client);
     context->client = NULL;
 
-    if (context->preedit_string)
-        g_free(context->preedit_string);
-    context->preedit_string = NULL;
+    g_string_free(context->preedit, TRUE);
+    context->preedit = NULL;
+    FcitxUtf8IndexFree(&context->preedit_index);
+
+    g_string_free(context->echo, TRUE);
+    context->echo = NULL;
+
+    /* every queued key holds a reference, so nothing can be left here */
+    g_queue_free(context->waiting);
+    context->waiting = NULL;
 }
 
 ///
@@ -273,19 +649,68 @@ fcitx_im_context_filter_keypress(ClutterIMContext *context,
         return FALSE;
 
     if (IsFcitxIMClientValid(fcitxcontext->client) && fcitxcontext->has_focus) {
+        fcitxcontext->compose_state = FCITX_COMPOSE_STATE_INIT;
+
         if (!IsFcitxIMClientEnabled(fcitxcontext->client)) {
             if (!FcitxIsHotKey(event->keyval, event->modifier_state, FcitxIMClientGetTriggerKey(fcitxcontext->client)))
                 return FALSE;
         }
 
         fcitxcontext->time = event->time;
+        FcitxStartupMark(FCITX_STARTUP_FIRST_KEY);
+        gint64 key_start = _fcitx_im_context_key_start(event);
+        if (event->type == CLUTTER_KEY_PRESS) {
+            fcitxcontext->key_start = key_start;
+            fcitxcontext->key_answered = FALSE;
+        }
+
+        if (_local_echo && _fcitx_im_context_can_predict(fcitxcontext, event)) {
+            gboolean visible = _fcitx_im_context_preedit_visible(fcitxcontext);
+            g_string_append_c(fcitxcontext->echo, (char) event->keyval);
+            if (!visible)
+                g_signal_emit(fcitxcontext, _signal_preedit_start_id, 0);
+            g_signal_emit(fcitxcontext, _signal_preedit_changed_id, 0);
+            _fcitx_im_context_latency_changed(fcitxcontext);
+
+            _fcitx_im_context_process_key_async(fcitxcontext, event, key_start, TRUE);
+            event->modifier_state |= FcitxKeyState_HandledMask;
+            return TRUE;
+        }
+
+        /*
+         * a sync call must not overtake keys that are still queued or
+         * waiting for their reply, e.g. a predicted letter; if they take
+         * too long the key goes asynchronously behind them
+         */
+        if (_process_mode == FCITX_IM_CONTEXT_MODE_ASYNC
+            || (_process_mode == FCITX_IM_CONTEXT_MODE_HYBRID && !_fcitx_im_context_is_focus_key(event))
+            || !_fcitx_im_context_drain_keys(fcitxcontext)) {
+            _fcitx_im_context_process_key_async(fcitxcontext, event, key_start, FALSE);
+            event->modifier_state |= FcitxKeyState_HandledMask;
+            return TRUE;
+        }
+
+        FcitxIMClientKeyResult result;
+        int ret = FcitxIMClientProcessKeySyncInline(fcitxcontext->client,
+                                                    event->keyval,
+                                                    event->hardware_keycode,
+                                                    event->modifier_state,
+                                                    (event->type == CLUTTER_KEY_PRESS) ? (FCITX_PRESS_KEY) : (FCITX_RELEASE_KEY),
+                                                    event->time,
+                                                    &result);
+        FcitxStartupMark(FCITX_STARTUP_FIRST_KEY_REPLY);
+        FcitxLatencyHistogramAdd(&fcitxcontext->latency[FCITX_IM_CONTEXT_LATENCY_REPLY],
+                                 g_get_monotonic_time() - key_start);
+        if (result.isinline) {
+            /* same order as the daemon emits CommitString and UpdatePreedit */
+            if (result.commit && result.commit[0])
+                _fcitx_im_context_commit_string_cb(NULL, (char*) result.commit, fcitxcontext);
+            if (result.cursor >= 0)
+                _fcitx_im_context_update_preedit_cb(NULL, (char*) (result.preedit ? result.preedit : ""), result.cursor, fcitxcontext);
+        }
+        _fcitx_im_context_key_answered(fcitxcontext, event, key_start, ret, result.isinline);
+        FcitxIMClientKeyResultClear(&result);
 
-        int ret = FcitxIMClientProcessKeySync(fcitxcontext->client,
-                                                event->keyval,
-                                                event->hardware_keycode,
-                                                event->modifier_state,
-                                                (event->type == CLUTTER_KEY_PRESS) ? (FCITX_PRESS_KEY) : (FCITX_RELEASE_KEY),
-                                                event->time);
         if (ret <= 0) {
             event->modifier_state |= FcitxKeyState_IgnoredMask;
             return FALSE;
@@ -293,37 +718,448 @@ fcitx_im_context_filter_keypress(ClutterIMContext *context,
             event->modifier_state |= FcitxKeyState_HandledMask;
             return TRUE;
         }
+    } else if (fcitxcontext->has_focus) {
+        /* no daemon, keep dead keys and Multi_key working locally */
+        return _fcitx_im_context_filter_compose(fcitxcontext, event);
     } else {
         return FALSE;
     }
     return FALSE;
 }
 
+static gboolean
+_fcitx_im_context_filter_compose(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event)
+{
+    const char* result = NULL;
+
+    if (event->type != CLUTTER_KEY_PRESS)
+        return FALSE;
+
+    if (!_compose_loaded) {
+        _compose_table = FcitxComposeTableLoad();
+        _compose_loaded = TRUE;
+    }
+    if (!_compose_table)
+        return FALSE;
+
+    switch (FcitxComposeTableFeed(_compose_table, &fcitxcontext->compose_state, event->keyval, &result)) {
+    case COMPOSE_NONE:
+        return FALSE;
+    case COMPOSE_COMMIT:
+        g_signal_emit(fcitxcontext, _signal_commit_id, 0, result);
+        return TRUE;
+    case COMPOSE_PARTIAL:
+    case COMPOSE_CANCEL:
+    default:
+        return TRUE;
+    }
+}
+
+/*
+ * keys the application is likely to act on by moving the focus or running
+ * a command: its handler must see them only after the daemon had its say
+ */
+static gboolean
+_fcitx_im_context_is_focus_key(ClutterKeyEvent* event)
+{
+    if (event->modifier_state & (FcitxKeyState_Ctrl | FcitxKeyState_Alt | FcitxKeyState_Super))
+        return TRUE;
+
+    switch (event->keyval) {
+    case FcitxKey_Tab:
+    case FcitxKey_ISO_Left_Tab:
+    case FcitxKey_Return:
+    case FcitxKey_KP_Enter:
+    case FcitxKey_Escape:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static gboolean
+_fcitx_im_context_preedit_visible(FcitxIMContext* fcitxcontext)
+{
+    if (fcitxcontext->preedit && fcitxcontext->preedit->len != 0)
+        return TRUE;
+    return fcitxcontext->echo && fcitxcontext->echo->len != 0;
+}
+
+/*
+ * only guess when the daemon is obviously composing raw letters, that is
+ * a lower case letter without modifier appended at the end of a non empty
+ * preedit made of lower case letters and apostrophes; with no preedit the
+ * current input method may as well pass letters through
+ */
+static gboolean
+_fcitx_im_context_can_predict(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event)
+{
+    const char* p;
+
+    if (event->type != CLUTTER_KEY_PRESS || !fcitxcontext->use_preedit)
+        return FALSE;
+    /*
+     * replies on the key channel and UpdatePreedit on the bus are not
+     * ordered against each other, an echo could not tell which preedit
+     * already covers its key; the channel is fast enough without one
+     */
+    if (FcitxIMClientHasKeyChannel(fcitxcontext->client))
+        return FALSE;
+    if (event->modifier_state & (FcitxKeyState_Ctrl_Alt_Shift | FcitxKeyState_Super))
+        return FALSE;
+    if (event->keyval < FcitxKey_a || event->keyval > FcitxKey_z)
+        return FALSE;
+    if (fcitxcontext->preedit->len == 0)
+        return FALSE;
+
+    for (p = fcitxcontext->preedit->str; *p; p++) {
+        if ((*p < 'a' || *p > 'z') && *p != '\'')
+            return FALSE;
+    }
+    if (fcitxcontext->cursor_pos != p - fcitxcontext->preedit->str)
+        return FALSE;
+    return TRUE;
+}
+
+static void
+_fcitx_im_context_clear_echo(FcitxIMContext* fcitxcontext, gboolean notify)
+{
+    /* keys still in flight no longer own a character of the echo */
+    fcitxcontext->echo_answered = 0;
+    fcitxcontext->echo_serial ++;
+    if (fcitxcontext->echo->len == 0)
+        return;
+
+    g_string_truncate(fcitxcontext->echo, 0);
+    if (notify) {
+        g_signal_emit(fcitxcontext, _signal_preedit_changed_id, 0);
+        if (!_fcitx_im_context_preedit_visible(fcitxcontext))
+            g_signal_emit(fcitxcontext, _signal_preedit_end_id, 0);
+    }
+}
+
+/*
+ * the daemon sends UpdatePreedit after the reply of the key that changed
+ * it, so a preedit or commit covers exactly the answered keys; characters
+ * of keys still in flight stay until their own update
+ */
+static void
+_fcitx_im_context_drop_answered_echo(FcitxIMContext* fcitxcontext, gboolean notify)
+{
+    int n = MIN(fcitxcontext->echo_answered, (int) fcitxcontext->echo->len);
+
+    fcitxcontext->echo_answered = 0;
+    if (n == 0)
+        return;
+
+    g_string_erase(fcitxcontext->echo, 0, n);
+    if (notify) {
+        g_signal_emit(fcitxcontext, _signal_preedit_changed_id, 0);
+        if (!_fcitx_im_context_preedit_visible(fcitxcontext))
+            g_signal_emit(fcitxcontext, _signal_preedit_end_id, 0);
+    }
+}
+
+static void
+_fcitx_im_context_process_key_async(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, gboolean predicted)
+{
+    ProcessKeyStruct* pks = _process_key_struct_new(fcitxcontext, event, start, predicted);
+
+    if (fcitxcontext->inflight < _key_queue_depth && g_queue_is_empty(fcitxcontext->waiting)
+        && !FcitxIMClientIsProbingBatch(fcitxcontext->client)) {
+        _fcitx_im_context_send_key(pks);
+        return;
+    }
+
+    /* the daemon is behind, hold the key back and merge autorepeat */
+    if (!predicted && _fcitx_im_context_compress_key(fcitxcontext, event)) {
+        _process_key_struct_free(pks);
+        return;
+    }
+    g_queue_push_tail_link(fcitxcontext->waiting, &pks->link);
+}
+
+/*
+ * wait for the keys before a synchronous one, queued ones included, and
+ * their raw fallbacks, no longer than a single key may take
+ */
+static gboolean
+_fcitx_im_context_drain_keys(FcitxIMContext* fcitxcontext)
+{
+    gint64 deadline = g_get_monotonic_time() + FCITX_IM_CLIENT_KEY_TIMEOUT * (gint64) 1000;
+    gint64 remaining;
+    gboolean drained = TRUE;
+
+    g_object_ref(fcitxcontext);
+    while (drained && (fcitxcontext->inflight > 0 || !g_queue_is_empty(fcitxcontext->waiting))) {
+        if (fcitxcontext->inflight == 0) {
+            _fcitx_im_context_pump_keys(fcitxcontext);
+            continue;
+        }
+        remaining = deadline - g_get_monotonic_time();
+        drained = remaining > 0 && IsFcitxIMClientValid(fcitxcontext->client)
+                  && FcitxIMClientWaitKeyReplies(fcitxcontext->client, (int) ((remaining + 999) / 1000));
+    }
+    g_object_unref(fcitxcontext);
+    return drained;
+}
+
+static void
+_fcitx_im_context_send_key(ProcessKeyStruct* pks)
+{
+    FcitxIMContext* fcitxcontext = pks->context;
+    ClutterKeyEvent* event = &pks->event;
+
+    if (!IsFcitxIMClientValid(fcitxcontext->client)) {
+        /* the daemon went away meanwhile, let the key through raw */
+        if (pks->predicted)
+            _fcitx_im_context_clear_echo(fcitxcontext, TRUE);
+        event->modifier_state |= FcitxKeyState_IgnoredMask;
+        _fcitx_im_context_emit_key_event(CLUTTER_IM_CONTEXT(fcitxcontext), event);
+        _process_key_struct_free(pks);
+        return;
+    }
+
+    fcitxcontext->inflight ++;
+    FcitxIMClientProcessKey(fcitxcontext->client,
+                            _fcitx_im_context_process_key_cb,
+                            pks,
+                            _process_key_struct_done,
+                            event->keyval,
+                            event->hardware_keycode,
+                            event->modifier_state,
+                            (event->type == CLUTTER_KEY_PRESS) ? (FCITX_PRESS_KEY) : (FCITX_RELEASE_KEY),
+                            event->time);
+}
+
+static void
+_fcitx_im_context_pump_keys(FcitxIMContext* fcitxcontext)
+{
+    int n;
+
+    /* the keys of a batch the daemon may not know go first */
+    while (!FcitxIMClientIsProbingBatch(fcitxcontext->client)
+           && fcitxcontext->inflight < _key_queue_depth && !g_queue_is_empty(fcitxcontext->waiting)) {
+        n = MIN(_key_queue_depth - fcitxcontext->inflight, (int) g_queue_get_length(fcitxcontext->waiting));
+        n = MIN(n, KEY_BATCH_MAX);
+
+        /* a backlog, e.g. from an on-screen keyboard, goes out in one message */
+        if (n >= 2 && IsFcitxIMClientValid(fcitxcontext->client))
+            _fcitx_im_context_send_key_batch(fcitxcontext, n);
+        else
+            _fcitx_im_context_send_key(g_queue_pop_head_link(fcitxcontext->waiting)->data);
+    }
+}
+
+static void
+_fcitx_im_context_send_key_batch(FcitxIMContext* fcitxcontext, int n)
+{
+    FcitxIMClientKeyEvent keys[KEY_BATCH_MAX];
+    GList* batch = NULL;
+    GList* last = NULL;
+    int i;
+
+    /* the batch keeps the keys chained through their links */
+    for (i = 0; i < n; i++) {
+        GList* link = g_queue_pop_head_link(fcitxcontext->waiting);
+        ProcessKeyStruct* pks = link->data;
+        ClutterKeyEvent* event = &pks->event;
+        link->prev = last;
+        link->next = NULL;
+        if (last)
+            last->next = link;
+        else
+            batch = link;
+        last = link;
+        keys[i].keyval = event->keyval;
+        keys[i].keycode = event->hardware_keycode;
+        keys[i].state = event->modifier_state;
+        keys[i].type = (event->type == CLUTTER_KEY_PRESS) ? (FCITX_PRESS_KEY) : (FCITX_RELEASE_KEY);
+        keys[i].time = event->time;
+    }
+
+    fcitxcontext->inflight += n;
+    FcitxIMClientProcessKeyBatch(fcitxcontext->client, keys, n,
+                                 _fcitx_im_context_process_key_batch_cb,
+                                 batch,
+                                 _process_key_batch_done);
+}
+
+static void
+_fcitx_im_context_process_key_batch_cb(const int* ret, int n, void* user_data)
+{
+    GList* link = user_data;
+    int i;
+
+    for (i = 0; i < n && link; i++, link = link->next)
+        _fcitx_im_context_process_key_cb(ret[i], link->data);
+}
+
+static void
+_process_key_batch_done(gpointer data)
+{
+    GList* link = data;
+    ProcessKeyStruct* first = link->data;
+    FcitxIMContext* fcitxcontext = g_object_ref(first->context);
+
+    while (link) {
+        GList* next = link->next;
+        _process_key_struct_free(link->data);
+        fcitxcontext->inflight --;
+        link = next;
+    }
+
+    _fcitx_im_context_pump_keys(fcitxcontext);
+    g_object_unref(fcitxcontext);
+}
+
+static gboolean
+_is_same_key(ClutterKeyEvent* a, ClutterKeyEvent* b)
+{
+    const guint32 mask = FcitxKeyState_Ctrl_Alt_Shift | FcitxKeyState_Super;
+    return a->keyval == b->keyval &&
+           a->hardware_keycode == b->hardware_keycode &&
+           (a->modifier_state & mask) == (b->modifier_state & mask);
+}
+
+/*
+ * drop a press that only repeats what is already waiting: either press,
+ * press (detectable autorepeat) or press, release, press where the queued
+ * release goes too, the real release still pairs with the first press.
+ * X sends the synthetic release of autorepeat with the same time as the
+ * next press, a typed double letter like "ll" never matches that
+ */
+static gboolean
+_fcitx_im_context_compress_key(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event)
+{
+    GList* tail = g_queue_peek_tail_link(fcitxcontext->waiting);
+    ProcessKeyStruct* last;
+    ProcessKeyStruct* prev;
+
+    if (tail == NULL || event->type != CLUTTER_KEY_PRESS)
+        return FALSE;
+
+    last = tail->data;
+    if (last->predicted || !_is_same_key(&last->event, event))
+        return FALSE;
+
+    if (last->event.type == CLUTTER_KEY_PRESS)
+        return TRUE;
+
+    if (tail->prev == NULL)
+        return FALSE;
+    prev = tail->prev->data;
+    if (prev->predicted || prev->event.type != CLUTTER_KEY_PRESS || !_is_same_key(&prev->event, event))
+        return FALSE;
+    if (last->event.time != event->time)
+        return FALSE;
+
+    _process_key_struct_free(g_queue_pop_tail_link(fcitxcontext->waiting)->data);
+    return TRUE;
+}
+
+static void
+_fcitx_im_context_process_key_cb(int ret, void* user_data)
+{
+    ProcessKeyStruct* pks = user_data;
+    FcitxIMContext* fcitxcontext = pks->context;
+
+    FcitxStartupMark(FCITX_STARTUP_FIRST_KEY_REPLY);
+    FcitxLatencyHistogramAdd(&fcitxcontext->latency[FCITX_IM_CONTEXT_LATENCY_REPLY],
+                             g_get_monotonic_time() - pks->start);
+    _fcitx_im_context_key_answered(fcitxcontext, &pks->event, pks->start, ret, FALSE);
+    if (ret > 0) {
+        /* its echo goes with the next preedit update */
+        if (pks->predicted && pks->echo_serial == fcitxcontext->echo_serial)
+            fcitxcontext->echo_answered ++;
+        return;
+    }
+
+    /* the daemon did not want the key, roll back and deliver it raw */
+    if (pks->predicted)
+        _fcitx_im_context_clear_echo(fcitxcontext, TRUE);
+    pks->event.modifier_state |= FcitxKeyState_IgnoredMask;
+    _fcitx_im_context_emit_key_event(CLUTTER_IM_CONTEXT(fcitxcontext), &pks->event);
+}
+
+/* structs are recycled, a stream of keys does not hit the allocator */
+static ProcessKeyStruct*
+_process_key_struct_new(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, gboolean predicted)
+{
+    ProcessKeyStruct* pks;
+
+    if (_key_struct_cache) {
+        pks = _key_struct_cache->data;
+        _key_struct_cache = _key_struct_cache->next;
+        _key_struct_cached --;
+    } else {
+        pks = g_slice_new(ProcessKeyStruct);
+        pks->link.data = pks;
+    }
+
+    pks->link.prev = NULL;
+    pks->link.next = NULL;
+    pks->context = g_object_ref(fcitxcontext);
+    pks->event = *event;
+    pks->predicted = predicted;
+    pks->echo_serial = fcitxcontext->echo_serial;
+    pks->start = start;
+    return pks;
+}
+
+static void
+_process_key_struct_free(gpointer data)
+{
+    ProcessKeyStruct* pks = data;
+    g_object_unref(pks->context);
+
+    if (_key_struct_cached >= KEY_STRUCT_CACHE_SIZE) {
+        g_slice_free(ProcessKeyStruct, pks);
+        return;
+    }
+    pks->link.prev = NULL;
+    pks->link.next = _key_struct_cache;
+    _key_struct_cache = &pks->link;
+    _key_struct_cached ++;
+}
+
+/* destroy notify of an in flight call, reply or not */
+static void
+_process_key_struct_done(gpointer data)
+{
+    ProcessKeyStruct* pks = data;
+    FcitxIMContext* fcitxcontext = g_object_ref(pks->context);
+
+    _process_key_struct_free(pks);
+    fcitxcontext->inflight --;
+    _fcitx_im_context_pump_keys(fcitxcontext);
+    g_object_unref(fcitxcontext);
+}
+
 static void
 _fcitx_im_context_update_preedit_cb(DBusGProxy* proxy, char* str, int cursor_pos, void* user_data)
 {
     FcitxLog(LOG_LEVEL, "_fcitx_im_context_commit_string_cb");
     FcitxIMContext* context =  FCITX_IM_CONTEXT(user_data);
 
-    gboolean visible = false;
+    FCITX_CLUTTER_PROBE3(preedit, FcitxIMClientGetID(context->client), strlen(str), cursor_pos);
 
-    if (context->preedit_string != NULL) {
-        if (strlen(context->preedit_string) != 0)
-            visible = true;
-        g_free(context->preedit_string);
-        context->preedit_string = NULL;
-    }
-    context->preedit_string = g_strdup(str);
-    char* tempstr = g_strndup(str, cursor_pos);
-    context->cursor_pos =  fcitx_utf8_strlen(tempstr);
-    g_free(tempstr);
+    gboolean visible = _fcitx_im_context_preedit_visible(context);
 
-    gboolean new_visible = false;
+    /* the authoritative preedit replaces what was predicted for answered keys */
+    _fcitx_im_context_drop_answered_echo(context, FALSE);
 
-    if (context->preedit_string != NULL) {
-        if (strlen(context->preedit_string) != 0)
-            new_visible = true;
+    /* reuse the buffer, it only grows to the longest preedit seen */
+    g_string_assign(context->preedit, str);
+    /* cursor comes in bytes, clutter wants characters */
+    if (FcitxUtf8IndexBuild(&context->preedit_index, str)) {
+        context->cursor_pos = FcitxUtf8IndexByteToChar(&context->preedit_index, cursor_pos < 0 ? 0 : cursor_pos);
+    } else {
+        context->cursor_pos = fcitx_utf8_strnlen(str, cursor_pos < 0 ? 0 : cursor_pos);
+        context->preedit_index.bytes = strlen(str);
     }
+
+    gboolean new_visible = _fcitx_im_context_preedit_visible(context);
     gboolean flag = new_visible != visible;
 
     if (new_visible) {
@@ -344,6 +1180,7 @@ _fcitx_im_context_update_preedit_cb(DBusGProxy* proxy, char* str, int cursor_pos
     }
 
     g_signal_emit(context, _signal_preedit_changed_id, 0);
+    _fcitx_im_context_latency_changed(context);
 }
 
 
@@ -359,16 +1196,23 @@ fcitx_im_context_focus_in(ClutterIMContext *context)
 
     fcitxcontext->has_focus = true;
 
-    if (IsFcitxIMClientValid(fcitxcontext->client)) {
+    if (_shared_ic)
+        _fcitx_im_context_attach_stage_ic(fcitxcontext);
+
+    /* recorded even before the IC exists, it is sent once created */
+    if (fcitxcontext->client) {
         FcitxIMClientFocusIn(fcitxcontext->client);
     }
 
     /* set_cursor_location_internal() will get origin from X server,
-     * it blocks UI. So delay it to idle callback. */
-    g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
-                    (GSourceFunc) _set_cursor_location_internal,
-                    g_object_ref(fcitxcontext),
-                    (GDestroyNotify) g_object_unref);
+     * it blocks UI. So delay it to idle callback, only one at a time. */
+    if (fcitxcontext->cursor_location_idle_id == 0) {
+        fcitxcontext->cursor_location_idle_id =
+            g_idle_add_full(G_PRIORITY_DEFAULT_IDLE,
+                            _set_cursor_location_idle_cb,
+                            fcitxcontext,
+                            NULL);
+    }
 
     return;
 }
@@ -384,16 +1228,20 @@ fcitx_im_context_focus_out(ClutterIMContext *context)
     }
 
     fcitxcontext->has_focus = false;
+    fcitxcontext->compose_state = FCITX_COMPOSE_STATE_INIT;
 
-    if (IsFcitxIMClientValid(fcitxcontext->client)) {
+    _cancel_cursor_location_idle(fcitxcontext);
+    _cancel_geometry_request(fcitxcontext);
+
+    if (fcitxcontext->client) {
         FcitxIMClientFocusOut(fcitxcontext->client);
     }
+    _fcitx_im_context_hide_candidates(fcitxcontext);
 
-
-    if (fcitxcontext->preedit_string != NULL)
-        g_free(fcitxcontext->preedit_string);
-    fcitxcontext->preedit_string = NULL;
+    g_string_truncate(fcitxcontext->preedit, 0);
+    FcitxUtf8IndexReset(&fcitxcontext->preedit_index);
     fcitxcontext->cursor_pos = 0;
+    _fcitx_im_context_clear_echo(fcitxcontext, FALSE);
     g_signal_emit(fcitxcontext, _signal_preedit_changed_id, 0);
     g_signal_emit(fcitxcontext, _signal_preedit_end_id, 0);
 
@@ -445,6 +1293,7 @@ fcitx_im_context_set_cursor_location(ClutterIMContext *context,
         return;
     }
     fcitxcontext->area = *area;
+    fcitxcontext->cursor_area = *area;
 
     if (IsFcitxIMClientValid(fcitxcontext->client)) {
         _set_cursor_location_internal(fcitxcontext);
@@ -453,52 +1302,163 @@ fcitx_im_context_set_cursor_location(ClutterIMContext *context,
     return;
 }
 
+static gboolean
+_set_cursor_location_idle_cb(gpointer user_data)
+{
+    FcitxIMContext *fcitxcontext = FCITX_IM_CONTEXT(user_data);
+    fcitxcontext->cursor_location_idle_id = 0;
+    _set_cursor_location_internal(fcitxcontext);
+    return FALSE;
+}
+
+static void
+_cancel_cursor_location_idle(FcitxIMContext *fcitxcontext)
+{
+    if (fcitxcontext->cursor_location_idle_id) {
+        g_source_remove(fcitxcontext->cursor_location_idle_id);
+        fcitxcontext->cursor_location_idle_id = 0;
+    }
+}
+
 static void
 _set_cursor_location_internal(FcitxIMContext *fcitxcontext)
 {
     ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
-    ClutterActor *stage = clutter_actor_get_stage (context->actor);
-    Window current_window, root, parent, *childs;
-    unsigned int nchild;
-    XWindowAttributes winattr;
+    ClutterActor *stage;
+    Window stage_window;
     Display *xdpy;
-    float fx, fy;
-    gint x, y;
+    xcb_connection_t *conn;
+    xcb_translate_coordinates_cookie_t cookie;
+    GSource *source;
+    FcitxGeometrySource *geometry;
 
-    if (!stage)
+    if (context->actor == NULL ||
+        !IsFcitxIMClientValid(fcitxcontext->client)) {
         return;
+    }
 
-    clutter_actor_get_transformed_position (context->actor, &fx, &fy);
-    x = fx;
-    y = fy;
+    stage = clutter_actor_get_stage (context->actor);
+    if (!stage)
+        return;
 
     xdpy = clutter_x11_get_default_display ();
-    current_window = clutter_x11_get_stage_window(CLUTTER_STAGE(stage));
+    stage_window = clutter_x11_get_stage_window(CLUTTER_STAGE(stage));
 
-    if (!xdpy || !current_window)
+    if (!xdpy || !stage_window)
         return;
 
-    while(1) {
-        XGetWindowAttributes (xdpy, current_window, &winattr);
-        x += winattr.x;
-        y += winattr.y;
+    /* a newer request supersedes the one in flight */
+    _cancel_geometry_request(fcitxcontext);
+
+    /* one round trip resolves the stage origin, the reply is picked up
+     * once the connection has it so the main loop never waits on X */
+    conn = XGetXCBConnection(xdpy);
+    cookie = xcb_translate_coordinates(conn,
+                                       stage_window,
+                                       RootWindow(xdpy, clutter_x11_get_default_screen()),
+                                       0, 0);
+    xcb_flush(conn);
+
+    fcitxcontext->geometry_conn = conn;
+    fcitxcontext->geometry_sequence = cookie.sequence;
+
+    source = g_source_new(&_geometry_source_funcs, sizeof(FcitxGeometrySource));
+    geometry = (FcitxGeometrySource*) source;
+    geometry->context = fcitxcontext;
+    geometry->deadline = g_get_monotonic_time() + GEOMETRY_TIMEOUT * 1000;
+    geometry->pollfd.fd = xcb_get_file_descriptor(conn);
+    geometry->pollfd.events = G_IO_IN;
+    g_source_add_poll(source, &geometry->pollfd);
+    g_source_attach(source, NULL);
+    g_source_unref(source);
+    fcitxcontext->geometry_source = source;
+    return;
+}
+
+static gboolean
+_geometry_source_prepare(GSource* source, gint* timeout)
+{
+    FcitxGeometrySource* geometry = (FcitxGeometrySource*) source;
+    gint64 remaining = geometry->deadline - g_source_get_time(source);
 
-        XQueryTree(xdpy, current_window, &root, &parent, &childs, &nchild);
-        current_window = parent;
-        if (root == parent)
-        break;
+    *timeout = remaining > 0 ? (remaining + 999) / 1000 : 0;
+    return _geometry_source_check(source);
+}
+
+static gboolean
+_geometry_source_check(GSource* source)
+{
+    FcitxGeometrySource* geometry = (FcitxGeometrySource*) source;
+    FcitxIMContext *fcitxcontext = geometry->context;
+    xcb_generic_error_t *error = NULL;
+
+    if (!geometry->done) {
+        geometry->done = xcb_poll_for_reply(fcitxcontext->geometry_conn,
+                                            fcitxcontext->geometry_sequence,
+                                            (void**) &geometry->reply,
+                                            &error);
+        if (error)
+            free(error);
     }
+    return geometry->done || g_source_get_time(source) >= geometry->deadline;
+}
 
-    if (fcitxcontext->area.x != x || fcitxcontext->area.y != y) {
-        fcitxcontext->area.x = x;
-        fcitxcontext->area.y = y;
+static gboolean
+_geometry_source_dispatch(GSource* source, GSourceFunc callback, gpointer user_data)
+{
+    FcitxGeometrySource* geometry = (FcitxGeometrySource*) source;
+    FcitxIMContext *fcitxcontext = geometry->context;
+
+    fcitxcontext->geometry_source = NULL;
+    if (!geometry->done) {
+        FcitxLog(LOG_LEVEL, "translate coordinates timed out");
+        xcb_discard_reply(fcitxcontext->geometry_conn, fcitxcontext->geometry_sequence);
+    } else if (geometry->reply) {
+        _set_cursor_location_with_origin(fcitxcontext, geometry->reply->dst_x, geometry->reply->dst_y);
+    }
+    return FALSE;
+}
+
+static void
+_geometry_source_finalize(GSource* source)
+{
+    free(((FcitxGeometrySource*) source)->reply);
+}
+
+static void
+_cancel_geometry_request(FcitxIMContext *fcitxcontext)
+{
+    FcitxGeometrySource* geometry = (FcitxGeometrySource*) fcitxcontext->geometry_source;
+
+    if (geometry) {
+        if (!geometry->done)
+            xcb_discard_reply(fcitxcontext->geometry_conn, fcitxcontext->geometry_sequence);
+        fcitxcontext->geometry_source = NULL;
+        g_source_destroy(&geometry->source);
     }
+}
+
+static void
+_set_cursor_location_with_origin(FcitxIMContext *fcitxcontext, int origin_x, int origin_y)
+{
+    ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
+    float fx, fy;
+    gint x, y;
 
     if (context->actor == NULL ||
         !IsFcitxIMClientValid(fcitxcontext->client)) {
         return;
     }
 
+    clutter_actor_get_transformed_position (context->actor, &fx, &fy);
+    x = fx + origin_x;
+    y = fy + origin_y;
+
+    if (fcitxcontext->area.x != x || fcitxcontext->area.y != y) {
+        fcitxcontext->area.x = x;
+        fcitxcontext->area.y = y;
+    }
+
     ClutterIMRectangle area = fcitxcontext->area;
     if (area.x == -1 && area.y == -1 && area.width == 0 && area.height == 0) {
         area.y = 0;
@@ -506,7 +1466,6 @@ _set_cursor_location_internal(FcitxIMContext *fcitxcontext)
     }
 
     FcitxIMClientSetCursorLocation(fcitxcontext->client, area.x, area.y + area.height);
-    return;
 }
 
 ///
@@ -528,6 +1487,10 @@ _fcitx_im_context_set_capacity(FcitxIMContext* fcitxcontext)
         FcitxCapacityFlags flags = CAPACITY_NONE;
         if (fcitxcontext->use_preedit)
             flags |= CAPACITY_PREEDIT;
+        if (_client_side_ui)
+            flags |= CAPACITY_CLIENT_SIDE_UI;
+        /* async mode never sends a key synchronously */
+        FcitxIMClientSetInlineResult(fcitxcontext->client, _process_mode != FCITX_IM_CONTEXT_MODE_ASYNC);
         FcitxIMClientSetCapacity(fcitxcontext->client, flags);
 
     }
@@ -556,10 +1519,11 @@ fcitx_im_context_get_preedit_string(ClutterIMContext   *context,
 
     if (IsFcitxIMClientValid(fcitxcontext->client) && IsFcitxIMClientEnabled(fcitxcontext->client)) {
         if (str) {
-            if (fcitxcontext->preedit_string)
-                *str = strdup(fcitxcontext->preedit_string);
-            else
-                *str = strdup("");
+            /* the caller owns the string, so this is the one copy we make */
+            gsize len = fcitxcontext->preedit->len;
+            *str = g_malloc(len + fcitxcontext->echo->len + 1);
+            memcpy(*str, fcitxcontext->preedit->str, len);
+            memcpy(*str + len, fcitxcontext->echo->str, fcitxcontext->echo->len + 1);
         }
         if (attrs) {
             *attrs = pango_attr_list_new();
@@ -568,12 +1532,12 @@ fcitx_im_context_get_preedit_string(ClutterIMContext   *context,
                 PangoAttribute *pango_attr;
                 pango_attr = pango_attr_underline_new(PANGO_UNDERLINE_SINGLE);
                 pango_attr->start_index = 0;
-                pango_attr->end_index = strlen(*str);
+                pango_attr->end_index = fcitxcontext->preedit_index.bytes + fcitxcontext->echo->len;
                 pango_attr_list_insert(*attrs, pango_attr);
             }
         }
         if (cursor_pos)
-            *cursor_pos = fcitxcontext->cursor_pos;
+            *cursor_pos = fcitxcontext->cursor_pos + fcitxcontext->echo->len;
 
     } else {
         if (str) {
@@ -595,16 +1559,63 @@ void _fcitx_im_context_enable_im_cb(DBusGProxy* proxy, void* user_data)
     FcitxIMClientSetEnabled(context->client, true);
 }
 
+/*
+ * only sent when CAPACITY_CLIENT_SIDE_UI is set, the preedit keeps coming
+ * through UpdatePreedit so only aux and candidates are drawn here
+ */
+void _fcitx_im_context_update_client_side_ui_cb(DBusGProxy* proxy, char* auxup, char* auxdown, char* preedit,
+        char* candidateword, char* imname, int cursorpos, void* user_data)
+{
+    FcitxIMContext* fcitxcontext = FCITX_IM_CONTEXT(user_data);
+    ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
+    ClutterActor* stage;
+    FcitxCandidatePanel* panel;
+    float x, y;
+
+    if (!fcitxcontext->has_focus || context->actor == NULL)
+        return;
+    stage = clutter_actor_get_stage(context->actor);
+    if (stage == NULL)
+        return;
+
+    panel = FcitxCandidatePanelGet(stage);
+    FcitxCandidatePanelUpdate(panel, auxup, auxdown, candidateword);
+
+    clutter_actor_get_transformed_position(context->actor, &x, &y);
+    if (fcitxcontext->cursor_area.x >= 0 && fcitxcontext->cursor_area.y >= 0) {
+        x += fcitxcontext->cursor_area.x;
+        y += fcitxcontext->cursor_area.y;
+    }
+    FcitxCandidatePanelMove(panel, x, y, fcitxcontext->cursor_area.height);
+}
+
+void _fcitx_im_context_hide_candidates(FcitxIMContext* fcitxcontext)
+{
+    ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
+    ClutterActor* stage;
+    FcitxCandidatePanel* panel;
+
+    if (!_client_side_ui || context->actor == NULL)
+        return;
+    stage = clutter_actor_get_stage(context->actor);
+    if (stage == NULL)
+        return;
+
+    panel = FcitxCandidatePanelLookup(stage);
+    if (panel)
+        FcitxCandidatePanelHide(panel);
+}
+
 void _fcitx_im_context_close_im_cb(DBusGProxy* proxy, void* user_data)
 {
     FcitxLog(LOG_LEVEL, "_fcitx_im_context_close_im_cb");
     FcitxIMContext* context =  FCITX_IM_CONTEXT(user_data);
     FcitxIMClientSetEnabled(context->client, false);
 
-    if (context->preedit_string != NULL)
-        g_free(context->preedit_string);
-    context->preedit_string = NULL;
+    g_string_truncate(context->preedit, 0);
+    FcitxUtf8IndexReset(&context->preedit_index);
     context->cursor_pos = 0;
+    _fcitx_im_context_clear_echo(context, FALSE);
     g_signal_emit(context, _signal_preedit_changed_id, 0);
     g_signal_emit(context, _signal_preedit_end_id, 0);
 }
@@ -613,13 +1624,19 @@ void _fcitx_im_context_commit_string_cb(DBusGProxy* proxy, char* str, void* user
 {
     FcitxLog(LOG_LEVEL, "_fcitx_im_context_commit_string_cb");
     FcitxIMContext* context =  FCITX_IM_CONTEXT(user_data);
+    FCITX_CLUTTER_PROBE2(commit, FcitxIMClientGetID(context->client), strlen(str));
+    _fcitx_im_context_drop_answered_echo(context, TRUE);
     g_signal_emit(context, _signal_commit_id, 0, str);
+    _fcitx_im_context_latency_changed(context);
 }
 
 void _fcitx_im_context_forward_key_cb(DBusGProxy* proxy, guint keyval, guint state, gint type, void* user_data)
 {
     FcitxLog(LOG_LEVEL, "_fcitx_im_context_forward_key_cb");
     ClutterIMContext* context =  CLUTTER_IM_CONTEXT(user_data);
+    FCITX_CLUTTER_PROBE4(forward_key, FcitxIMClientGetID(FCITX_IM_CONTEXT(user_data)->client), keyval, state, type);
+    if (context->actor == NULL)
+        return;
     const char* signal_name;
     gboolean consumed = FALSE;
     FcitxKeyEventType tp = (FcitxKeyEventType) type;
@@ -652,26 +1669,263 @@ void _fcitx_im_context_forward_key_cb(DBusGProxy* proxy, guint keyval, guint sta
     
 }
 
+void _fcitx_im_context_emit_key_event(ClutterIMContext* context, ClutterKeyEvent* event)
+{
+    const char* signal_name;
+    gboolean consumed = FALSE;
+
+    if (context->actor == NULL)
+        return;
+
+    if (event->type == CLUTTER_KEY_PRESS)
+        signal_name = "key-press-event";
+    else
+        signal_name = "key-release-event";
+
+    g_signal_emit_by_name(context->actor, signal_name, event, &consumed);
+}
+
 void _fcitx_im_context_connect_cb(FcitxIMClient* client, void* user_data)
 {
     FcitxIMContext* context =  FCITX_IM_CONTEXT(user_data);
     if (IsFcitxIMClientValid(client)) {
-        FcitxIMClientConnectSignal(client,
-                                   G_CALLBACK(_fcitx_im_context_enable_im_cb),
-                                   G_CALLBACK(_fcitx_im_context_close_im_cb),
-                                   G_CALLBACK(_fcitx_im_context_commit_string_cb),
-                                   G_CALLBACK(_fcitx_im_context_forward_key_cb),
-                                   G_CALLBACK(_fcitx_im_context_update_preedit_cb),
-                                   context,
-                                   NULL);
+        _fcitx_im_context_connect_signals(context);
         _fcitx_im_context_set_capacity(context);
     }
 
 }
 
+void _fcitx_im_context_connect_signals(FcitxIMContext* fcitxcontext)
+{
+    FcitxIMClientConnectSignal(fcitxcontext->client,
+                               G_CALLBACK(_fcitx_im_context_enable_im_cb),
+                               G_CALLBACK(_fcitx_im_context_close_im_cb),
+                               G_CALLBACK(_fcitx_im_context_commit_string_cb),
+                               G_CALLBACK(_fcitx_im_context_forward_key_cb),
+                               G_CALLBACK(_fcitx_im_context_update_preedit_cb),
+                               G_CALLBACK(_fcitx_im_context_update_client_side_ui_cb),
+                               fcitxcontext,
+                               NULL);
+}
+
+void _fcitx_im_context_disconnect_signals(FcitxIMContext* fcitxcontext)
+{
+    FcitxIMClientDisconnectSignal(fcitxcontext->client, fcitxcontext);
+}
+
+/*
+ * take over the IC of the stage, the previous owner loses the client until
+ * it gets the focus back; its composition is reset on the daemon side, the
+ * FocusOut/FocusIn pair of the switch is folded away and would not do it
+ */
+void _fcitx_im_context_attach_stage_ic(FcitxIMContext* fcitxcontext)
+{
+    ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
+    ClutterActor* stage;
+    FcitxIMStageIC* stageic;
+
+    if (context->actor == NULL)
+        return;
+    stage = clutter_actor_get_stage(context->actor);
+    if (stage == NULL)
+        return;
+
+    if (fcitxcontext->stageic && fcitxcontext->stageic->stage != stage)
+        _fcitx_im_context_detach_stage_ic(fcitxcontext);
+
+    if (fcitxcontext->stageic == NULL) {
+        stageic = g_object_get_data(G_OBJECT(stage), STAGE_IC_KEY);
+        if (stageic == NULL) {
+            Display* xdpy = clutter_x11_get_default_display();
+            FcitxIMClient* client;
+            stageic = g_new0(FcitxIMStageIC, 1);
+            client = FcitxIMClientOpenForDisplay(xdpy ? DisplayString(xdpy) : NULL,
+                                                 _fcitx_im_stage_ic_connect_cb,
+                                                 _fcitx_im_context_destroy_cb,
+                                                 stageic);
+            if (client == NULL) {
+                g_free(stageic);
+                return;
+            }
+            stageic->client = client;
+            stageic->stage = stage;
+            g_object_add_weak_pointer(G_OBJECT(stage), (gpointer*) &stageic->stage);
+            g_object_set_data(G_OBJECT(stage), STAGE_IC_KEY, stageic);
+        }
+        stageic->ref ++;
+        fcitxcontext->stageic = stageic;
+    }
+
+    stageic = fcitxcontext->stageic;
+    if (stageic->owner == fcitxcontext)
+        return;
+
+    if (stageic->owner) {
+        if (IsFcitxIMClientValid(stageic->client)) {
+            _fcitx_im_context_disconnect_signals(stageic->owner);
+            FcitxIMClientReset(stageic->client);
+        }
+        stageic->owner->client = NULL;
+    }
+
+    stageic->owner = fcitxcontext;
+    fcitxcontext->client = stageic->client;
+    if (IsFcitxIMClientValid(stageic->client)) {
+        _fcitx_im_context_connect_signals(fcitxcontext);
+        _fcitx_im_context_set_capacity(fcitxcontext);
+    }
+}
+
+void _fcitx_im_context_detach_stage_ic(FcitxIMContext* fcitxcontext)
+{
+    FcitxIMStageIC* stageic = fcitxcontext->stageic;
+
+    if (stageic->owner == fcitxcontext) {
+        if (IsFcitxIMClientValid(stageic->client))
+            _fcitx_im_context_disconnect_signals(fcitxcontext);
+        stageic->owner = NULL;
+    }
+    fcitxcontext->client = NULL;
+    fcitxcontext->stageic = NULL;
+
+    stageic->ref --;
+    if (stageic->ref > 0)
+        return;
+
+    if (stageic->stage) {
+        g_object_set_data(G_OBJECT(stageic->stage), STAGE_IC_KEY, NULL);
+        g_object_remove_weak_pointer(G_OBJECT(stageic->stage), (gpointer*) &stageic->stage);
+    }
+    FcitxIMClientClose(stageic->client);
+    g_free(stageic);
+}
+
+void _fcitx_im_stage_ic_connect_cb(FcitxIMClient* client, void* user_data)
+{
+    FcitxIMStageIC* stageic = user_data;
+    if (stageic->owner)
+        _fcitx_im_context_connect_cb(client, stageic->owner);
+}
+
 void _fcitx_im_context_destroy_cb(FcitxIMClient* client, void* user_data)
 {
     FcitxIMClientSetEnabled(client, false);
 }
 
+static void
+fcitx_im_context_get_property(GObject *object,
+                              guint prop_id,
+                              GValue *value,
+                              GParamSpec *pspec)
+{
+    FcitxIMContext* fcitxcontext = FCITX_IM_CONTEXT(object);
+    guint stage = (prop_id - 1) / LATENCY_PROPS_PER_STAGE;
+    guint metric = (prop_id - 1) % LATENCY_PROPS_PER_STAGE;
+
+    if (prop_id == 0 || stage >= FCITX_IM_CONTEXT_LATENCY_LAST) {
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+        return;
+    }
+
+    if (metric == 0)
+        g_value_set_uint64(value, fcitxcontext->latency[stage].count);
+    else
+        g_value_set_int64(value, FcitxLatencyHistogramPercentile(&fcitxcontext->latency[stage],
+                                                                  _latency_percents[metric - 1]));
+}
+
+/*
+ * the X server stamps key events with CLOCK_MONOTONIC in ms, the clock of
+ * g_get_monotonic_time(); a stamp from another clock, a synthetic or a
+ * replayed event is timed from now instead
+ */
+static gint64
+_fcitx_im_context_key_start(ClutterKeyEvent* event)
+{
+    gint64 now = g_get_monotonic_time();
+    guint32 age = (guint32) ((now / 1000) & 0xffffffff) - event->time;
+
+    if (event->time == 0 || age > KEY_TIME_MAX_AGE)
+        return now;
+    return now - (gint64) age * 1000;
+}
+
+/*
+ * a key without a visible change must not leave key_start to a later
+ * unrelated one: an unhandled key is done at its reply, the preedit update
+ * of a handled key arrives before the reply to the next key
+ */
+static void
+_fcitx_im_context_key_answered(FcitxIMContext* fcitxcontext, ClutterKeyEvent* event, gint64 start, int ret, gboolean done)
+{
+    if (event->type == CLUTTER_KEY_PRESS && start == fcitxcontext->key_start) {
+        if (ret > 0 && !done) {
+            fcitxcontext->key_answered = TRUE;
+            return;
+        }
+    } else if (!fcitxcontext->key_answered) {
+        return;
+    }
+    fcitxcontext->key_start = 0;
+    fcitxcontext->key_answered = FALSE;
+}
+
+/*
+ * the first visible change after a key: stamp it and wait for the paint
+ * of the stage showing it, later changes of the same key are not counted
+ */
+void
+_fcitx_im_context_latency_changed(FcitxIMContext* fcitxcontext)
+{
+    ClutterIMContext* context = CLUTTER_IM_CONTEXT(fcitxcontext);
+    ClutterActor* stage;
+
+    if (!fcitxcontext->key_start)
+        return;
+
+    FcitxLatencyHistogramAdd(&fcitxcontext->latency[FCITX_IM_CONTEXT_LATENCY_CHANGE],
+                             g_get_monotonic_time() - fcitxcontext->key_start);
+    fcitxcontext->paint_start = fcitxcontext->key_start;
+    fcitxcontext->key_start = 0;
+    fcitxcontext->key_answered = FALSE;
+
+    if (context->actor == NULL)
+        return;
+    stage = clutter_actor_get_stage(context->actor);
+    if (stage == NULL || stage == fcitxcontext->paint_stage)
+        return;
+
+    _fcitx_im_context_latency_unhook(fcitxcontext);
+    fcitxcontext->paint_stage = stage;
+    g_object_add_weak_pointer(G_OBJECT(stage), (gpointer*) &fcitxcontext->paint_stage);
+    fcitxcontext->paint_handler = g_signal_connect_after(stage, "paint",
+                                                         G_CALLBACK(_fcitx_im_context_latency_paint_cb),
+                                                         fcitxcontext);
+}
+
+void
+_fcitx_im_context_latency_paint_cb(ClutterActor* stage, gpointer user_data)
+{
+    FcitxIMContext* fcitxcontext = FCITX_IM_CONTEXT(user_data);
+
+    if (!fcitxcontext->paint_start)
+        return;
+
+    FcitxLatencyHistogramAdd(&fcitxcontext->latency[FCITX_IM_CONTEXT_LATENCY_PAINT],
+                             g_get_monotonic_time() - fcitxcontext->paint_start);
+    fcitxcontext->paint_start = 0;
+}
+
+void
+_fcitx_im_context_latency_unhook(FcitxIMContext* fcitxcontext)
+{
+    if (fcitxcontext->paint_stage == NULL)
+        return;
+
+    g_signal_handler_disconnect(fcitxcontext->paint_stage, fcitxcontext->paint_handler);
+    g_object_remove_weak_pointer(G_OBJECT(fcitxcontext->paint_stage), (gpointer*) &fcitxcontext->paint_stage);
+    fcitxcontext->paint_stage = NULL;
+    fcitxcontext->paint_handler = 0;
+}
+
 // kate: indent-mode cstyle; space-indent on; indent-width 0;
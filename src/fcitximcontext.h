@@ -47,6 +47,7 @@ FcitxIMContext
 *fcitx_im_context_new(void);
 void fcitx_im_context_register_type
 (GTypeModule *type_module);
+void fcitx_im_context_load_settings(void);
 G_END_DECLS
 #endif
 // kate: indent-mode cstyle; space-indent on; indent-width 0;
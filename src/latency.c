@@ -0,0 +1,60 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include "latency.h"
+
+void FcitxLatencyHistogramAdd(FcitxLatencyHistogram* histogram, gint64 usec)
+{
+    guint bucket;
+
+    if (usec < 0)
+        usec = 0;
+
+    bucket = usec ? g_bit_storage((gulong) usec) - 1 : 0;
+    if (bucket >= FCITX_LATENCY_BUCKETS)
+        bucket = FCITX_LATENCY_BUCKETS - 1;
+
+    histogram->buckets[bucket] ++;
+    histogram->count ++;
+    if (usec > histogram->max)
+        histogram->max = usec;
+}
+
+gint64 FcitxLatencyHistogramPercentile(const FcitxLatencyHistogram* histogram, double percent)
+{
+    guint64 rank, seen = 0;
+    guint i;
+
+    if (histogram->count == 0)
+        return 0;
+
+    rank = (guint64) (histogram->count * percent / 100.0 + 0.5);
+    if (rank == 0)
+        rank = 1;
+
+    for (i = 0; i < FCITX_LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            gint64 bound = ((gint64) 2 << i) - 1;
+            return bound < histogram->max ? bound : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
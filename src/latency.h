@@ -0,0 +1,50 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_LATENCY_H
+#define FCITX_LATENCY_H
+
+#include <glib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FCITX_LATENCY_BUCKETS 32
+
+    /**
+     * log2 histogram of microsecond latencies, bucket i counts values in
+     * [2^i, 2^(i+1)) with 0 and 1 in the first one; percentiles are the
+     * upper bound of their bucket, so they are at most 2x pessimistic
+     */
+    typedef struct _FcitxLatencyHistogram {
+        guint64 count;
+        gint64 max;
+        guint64 buckets[FCITX_LATENCY_BUCKETS];
+    } FcitxLatencyHistogram;
+
+    void FcitxLatencyHistogramAdd(FcitxLatencyHistogram* histogram, gint64 usec);
+    gint64 FcitxLatencyHistogramPercentile(const FcitxLatencyHistogram* histogram, double percent);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
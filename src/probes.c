@@ -0,0 +1,30 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include "probes.h"
+
+#ifdef HAVE_SYS_SDT_H
+
+/* raised by perf or bpftrace while they are attached to the probe */
+#define FCITX_CLUTTER_PROBE_DEFINE(name) \
+    unsigned short FCITX_CLUTTER_PROBE_SEMAPHORE(name) __attribute__((section(".probes"))) = 0;
+FCITX_CLUTTER_PROBES(FCITX_CLUTTER_PROBE_DEFINE)
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,86 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_CLUTTER_PROBES_H
+#define FCITX_CLUTTER_PROBES_H
+
+/**
+ * USDT probes in the fcitx_clutter provider, list them with
+ * "perf list sdt_fcitx_clutter:*" or "bpftrace -l 'usdt:im-fcitx.so:*'".
+ *
+ * ic_create(id) ic_destroy(id) ic_reconnect(oldid)
+ * key_in(id, keyval, state, type) key_reply(id, ret, usec)
+ * commit(id, bytes) preedit(id, bytes, cursor)
+ * forward_key(id, keyval, state, type)
+ * startup(phase, usec since g_module_check_init)
+ *
+ * each probe has a semaphore the tracer raises while it is attached, the
+ * arguments are only evaluated then, so strlen() or clock reads in them
+ * cost nothing in normal use; key_reply usec is 0 for keys sent before
+ * the tracer attached
+ */
+
+#include "config.h"
+
+#define FCITX_CLUTTER_PROBES(_) \
+    _(ic_create) _(ic_destroy) _(ic_reconnect) \
+    _(key_in) _(key_reply) \
+    _(commit) _(preedit) _(forward_key) \
+    _(startup)
+
+#ifdef HAVE_SYS_SDT_H
+
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#include <glib.h>
+
+/* sys/sdt.h refers to <provider>_<name>_semaphore, defined in probes.c */
+#define FCITX_CLUTTER_PROBE_SEMAPHORE(name) fcitx_clutter_##name##_semaphore
+#define FCITX_CLUTTER_PROBE_DECLARE(name) \
+    extern unsigned short FCITX_CLUTTER_PROBE_SEMAPHORE(name) __attribute__((section(".probes")));
+FCITX_CLUTTER_PROBES(FCITX_CLUTTER_PROBE_DECLARE)
+
+#define FCITX_CLUTTER_PROBE_ENABLED(name) __builtin_expect(FCITX_CLUTTER_PROBE_SEMAPHORE(name) != 0, 0)
+
+#define FCITX_CLUTTER_PROBE1(name, a) \
+    do { if (FCITX_CLUTTER_PROBE_ENABLED(name)) DTRACE_PROBE1(fcitx_clutter, name, a); } while(0)
+#define FCITX_CLUTTER_PROBE2(name, a, b) \
+    do { if (FCITX_CLUTTER_PROBE_ENABLED(name)) DTRACE_PROBE2(fcitx_clutter, name, a, b); } while(0)
+#define FCITX_CLUTTER_PROBE3(name, a, b, c) \
+    do { if (FCITX_CLUTTER_PROBE_ENABLED(name)) DTRACE_PROBE3(fcitx_clutter, name, a, b, c); } while(0)
+#define FCITX_CLUTTER_PROBE4(name, a, b, c, d) \
+    do { if (FCITX_CLUTTER_PROBE_ENABLED(name)) DTRACE_PROBE4(fcitx_clutter, name, a, b, c, d); } while(0)
+/* start of a key, only taken while key_reply is traced */
+#define FCITX_CLUTTER_PROBE_TIME() (FCITX_CLUTTER_PROBE_ENABLED(key_reply) ? g_get_monotonic_time() : 0)
+#define FCITX_CLUTTER_PROBE_SINCE(start) ((start) ? g_get_monotonic_time() - (start) : 0)
+
+#else
+
+/* arguments are never evaluated, but still count as used */
+#define FCITX_CLUTTER_PROBE1(name, a) do { if (0) { (void) (a); } } while(0)
+#define FCITX_CLUTTER_PROBE2(name, a, b) do { if (0) { (void) (a); (void) (b); } } while(0)
+#define FCITX_CLUTTER_PROBE3(name, a, b, c) do { if (0) { (void) (a); (void) (b); (void) (c); } } while(0)
+#define FCITX_CLUTTER_PROBE4(name, a, b, c, d) do { if (0) { (void) (a); (void) (b); (void) (c); (void) (d); } } while(0)
+#define FCITX_CLUTTER_PROBE_TIME() 0
+#define FCITX_CLUTTER_PROBE_SINCE(start) ((void) (start), 0)
+
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
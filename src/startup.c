@@ -0,0 +1,101 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include "fcitx/fcitx.h"
+#include "fcitx-utils/log.h"
+
+#include "startup.h"
+#include "probes.h"
+
+static const char* phasenames[FCITX_STARTUP_PHASE_LAST] = {
+    "g_module_check_init",
+    "im_module_init",
+    "im_module_create",
+    "FcitxIMClientOpen",
+    "CreateICv2 reply",
+    "first key",
+    "first key reply"
+};
+
+static gint64 phasetime[FCITX_STARTUP_PHASE_LAST];
+static boolean reported = false;
+
+static void FcitxStartupReport(void);
+
+void FcitxStartupMark(FcitxStartupPhase phase)
+{
+    if (G_LIKELY(reported) || phasetime[phase])
+        return;
+
+    phasetime[phase] = g_get_monotonic_time();
+    FCITX_CLUTTER_PROBE2(startup, phase, phasetime[FCITX_STARTUP_CHECK_INIT]
+                         ? phasetime[phase] - phasetime[FCITX_STARTUP_CHECK_INIT] : 0);
+
+    if (phase == FCITX_STARTUP_FIRST_KEY_REPLY) {
+        reported = true;
+        FcitxStartupReport();
+    }
+}
+
+#ifdef FCITX_CLUTTER_BENCH_API
+FCITX_EXPORT_API
+int64_t fcitx_clutter_startup_time(int phase)
+{
+    if (phase < 0 || phase >= FCITX_STARTUP_PHASE_LAST)
+        return 0;
+    return phasetime[phase];
+}
+
+FCITX_EXPORT_API
+void fcitx_clutter_startup_rearm(void)
+{
+    int i;
+
+    for (i = FCITX_STARTUP_CONTEXT_CREATE; i < FCITX_STARTUP_PHASE_LAST; i++)
+        phasetime[i] = 0;
+    reported = false;
+}
+#endif
+
+void FcitxStartupReport(void)
+{
+    const char* timing = getenv("FCITX_CLUTTER_STARTUP_TIMING");
+    gint64 last;
+    int i;
+
+    if (!timing || strcmp(timing, "1") != 0)
+        return;
+
+    last = phasetime[FCITX_STARTUP_CHECK_INIT];
+    for (i = 0; i < FCITX_STARTUP_PHASE_LAST; i++) {
+        /* a phase may be skipped, e.g. no check_init for a static build */
+        if (!phasetime[i])
+            continue;
+        if (!last)
+            last = phasetime[i];
+        FcitxLog(INFO, "startup %-20s +%6" G_GINT64_FORMAT "us total %7" G_GINT64_FORMAT "us",
+                 phasenames[i], phasetime[i] - last,
+                 phasetime[i] - (phasetime[FCITX_STARTUP_CHECK_INIT] ? phasetime[FCITX_STARTUP_CHECK_INIT] : phasetime[i]));
+        last = phasetime[i];
+    }
+}
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
@@ -0,0 +1,71 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_CLUTTER_STARTUP_H
+#define FCITX_CLUTTER_STARTUP_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * milestones between loading the module and the first key the daemon
+     * answered; each is recorded once per process, so the first context is
+     * the cold path and later ones only show up in the ic_create probe
+     */
+    typedef enum _FcitxStartupPhase {
+        FCITX_STARTUP_CHECK_INIT,
+        FCITX_STARTUP_MODULE_INIT,
+        FCITX_STARTUP_CONTEXT_CREATE,
+        FCITX_STARTUP_CLIENT_OPEN,
+        FCITX_STARTUP_IC_CREATED,
+        FCITX_STARTUP_FIRST_KEY,
+        FCITX_STARTUP_FIRST_KEY_REPLY,
+        FCITX_STARTUP_PHASE_LAST
+    } FcitxStartupPhase;
+
+    /**
+     * record a milestone, it fires the startup(phase, usec) probe with the
+     * time since g_module_check_init and, with FCITX_CLUTTER_STARTUP_TIMING=1,
+     * logs the whole breakdown once the first key reply arrived
+     */
+    void FcitxStartupMark(FcitxStartupPhase phase);
+
+#ifdef FCITX_CLUTTER_BENCH_API
+    /**
+     * exported by modules built with ENABLE_BENCHMARKS only, the benchmarks
+     * load the module like an application and look them up: when a phase
+     * was reached in g_get_monotonic_time() units or 0, and forgetting every
+     * phase after im_module_init so the next context records them again
+     */
+    int64_t fcitx_clutter_startup_time(int phase);
+    void fcitx_clutter_startup_rearm(void);
+#endif
+
+    typedef int64_t (*FcitxStartupTimeFunc)(int phase);
+    typedef void (*FcitxStartupRearmFunc)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
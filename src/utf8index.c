@@ -0,0 +1,202 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "utf8index.h"
+
+#define HIGH_BITS UINT64_C(0x8080808080808080)
+
+static size_t FcitxUtf8AsciiPrefix(const char* str, size_t len);
+static int FcitxUtf8SequenceLength(const unsigned char* p, size_t left);
+static boolean FcitxUtf8IndexReserve(FcitxUtf8Index* index, size_t bytes);
+
+void FcitxUtf8IndexInit(FcitxUtf8Index* index)
+{
+    memset(index, 0, sizeof(FcitxUtf8Index));
+    index->ascii = true;
+}
+
+void FcitxUtf8IndexReset(FcitxUtf8Index* index)
+{
+    index->bytes = 0;
+    index->chars = 0;
+    index->ascii = true;
+}
+
+void FcitxUtf8IndexFree(FcitxUtf8Index* index)
+{
+    free(index->bytetochar);
+    free(index->chartobyte);
+    FcitxUtf8IndexInit(index);
+}
+
+/* length of the leading ASCII run, eight bytes per step */
+size_t FcitxUtf8AsciiPrefix(const char* str, size_t len)
+{
+    size_t i = 0;
+    uint64_t word;
+
+    while (i + sizeof(word) <= len) {
+        memcpy(&word, str + i, sizeof(word));
+        if (word & HIGH_BITS)
+            break;
+        i += sizeof(word);
+    }
+    while (i < len && !(str[i] & 0x80))
+        i++;
+    return i;
+}
+
+/* length of the valid sequence at p, 0 if it is malformed */
+int FcitxUtf8SequenceLength(const unsigned char* p, size_t left)
+{
+    if (p[0] < 0x80)
+        return 1;
+
+    if (p[0] >= 0xc2 && p[0] <= 0xdf) {
+        if (left < 2 || (p[1] & 0xc0) != 0x80)
+            return 0;
+        return 2;
+    }
+
+    if (p[0] >= 0xe0 && p[0] <= 0xef) {
+        if (left < 3 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80)
+            return 0;
+        /* overlong and surrogates */
+        if (p[0] == 0xe0 && p[1] < 0xa0)
+            return 0;
+        if (p[0] == 0xed && p[1] > 0x9f)
+            return 0;
+        return 3;
+    }
+
+    if (p[0] >= 0xf0 && p[0] <= 0xf4) {
+        if (left < 4 || (p[1] & 0xc0) != 0x80 || (p[2] & 0xc0) != 0x80 || (p[3] & 0xc0) != 0x80)
+            return 0;
+        /* overlong and beyond U+10FFFF */
+        if (p[0] == 0xf0 && p[1] < 0x90)
+            return 0;
+        if (p[0] == 0xf4 && p[1] > 0x8f)
+            return 0;
+        return 4;
+    }
+
+    return 0;
+}
+
+boolean FcitxUtf8IndexReserve(FcitxUtf8Index* index, size_t bytes)
+{
+    unsigned int* bytetochar;
+    unsigned int* chartobyte;
+
+    if (bytes + 1 <= index->capacity)
+        return true;
+
+    bytetochar = realloc(index->bytetochar, (bytes + 1) * sizeof(unsigned int));
+    if (!bytetochar)
+        return false;
+    index->bytetochar = bytetochar;
+
+    chartobyte = realloc(index->chartobyte, (bytes + 1) * sizeof(unsigned int));
+    if (!chartobyte)
+        return false;
+    index->chartobyte = chartobyte;
+
+    index->capacity = bytes + 1;
+    return true;
+}
+
+boolean FcitxUtf8IndexBuild(FcitxUtf8Index* index, const char* str)
+{
+    size_t len = str ? strlen(str) : 0;
+    size_t ascii = FcitxUtf8AsciiPrefix(str, len);
+    size_t i, ch;
+
+    FcitxUtf8IndexReset(index);
+
+    if (ascii == len) {
+        index->bytes = len;
+        index->chars = len;
+        return true;
+    }
+
+    if (!FcitxUtf8IndexReserve(index, len))
+        return false;
+
+    for (i = 0; i < ascii; i++) {
+        index->bytetochar[i] = i;
+        index->chartobyte[i] = i;
+    }
+
+    ch = ascii;
+    while (i < len) {
+        /* skip ASCII runs in the middle, as in "nihao 你好 ma" */
+        if (!(str[i] & 0x80)) {
+            size_t run = FcitxUtf8AsciiPrefix(str + i, len - i);
+            size_t end = i + run;
+            for (; i < end; i++, ch++) {
+                index->bytetochar[i] = ch;
+                index->chartobyte[ch] = i;
+            }
+            continue;
+        }
+
+        int seq = FcitxUtf8SequenceLength((const unsigned char*) str + i, len - i);
+        if (seq == 0) {
+            FcitxUtf8IndexReset(index);
+            return false;
+        }
+
+        index->chartobyte[ch] = i;
+        /* bytes inside a character map to the character itself */
+        for (; seq > 0; seq--, i++)
+            index->bytetochar[i] = ch;
+        ch++;
+    }
+
+    index->bytetochar[len] = ch;
+    index->chartobyte[ch] = len;
+    index->bytes = len;
+    index->chars = ch;
+    index->ascii = false;
+    return true;
+}
+
+size_t FcitxUtf8IndexByteToChar(const FcitxUtf8Index* index, size_t byte)
+{
+    if (byte > index->bytes)
+        byte = index->bytes;
+    if (index->ascii)
+        return byte;
+    return index->bytetochar[byte];
+}
+
+size_t FcitxUtf8IndexCharToByte(const FcitxUtf8Index* index, size_t ch)
+{
+    if (ch > index->chars)
+        ch = index->chars;
+    if (index->ascii)
+        return ch;
+    return index->chartobyte[ch];
+}
+
+// kate: indent-mode cstyle; space-indent on; indent-width 0;
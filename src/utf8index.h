@@ -0,0 +1,56 @@
+/***************************************************************************
+ *   Copyright (C) 2012~2012 by CSSlayer                                   *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation; either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU General Public License for more details.                          *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this program; if not, write to the                         *
+ *   Free Software Foundation, Inc.,                                       *
+ *   51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.              *
+ ***************************************************************************/
+
+#ifndef FCITX_UTF8_INDEX_H
+#define FCITX_UTF8_INDEX_H
+
+#include <stddef.h>
+#include "fcitx-utils/utils.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /**
+     * byte <-> character offset map of one string, built in a single pass
+     * so later conversions are plain array lookups; pure ASCII strings need
+     * no table at all. The buffers are kept between builds.
+     */
+    typedef struct _FcitxUtf8Index {
+        size_t bytes;
+        size_t chars;
+        boolean ascii;
+        unsigned int* bytetochar;
+        unsigned int* chartobyte;
+        size_t capacity;
+    } FcitxUtf8Index;
+
+    void FcitxUtf8IndexInit(FcitxUtf8Index* index);
+    boolean FcitxUtf8IndexBuild(FcitxUtf8Index* index, const char* str);
+    void FcitxUtf8IndexReset(FcitxUtf8Index* index);
+    void FcitxUtf8IndexFree(FcitxUtf8Index* index);
+    size_t FcitxUtf8IndexByteToChar(const FcitxUtf8Index* index, size_t byte);
+    size_t FcitxUtf8IndexCharToByte(const FcitxUtf8Index* index, size_t ch);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+// kate: indent-mode cstyle; space-indent on; indent-width 0;